@@ -8,8 +8,49 @@
  */
 
 #include "portable.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ac/ctype.h>
+#include <ac/string.h>
+#include <ac/errno.h>
+#include <ac/unistd.h>
+
 #include "slap.h"
 #include "slap-config.h"
+#include "lutil.h"
+
+/* Publish statistics under cn=Monitor whenever slapd was built with the
+   monitor backend, unless AUTOMEMBER_NO_MONITOR is defined: */
+#if defined(SLAPD_MONITOR) && ! defined(AUTOMEMBER_NO_MONITOR)
+#   define AUTOMEMBER_MONITOR
+#   include "back-monitor/back-monitor.h"
+#endif
+
+/* Static tracepoints (USDT) at each stage, for bpftrace or SystemTap to
+   attach to in a running slapd, when AUTOMEMBER_USDT is defined (this
+   needs <sys/sdt.h>, e.g. from systemtap-sdt-dev).  Otherwise each probe
+   compiles to nothing, its arguments included.  The probes are under
+   provider "automember"; README.md lists them with their arguments: */
+#ifdef AUTOMEMBER_USDT
+#   include <sys/sdt.h>
+#   define AUTOMEMBER_PROBE(...)    STAP_PROBEV(automember, __VA_ARGS__)
+#else
+#   define AUTOMEMBER_PROBE(...)
+#endif
+
+/* An internal search, probed either side with what it is for and its base:
+     search__entry(kind, base ndn, scope)
+     search__return(kind, base ndn, rc) */
+#define AUTOMEMBER_BE_SEARCH(rc, kind, op2, rs2) \
+    do { \
+        AUTOMEMBER_PROBE(search__entry, (kind), (op2)->o_req_ndn.bv_val, (op2)->ors_scope); \
+        (rc) = (op2)->o_bd->be_search((op2), (rs2)); \
+        AUTOMEMBER_PROBE(search__return, (kind), (op2)->o_req_ndn.bv_val, (rc)); \
+    } while ( 0 )
 
 /* If no callbacks were specifically selected, enable the response
    callback: */
@@ -50,7 +91,222 @@ automember_memberof_attr_init(void)
     return LDAP_SUCCESS;
 }
 
-/* Per-overlay instance config */
+/* memberOf reverse index:  each group (entry of the 'member' objectClass)
+   is tracked by normalized DN along with its normalized memberUid values,
+   and each memberUid value maps back to the groups that list it: */
+typedef struct automember_idx_group {
+    struct berval           g_dn;
+    struct berval           g_ndn;
+    BerVarray               g_uids;             /* Normalized memberUid values  */
+} automember_idx_group_t;
+
+typedef struct automember_idx_uid {
+    struct berval           u_uid;              /* Normalized memberUid value   */
+    int                     u_ngroups;
+    automember_idx_group_t  **u_groups;
+} automember_idx_uid_t;
+
+typedef struct automember_index {
+    ldap_pvt_thread_rdwr_t  rwlock;
+    int                     is_valid;           /* Non-zero once fully built and
+                                                   not invalidated since        */
+    int                     build_pending;      /* A build is queued or running */
+    unsigned long           generation;         /* Bumped by every write the index
+                                                   follows, so a build that raced
+                                                   one can tell */
+    Avlnode                 *groups;            /* automember_idx_group_t by ndn */
+    Avlnode                 *uids;              /* automember_idx_uid_t by uid  */
+} automember_index_t;
+
+/* Compiled synth template:  the literal text around each "{}" token with
+   lengths precomputed, so expansion never rescans the template string: */
+#define AUTOMEMBER_TOK_ESCAPE       0x01    /* Token sits in an RDN value       */
+#define AUTOMEMBER_TOK_VALUE_START  0x02    /* ...at the start of that value    */
+#define AUTOMEMBER_TOK_VALUE_END    0x04    /* ...at the end of that value      */
+
+/* Characters that must be escaped anywhere in an RDN value (RFC 4514, plus
+   '=' as libldap does): */
+#define AUTOMEMBER_RDN_NEEDESCAPE(c) \
+    ((c) == '"' || (c) == '+' || (c) == ',' || (c) == ';' || (c) == '<' || \
+     (c) == '>' || (c) == '\\' || (c) == '=')
+
+/* How a plain value (see AUTOMEMBER_NTOK_PLAIN) substituted for a token of
+   the normalized template normalizes, so member values can be normalized
+   by splicing rather than by dnNormalize(): */
+#define AUTOMEMBER_NTOK_EXACT       0x01    /* Unchanged (case{Exact,ExactIA5}Match) */
+#define AUTOMEMBER_NTOK_FOLD        0x02    /* Lower-cased (case{Ignore,IgnoreIA5}Match) */
+
+/* Characters every case{Exact,Ignore}{,IA5}Match normalization leaves as
+   they are (bar case) and no RDN value needs escaped: */
+#define AUTOMEMBER_NTOK_PLAIN(c) \
+    (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+     ((c) >= '0' && (c) <= '9') || (c) == '-' || (c) == '.' || (c) == '_')
+
+typedef struct automember_tmpl {
+    int                     n_tokens;
+    ber_len_t               lit_len;            /* Sum of the literal lengths   */
+    struct berval           *lits;              /* n_tokens + 1 literals, any of
+                                                   which may be empty           */
+    unsigned char           *tok_flags;         /* AUTOMEMBER_TOK_* per token   */
+} automember_tmpl_t;
+
+/* Hot-path statistics, published under cn=Monitor.  The counters are
+   bumped with relaxed atomic adds, so they cost no lock; latencies are
+   counted into power-of-two microsecond buckets (bucket b holds times
+   below 2^b us, the last bucket everything beyond): */
+enum {
+    AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED = 0,    /* Entries given member/memberOf    */
+    AUTOMEMBER_STAT_VALUES_EXPANDED,            /* Values through the synth template */
+    AUTOMEMBER_STAT_SOURCE_FETCHES,             /* memberUid re-read from the backend */
+    AUTOMEMBER_STAT_MEMBEROF_SEARCHES,          /* Internal memberOf searches        */
+    AUTOMEMBER_STAT_ENTRY_COPIES,               /* Reply entries duplicated          */
+    AUTOMEMBER_STAT_ENTRY_WRAPS,                /* Reply entries wrapped             */
+    AUTOMEMBER_STAT_RESOLVE_HITS,               /* uids resolved from the cache      */
+    AUTOMEMBER_STAT_RESOLVE_SEARCHES,           /* Internal uid => DN searches       */
+    AUTOMEMBER_STAT_COMPARES,                   /* Compares answered by the overlay  */
+    AUTOMEMBER_STAT_COUNT
+};
+
+enum {
+    AUTOMEMBER_PATH_MEMBER = 0,
+    AUTOMEMBER_PATH_MEMBEROF,
+    AUTOMEMBER_PATH_COUNT
+};
+
+#define AUTOMEMBER_LATENCY_BUCKETS  20
+
+#ifdef AUTOMEMBER_MONITOR
+    typedef struct automember_stats {
+        unsigned long       counters[AUTOMEMBER_STAT_COUNT];
+        unsigned long       latency[AUTOMEMBER_PATH_COUNT][AUTOMEMBER_LATENCY_BUCKETS];
+    } automember_stats_t;
+    
+    typedef struct timespec automember_timer_t;
+    
+#   define AUTOMEMBER_STAT_ADD(am, stat, n) \
+        __atomic_fetch_add(&(am)->st->stats.counters[(stat)], (unsigned long)(n), __ATOMIC_RELAXED)
+#   define AUTOMEMBER_TIMER_START(am, t)        automember_timer_start((am), &(t))
+#   define AUTOMEMBER_TIMER_STOP(am, path, t)   automember_timer_stop((am), (path), &(t))
+#else
+    typedef int automember_timer_t;
+    
+#   define AUTOMEMBER_STAT_ADD(am, stat, n)     ((void)0)
+#   define AUTOMEMBER_TIMER_START(am, t)        ((t) = 0)
+#   define AUTOMEMBER_TIMER_STOP(am, path, t)   ((void)(t))
+#endif
+
+/* How much synthesis a search gets, from the most to the least: */
+enum {
+    AUTOMEMBER_SYNTH_FULL = 0,                  /* Whenever the attribute is requested */
+    AUTOMEMBER_SYNTH_EXPLICIT,                  /* Only when requested by name         */
+    AUTOMEMBER_SYNTH_NONE                       /* Never                               */
+};
+
+/* Kinds of search a policy can be confined to: */
+#define AUTOMEMBER_POLICY_OP_SEARCH     0x1     /* Anything not below                  */
+#define AUTOMEMBER_POLICY_OP_SYNC       0x2     /* Content sync (syncrepl consumers)   */
+#define AUTOMEMBER_POLICY_OP_PAGED      0x4     /* Paged results                       */
+
+/* A synthesis policy:  searches matching every criterion given get p_synth.
+   Policies are tried in the order configured and the first match wins: */
+typedef struct automember_policy {
+    struct automember_policy    *p_next;
+    int                         p_synth;        /* AUTOMEMBER_SYNTH_*                  */
+    struct berval               p_ndn;          /* Bind DN (BER_BVNULL: any)           */
+    int                         p_subtree;      /* ...or any bind DN beneath it        */
+    struct berval               p_peer;         /* Peer name prefix, e.g. "IP=10.1."
+                                                   (BER_BVNULL: any)                   */
+    int                         p_ops;          /* AUTOMEMBER_POLICY_OP_* (0: any)     */
+    struct berval               p_text;         /* As configured                       */
+} automember_policy_t;
+
+/* Entry dispatch:  the rules that apply to an entry, as a mask of
+   AUTOMEMBER_DISPATCH_* and rule bits, found with one pass over its
+   objectClass values: */
+#define AUTOMEMBER_DISPATCH_MEMBER      0x1u    /* member objectClass (or a subclass)   */
+#define AUTOMEMBER_DISPATCH_MEMBEROF    0x2u    /* memberOf objectClass                 */
+#define AUTOMEMBER_RULE_FIRST_BIT       2       /* Additional rules from here on        */
+#define AUTOMEMBER_MAX_RULES            30
+
+/* An additional synthesis rule:  on entries of r_oc, r_target is
+   synthesized from r_src through r_tmpl, as member is from memberUid: */
+typedef struct automember_rule {
+    struct automember_rule  *r_next;
+    unsigned int            r_bit;              /* Its bit in dispatch masks            */
+    ObjectClass             *r_oc;
+    AttributeDescription    *r_src;
+    AttributeDescription    *r_target;
+    char                    *r_tmpl;
+    automember_tmpl_t       r_ctmpl;
+    struct berval           r_text;             /* As configured                        */
+} automember_rule_t;
+
+/* The dispatch mask of each objectClass in the schema, sorted by address: */
+typedef struct automember_dispatch {
+    ObjectClass             *d_oc;
+    unsigned int            d_mask;
+} automember_dispatch_t;
+
+/* uid => DN resolver cache:  each memberUid value's person, found by an
+   internal (uid=<value>) search, or the fact that there is no such person.
+   The cache is split into shards by hash of the uid, each with its own
+   lock, LRU list and share of the configured size: */
+#define AUTOMEMBER_RESOLVE_SHARDS       16
+#define AUTOMEMBER_RESOLVE_CACHE_SIZE   16384   /* Default, over all shards     */
+
+typedef struct automember_resolved {
+    struct automember_resolved  *rv_prev;       /* LRU list, most recently used
+                                                   first                        */
+    struct automember_resolved  *rv_next;
+    struct berval               rv_nuid;        /* uid value, normalized        */
+    struct berval               rv_dn;          /* BER_BVNULL:  no such person  */
+    struct berval               rv_ndn;         /* ...and normalized            */
+} automember_resolved_t;
+
+typedef struct automember_resolve_shard {
+    ldap_pvt_thread_mutex_t     mutex;
+    Avlnode                     *uids;          /* automember_resolved_t by uid */
+    automember_resolved_t       *lru_head;
+    automember_resolved_t       *lru_tail;
+    int                         n_entries;
+    unsigned long               generation;     /* Bumped by every invalidation */
+} automember_resolve_shard_t;
+
+/* A subtree searched for groups when resolving memberOf: */
+typedef struct automember_base {
+    struct automember_base  *b_next;
+    struct berval           b_dn;
+    struct berval           b_ndn;
+    int                     b_scope;
+} automember_base_t;
+
+/* Per-overlay instance state, shared by every configuration snapshot: */
+typedef struct automember_state {
+    automember_index_t      memberof_idx;       /* The memberUid => group DN index   */
+    int                     rebuild_pending;    /* Rebuild once the database opens  */
+    int                     rebuild_running;    /* Rebuilds under way, which need the
+                                                   index kept current          */
+    BackendDB               *be;                /* The database, once open          */
+    automember_resolve_shard_t  resolve_shards[AUTOMEMBER_RESOLVE_SHARDS];
+    struct automember       *conf;              /* The configuration in force       */
+    unsigned int            conf_epoch;         /* Operations count themselves in
+                                                   conf_readers[conf_epoch & 1]     */
+    unsigned long           conf_readers[2];
+    ldap_pvt_thread_mutex_t conf_mutex;         /* Guards the two lists below       */
+    struct automember       *retired;           /* Superseded configurations...     */
+    struct automember       *draining;          /* ...and those superseded before the
+                                                   last epoch flip, freed once
+                                                   conf_readers[drain_slot] empties */
+    int                     drain_slot;
+#ifdef AUTOMEMBER_MONITOR
+    automember_stats_t      stats;
+    struct berval           monitor_ndn;        /* The database's cn=Monitor entry  */
+    monitor_callback_t      *monitor_cb;        /* Non-NULL while registered there  */
+#endif
+} automember_state_t;
+
+/* Per-overlay instance config:  an immutable snapshot once the database
+   is open (see automember_conf_get()) */
 typedef struct automember {
     AttributeDescription    *attr_oc;           /* The objectClass attribute def        */
     AttributeDescription    *attr_memberuid;    /* The attribute whose value(s) are
@@ -66,675 +322,6444 @@ typedef struct automember {
                                                    the reverse-membership attribute     */
     const char              *synth_tmpl;        /* The string template that will be
                                                    used to create the target values    */
+    automember_tmpl_t       synth_ctmpl;        /* synth_tmpl, compiled             */
+    BerVarray               synth_ntmpl;        /* Normalized literal parts of the
+                                                   template, one more than there are
+                                                   tokens (NULL if not a DN template) */
+    unsigned char           *synth_nflags;      /* AUTOMEMBER_NTOK_* per token of
+                                                   synth_ntmpl (NULL:  member values
+                                                   go through dnNormalize())    */
+    int                     use_memberof_idx;   /* Answer memberOf from the reverse
+                                                   index rather than a search       */
+    automember_base_t       *group_bases;       /* Where groups are searched for, in
+                                                   order (NULL: the whole database) */
+    Filter                  *memberof_filter;   /* memberOf lookup filter, parsed
+                                                   with a placeholder uid           */
+    AttributeDescription    *attr_nested;       /* DN-valued attribute by which a
+                                                   group lists the groups nested in
+                                                   it (NULL: no nesting)            */
+    Filter                  *nested_filter;     /* Parent group lookup filter, parsed
+                                                   with a placeholder DN            */
+    int                     materialize;        /* Store member/memberOf rather than
+                                                   synthesizing them on read        */
+    int                     memberof_batch;     /* Person entries whose memberOf is
+                                                   resolved per internal search
+                                                   (search callback only)           */
+    int                     memberof_prefetch;  /* Person entries whose memberOf is
+                                                   looked up ahead on pool threads
+                                                   (search callback only, 0: none) */
+    int                     member_max_values;  /* Most member values in one reply
+                                                   (0: no limit)                    */
+    automember_policy_t     *policies;          /* Synthesis policies, in order     */
+    automember_rule_t       *rules;             /* Additional synthesis rules       */
+    int                     n_rules;
+    automember_dispatch_t   *dispatch;          /* objectClass => rules that apply  */
+    int                     n_dispatch;
+    automember_base_t       *resolve_base;      /* Where people are found by uid for
+                                                   member values (NULL: expand the
+                                                   synth template instead)      */
+    int                     resolve_cache_size; /* Most uids cached (0: none)   */
+    char                    *snapshot_path;     /* Where the memberOf index is saved
+                                                   between runs (NULL: it isn't) */
+    automember_state_t      *st;                /* Shared by every snapshot         */
+    struct automember       *retired_next;
 } automember_t;
 
-/* Relative configuration OIDs */
-enum {
-    CFG_AUTOMEMBER_MEMBER_OBJECTCLASS = 1,
-    CFG_AUTOMEMBER_SYNTHTMPL,
-    CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS
-};
+/* The overlay instance's state, which outlives every snapshot: */
+#define AUTOMEMBER_STATE(on)    ((automember_state_t*)(on)->on_bi.bi_private)
 
-/* Configuration handler: */
-static int
-automember_config(
-    ConfigArgs  *c
+/* The configuration in force.  Operations take it once at the start with
+   automember_conf_get() and use it throughout, without a lock:  once the
+   database is open automember_config() publishes a changed copy in its
+   place rather than changing the one they hold. */
+#define AUTOMEMBER_CONF(on) \
+    ((automember_t*)__atomic_load_n(&AUTOMEMBER_STATE(on)->conf, __ATOMIC_ACQUIRE))
+
+/* Is am still the configuration in force?  Anything built from am and
+   kept beyond the operation (the memberOf index, resolver answers) is
+   kept only if so, checked under the lock the reconfiguration's flush of
+   it takes: */
+#define AUTOMEMBER_CONF_IS_CURRENT(on, am)  (AUTOMEMBER_CONF(on) == (am))
+
+#ifdef AUTOMEMBER_MONITOR
+
+/* Helper: start timing a synthesis path (only while anyone can see it) */
+static void
+automember_timer_start(
+    automember_t        *am,
+    automember_timer_t  *t
 )
 {
-    slap_overinst   *on = (slap_overinst*)c->bi;
-    automember_t    *am = (automember_t*)on->on_bi.bi_private;
-    const char      *text = NULL;
+    if ( am->st->monitor_cb ) {
+        clock_gettime(CLOCK_MONOTONIC, t);
+    } else {
+        t->tv_nsec = -1;
+    }
+}
+
+/* Helper: count the time elapsed since automember_timer_start() */
+static void
+automember_timer_stop(
+    automember_t        *am,
+    int                 path,
+    automember_timer_t  *t
+)
+{
+    struct timespec     now;
+    unsigned long       usec;
+    int                 bucket = 0;
     
-    switch ( c->op ) {
+    if ( t->tv_nsec < 0 ) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usec = (unsigned long)(now.tv_sec - t->tv_sec) * 1000000UL + (now.tv_nsec - t->tv_nsec) / 1000;
+    while ( (bucket < AUTOMEMBER_LATENCY_BUCKETS - 1) && (usec >> bucket) ) bucket++;
+    __atomic_fetch_add(&am->st->stats.latency[path][bucket], 1UL, __ATOMIC_RELAXED);
+}
+
+#endif
+
+static void automember_idx_invalidate(automember_index_t *idx);
+static void automember_idx_schedule(slap_overinst *on, automember_t *am);
+static void automember_rebuild_schedule(slap_overinst *on);
+static void automember_dispatch_build(automember_t *am);
+static void automember_resolve_flush(automember_t *am);
+static void automember_conf_put(slap_overinst *on, int slot);
+static void automember_conf_reclaim(automember_state_t *st);
+
+/* What a search's attribute list asks of the overlay, worked out once per
+   search by automember_attr_req_analyze(): */
+typedef struct automember_attr_req {
+    int                     member;             /* member is to be synthesized
+                                                   (AUTOMEMBER_REQ_* if so)     */
+    int                     memberuid;          /* memberUid comes back with the
+                                                   entry from the backend       */
+    int                     memberof;           /* memberOf is to be synthesized
+                                                   (AUTOMEMBER_REQ_* if so)     */
+    int                     member_range;       /* member was asked for by range
+                                                   ("member;range=<lo>-<hi>")   */
+    int                     range_lo;
+    int                     range_hi;           /* -1:  "*", to the last value  */
+    AttributeDescription    *range_ads;         /* Reply descriptions made for
+                                                   ranges so far (o_tmpmemctx)  */
+    unsigned int            rules;              /* Additional rules whose target
+                                                   is to be synthesized         */
+    unsigned int            rules_named;        /* ...whose target is requested
+                                                   by name                      */
+    unsigned int            rules_src;          /* ...whose source comes back
+                                                   with the entry               */
+} automember_attr_req_t;
+
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+    /* A memberOf lookup run ahead on a pool thread for a held entry.  The
+       search and the pool task each hold a reference; whichever drops the
+       last frees it.  A lookup the pool has yet to start when the search
+       needs the answer is run by the search itself. */
+#   define AUTOMEMBER_PREFETCH_QUEUED   0
+#   define AUTOMEMBER_PREFETCH_RUNNING  1
+#   define AUTOMEMBER_PREFETCH_DONE     2
+    typedef struct automember_prefetch {
+        ldap_pvt_thread_mutex_t mutex;
+        ldap_pvt_thread_cond_t  cond;           /* Signalled when DONE          */
+        int                     state;          /* AUTOMEMBER_PREFETCH_*        */
+        int                     refs;
+        slap_overinst           *on;
+        automember_t            *am;
+        int                     conf_slot;      /* Holds am, as the search does */
+        struct berval           uid;            /* The person's uid (heap)      */
+        BerVarray               dn_list;        /* The answer (heap), once DONE */
+        BerVarray               ndn_list;
+    } automember_prefetch_t;
+
+    /* An entry held back so its memberOf can be resolved with others: */
+    typedef struct automember_held_entry {
+        Entry                   *e;
+        int                     wants_memberof;
+        struct berval           nuid;           /* uid normalized as memberUid */
+        automember_prefetch_t   *pf;            /* Its lookup, when prefetching */
+    } automember_held_entry_t;
+
+    /* Has the lookup for held entry h (if any) finished? */
+#   define AUTOMEMBER_PREFETCH_IS_DONE(h) \
+        (! (h)->pf || __atomic_load_n(&(h)->pf->state, __ATOMIC_ACQUIRE) == AUTOMEMBER_PREFETCH_DONE)
+#endif
+
+/* Per-search state, hung off our callback and also listed in the
+   operation's o_extra so the response handler and helpers can find it: */
+typedef struct automember_search_ctx {
+    slap_callback           sc;                 /* MUST be first */
+    OpExtra                 oe;                 /* oe_key is the overlay instance              */
+    Operation               *op;                /* The search this belongs to                  */
+    slap_overinst           *on;
+    automember_t            *am;                /* The configuration it started with           */
+    int                     conf_slot;          /* ...as held (see automember_conf_get())      */
+    automember_attr_req_t   req;
+    Filter                  *orig_filter;       /* Client's filter, if we rewrote it           */
+    struct berval           orig_filterstr;
+    AttributeName           *orig_attrs;        /* Client's attribute list, if we widened it   */
+    AttributeName           *reply_attrs;       /* ...as replies are checked against, if it
+                                                   names member by range                       */
+    Avlnode                 *nested_parents;    /* Nested group memo:  the parents of each
+                                                   group met so far, by group ndn              */
+    Entry                   *wrap;              /* Wrapper of the entry being sent, if any
+                                                   (see automember_entry_wrap())               */
+    Entry                   *wrap_orig;         /* ...the entry it shares attributes with      */
+    slap_mask_t             wrap_orig_flags;    /* ...and its REP_ENTRY_* flags                */
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+    int                     batch_size;         /* memberOf window (1 = no batching)           */
+    int                     prefetch;           /* Window entries' lookups run ahead, rather
+                                                   than batched                                */
+    int                     is_gone;            /* The client went away:  discard, not send    */
+    int                     n_held;
+    automember_held_entry_t *held;              /* Entries in the order received               */
+#endif
+} automember_search_ctx_t;
+
+/* Helper: the state of the search op, or NULL if the search hook did not
+           attach any (e.g. nothing was asked of the overlay) */
+static automember_search_ctx_t*
+automember_search_ctx_find(
+    Operation       *op,
+    slap_overinst   *on
+)
+{
+    OpExtra         *oex;
     
-        case SLAP_CONFIG_EMIT:
-            break;
-        
-        case LDAP_MOD_DELETE:
-            break;
+    LDAP_SLIST_FOREACH( oex, &op->o_extra, oe_next ) {
+        if ( oex->oe_key == on ) {
+            automember_search_ctx_t *ctx = (automember_search_ctx_t*)((char*)oex - offsetof(automember_search_ctx_t, oe));
             
-        default: {
-            switch ( c->type ) {
-                case CFG_AUTOMEMBER_MEMBER_OBJECTCLASS: {
-                    if ( c->argc != 2 ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                 "automember: automember_config:  expects 'automember-member-objectClass <oc-name>'");
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    }
-                    am->oc_member = oc_find(c->argv[1]);
-                    if ( ! am->oc_member ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                "automember: automember_config:  'member' objectClass '%s' is undefined", c->argv[1]);
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    } else {
-                        Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  automember_config: set 'member' objectClass %s\n", c->argv[1]);
-                    }
-                    break;
-                }
-                
-                case CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS: {
-                    if ( c->argc != 2 ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                 "automember: automember_config:  expects 'automember-memberof-objectClass <oc-name>'");
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    }
-                    am->oc_memberof = oc_find(c->argv[1]);
-                    if ( ! am->oc_memberof ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                "automember: automember_config:  'memberof' objectClass '%s' is undefined", c->argv[1]);
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    } else {
-                        Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  automember_config: set 'memberof' objectClass %s\n", c->argv[1]);
-                    }
-                    break;
-                }
-                
-                case CFG_AUTOMEMBER_SYNTHTMPL: {
-                    const char  *arg_copy;
-                    
-                    if ( c->argc != 2 ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                 "automember: automember_config:  expects 'automember-synth-template <tmpl-string>'");
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    }
-                    arg_copy = ber_strdup(c->argv[1]);
-                    if ( ! arg_copy ) {
-                        snprintf(c->cr_msg, sizeof(c->cr_msg),
-                                 "automember: automember_config:  failed to duplicate template string ");
-                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
-                        return 1;
-                    }
-                    if ( am->synth_tmpl && am->synth_tmpl != automember_default_synth_tmpl ) ch_free((void*)am->synth_tmpl);
-                    am->synth_tmpl = arg_copy;
-                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set synthtmpl %s\n", c->argv[1]);
-                    break;
-                }
-            }
-            break;
+            /* Our internal searches copy the list from the search that
+               started them, but are not that search: */
+            return ( ctx->op == op ) ? ctx : NULL;
         }
-    
     }
-    return 0;
+    return NULL;
 }
 
-static ConfigTable automember_cfg[] = {
-    { "automember-member-objectclass", "oc-name",
-            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBER_OBJECTCLASS, automember_config,
-            "( OLcfgOvAt:100.1 NAME 'olcAutomemberMemberObjectClass' "
-                              "DESC 'Synthesize member attributes on entries of this class' "
-                              "EQUALITY caseIgnoreMatch "
-                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
-            NULL, NULL },
-    { "automember-synth-template", "tmpl-string",
-            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_SYNTHTMPL, automember_config,
-            "( OLcfgOvAt:100.2 NAME 'olcAutomemberSynthTemplate' "
-                              "DESC 'string template for member synthesis' "
-                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
-            NULL, NULL },
-    { "automember-memberof-objectclass", "oc-name",
-            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS, automember_config,
-            "( OLcfgOvAt:100.3 NAME 'olcAutomemberMemberOfObjectClass' "
-                              "DESC 'Synthesize memberOf attribute on entries of this class' "
-                              "EQUALITY caseIgnoreMatch "
-                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
-            NULL, NULL },
-    { NULL, NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL }
-};
+/* Helper: compile a template string into its literals and tokens */
+static void
+automember_tmpl_compile(
+    const char          *tmpl_str,
+    automember_tmpl_t   *tmpl
+)
+{
+    const char          *s, *p;
+    int                 i;
+    
+    memset(tmpl, 0, sizeof(*tmpl));
+    for ( s = tmpl_str; (s = strstr(s, "{}")) != NULL; s += 2 ) tmpl->n_tokens++;
+    tmpl->lits = (struct berval*)ch_calloc(tmpl->n_tokens + 1, sizeof(struct berval));
+    tmpl->tok_flags = (unsigned char*)ch_calloc(tmpl->n_tokens + 1, sizeof(unsigned char));
+    
+    for ( i = 0, s = tmpl_str; ; i++ ) {
+        p = strstr(s, "{}");
+        tmpl->lits[i].bv_len = p ? p - s : strlen(s);
+        tmpl->lits[i].bv_val = (char*)ch_malloc(tmpl->lits[i].bv_len + 1);
+        memcpy(tmpl->lits[i].bv_val, s, tmpl->lits[i].bv_len);
+        tmpl->lits[i].bv_val[tmpl->lits[i].bv_len] = '\0';
+        tmpl->lit_len += tmpl->lits[i].bv_len;
+        if ( ! p ) break;
+        s = p + 2;
+    }
+    
+    /* Values substituted into an RDN value must be escaped: the token is in
+       a value if the literal before it has an '=' after its last ',' or '+'
+       (or has none of those and follows a token that is in a value): */
+    for ( i = 0; i < tmpl->n_tokens; i++ ) {
+        struct berval   *before = &tmpl->lits[i], *after = &tmpl->lits[i + 1];
+        ber_len_t       j = before->bv_len;
+        
+        while ( j > 0 && before->bv_val[j - 1] != '=' && before->bv_val[j - 1] != ',' && before->bv_val[j - 1] != '+' ) j--;
+        if ( j == 0 ) {
+            if ( i > 0 ) tmpl->tok_flags[i] = tmpl->tok_flags[i - 1] & AUTOMEMBER_TOK_ESCAPE;
+        } else if ( before->bv_val[j - 1] == '=' ) {
+            tmpl->tok_flags[i] = AUTOMEMBER_TOK_ESCAPE;
+            if ( j == before->bv_len ) tmpl->tok_flags[i] |= AUTOMEMBER_TOK_VALUE_START;
+        }
+        if ( (tmpl->tok_flags[i] & AUTOMEMBER_TOK_ESCAPE) &&
+             ((after->bv_len == 0 && i + 1 == tmpl->n_tokens) ||
+              (after->bv_len > 0 && (after->bv_val[0] == ',' || after->bv_val[0] == '+'))) )
+        {
+            tmpl->tok_flags[i] |= AUTOMEMBER_TOK_VALUE_END;
+        }
+    }
+    Debug(LDAP_DEBUG_CONFIG, "automember: automember_tmpl_compile:  '%s' has %d token(s), %lu literal byte(s)\n",
+                tmpl_str, tmpl->n_tokens, (unsigned long)tmpl->lit_len);
+}
 
-static ConfigOCs automember_ocs[] = {
-    { "( OLcfgOvOc:100.0 NAME 'olcAutomemberConfig' "
-                      "DESC 'Automember overlay configuration' "
-                      "SUP olcOverlayConfig "
-                      "MAY ( olcAutomemberMemberObjectClass $ olcAutomemberSynthTemplate $ olcAutomemberMemberOfObjectClass ) )",
-            Cft_Overlay, automember_cfg, NULL, NULL },
-    { NULL, 0, NULL }
-};
+static void
+automember_tmpl_free(
+    automember_tmpl_t   *tmpl
+)
+{
+    int                 i;
+    
+    if ( tmpl->lits ) {
+        for ( i = 0; i <= tmpl->n_tokens; i++ ) ch_free(tmpl->lits[i].bv_val);
+        ch_free(tmpl->lits);
+    }
+    ch_free(tmpl->tok_flags);
+    memset(tmpl, 0, sizeof(*tmpl));
+}
 
-/**************************/
+/* A value that survives DN normalization unchanged, used to locate the
+   template tokens in the normalized form of the template: */
+#define AUTOMEMBER_TMPL_PROBE       "automember-tmpl-probe"
 
-/* Helper: transform the source attribute value into the
-           synthesized value */
-static BerValue*
-automember_xform_uid_to_dn(
-    Operation       *op,
-    const char      *tmpl,
-    BerValue        *src_val,
-    BerValue        *out_val
+/* Helper: split the normalized form of a DN template into the literal
+           text around its tokens, so synthesized DNs can be mapped back to
+           the source value.  Returns NULL if the template has no tokens,
+           isn't a DN, or has adjacent tokens (which can't be split). */
+static BerVarray
+automember_synth_ntmpl(
+    const char      *tmpl
 )
 {
-    BerValue        *synth_val = NULL;
-    const char      *s = tmpl;
-    char            *b = NULL, *d;
-    size_t          tmpl_len = strlen(tmpl);
-    size_t          src_val_len = src_val->bv_val ? strlen(src_val->bv_val) : 0;
-    int             n_tokens = 0;
+    struct berval   probe_dn, probe_ndn = BER_BVNULL;
+    BerVarray       segs = NULL;
+    const char      *s;
+    char            *d, *p;
+    int             n_tokens = 0, n_found = 0;
     
-    /* [SPECIAL CASE]  The source value is NULL: */
-    if ( src_val == NULL ) {
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn:  NULL template yields NULL value\n");
+    for ( s = tmpl; (s = strstr(s, "{}")) != NULL; s += 2 ) n_tokens++;
+    if ( n_tokens == 0 ) return NULL;
+    
+    /* Expand the template with the probe value and normalize it: */
+    probe_dn.bv_len = strlen(tmpl) + n_tokens * (STRLENOF(AUTOMEMBER_TMPL_PROBE) - 2);
+    probe_dn.bv_val = d = (char*)ch_malloc(probe_dn.bv_len + 1);
+    for ( s = tmpl; (p = strstr(s, "{}")) != NULL; s = p + 2 ) {
+        d = lutil_strncopy(d, s, p - s);
+        d = lutil_strcopy(d, AUTOMEMBER_TMPL_PROBE);
+    }
+    lutil_strcopy(d, s);
+    if ( dnNormalize(0, NULL, NULL, &probe_dn, &probe_ndn, NULL) != LDAP_SUCCESS ) {
+        Debug(LDAP_DEBUG_CONFIG, "automember: automember_synth_ntmpl:  template '%s' is not a DN\n", tmpl);
+        ch_free(probe_dn.bv_val);
         return NULL;
     }
+    ch_free(probe_dn.bv_val);
     
-    /* [SPECIAL CASE]  If the template is just "{}" then it's
-       just duplication: */
-    if ( strcmp(tmpl, "{}") == 0 ) {
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn:  trivial template duplicates original value\n");
-        return ber_bvdup(src_val);
+    /* Collect the literal text between the probes: */
+    for ( s = probe_ndn.bv_val; (p = strstr(s, AUTOMEMBER_TMPL_PROBE)) != NULL; s = p + STRLENOF(AUTOMEMBER_TMPL_PROBE) ) {
+        struct berval   seg;
+        
+        seg.bv_val = (char*)s;
+        seg.bv_len = p - s;
+        if ( n_found++ && seg.bv_len == 0 ) break;
+        ber_bvarray_add(&segs, ber_dupbv(NULL, &seg));
     }
-    
-    /* For every {} in the template, subtract 2 bytes and add
-       the length of the src value: */
-    while ( s && *s ) {
-        const char  *p = strstr(s, "{}");
+    if ( p == NULL && n_found == n_tokens ) {
+        struct berval   seg;
         
-        if ( p ) {
-            n_tokens++;
-            tmpl_len -= 2;
-            tmpl_len += src_val_len;
-            p += 2;
-        }
-        s = p;
+        ber_str2bv(s, 0, 0, &seg);
+        ber_bvarray_add(&segs, ber_dupbv(NULL, &seg));
+    } else {
+        Debug(LDAP_DEBUG_CONFIG, "automember: automember_synth_ntmpl:  tokens in template '%s' cannot be located after normalization\n", tmpl);
+        ber_bvarray_free(segs);
+        segs = NULL;
     }
+    ch_free(probe_ndn.bv_val);
+    return segs;
+}
+
+/* Helper: the AUTOMEMBER_NTOK_* flags for each token of normalized
+           template segs, or NULL unless every token is the whole value of
+           a single-valued RDN whose attribute matches by one of the
+           case{Exact,Ignore}{,IA5}Match rules */
+static unsigned char*
+automember_synth_nflags(
+    BerVarray               segs
+)
+{
+    unsigned char           *nflags;
+    int                     t, n_tokens;
     
-    /* Allocate and fill-in the string: */
-    b = (char*)ber_memalloc_x(tmpl_len + 1, op->o_tmpmemctx);
-    if ( b ) {
-        s = tmpl;
-        d = b;
-        while ( s && *s ) {
-            char    *s2 = strstr(s, "{}");
-            
-            if ( s2 ) {
-                /* Copy [s,s2-1] into d: */
-                if ( s2 > s ) {
-                    memcpy(d, s, s2 - s);
-                    d += s2 - s;
-                }
-                /* Skip past the "{}" token: */
-                s = s2 + 2;
-                if ( src_val_len ) {
-                    /* Copy the src value into place: */
-                    memcpy(d, src_val->bv_val, src_val_len);
-                    d += src_val_len;
-                }
-                *d = '\0';
-            } else {
-                /* Copy the remainder of s into d: */
-                strcpy(d, s);
-                s = NULL;
-            }
-        }
-        /* The buffer at b now contains the templated C string; create
-           a (duplicated) BerValue out of it: */
-        if ( out_val ) {
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn: using pre-allocated BerValue for result\n");
-            synth_val = out_val;
-            synth_val->bv_len = tmpl_len;
-            synth_val->bv_val = b;
+    if ( ! segs ) return NULL;
+    for ( n_tokens = 0; ! BER_BVISNULL(&segs[n_tokens + 1]); n_tokens++ );
+    nflags = (unsigned char*)ch_calloc(n_tokens + 1, sizeof(unsigned char));
+    
+    for ( t = 0; t < n_tokens; t++ ) {
+        struct berval           *before = &segs[t], *after = &segs[t + 1], type;
+        AttributeDescription    *ad = NULL;
+        MatchingRule            *mr;
+        const char              *text;
+        ber_len_t               j;
+        
+        if ( before->bv_len < 2 || before->bv_val[before->bv_len - 1] != '=' ) break;
+        if ( after->bv_len > 0 && after->bv_val[0] != ',' ) break;
+        j = before->bv_len - 1;
+        while ( j > 0 && before->bv_val[j - 1] != ',' ) j--;
+        type.bv_val = before->bv_val + j;
+        type.bv_len = before->bv_len - 1 - j;
+        
+        /* A multi-valued RDN is sorted by value when normalized: */
+        if ( memchr(type.bv_val, '+', type.bv_len) || memchr(type.bv_val, '=', type.bv_len) ) break;
+        if ( slap_bv2ad(&type, &ad, &text) != LDAP_SUCCESS ) break;
+        if ( (mr = ad->ad_type->sat_equality) == NULL ) break;
+        if ( strcasecmp(mr->smr_cname.bv_val, "caseIgnoreMatch") == 0 ||
+             strcasecmp(mr->smr_cname.bv_val, "caseIgnoreIA5Match") == 0 )
+        {
+            nflags[t] = AUTOMEMBER_NTOK_FOLD;
+        } else if ( strcasecmp(mr->smr_cname.bv_val, "caseExactMatch") == 0 ||
+                    strcasecmp(mr->smr_cname.bv_val, "caseExactIA5Match") == 0 )
+        {
+            nflags[t] = AUTOMEMBER_NTOK_EXACT;
         } else {
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn: allocated new BerValue for result\n");
-            synth_val = ber_str2bv_x(b, 0, 0, NULL, op->o_tmpmemctx);
+            break;
         }
-        
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn: %d token(s) replaced, '%s' => '%s'\n", n_tokens, tmpl, b);
     }
-    return synth_val;
+    if ( t < n_tokens ) {
+        Debug(LDAP_DEBUG_CONFIG, "automember: automember_synth_nflags:  token %d cannot be normalized by splicing\n", t);
+        ch_free(nflags);
+        return NULL;
+    }
+    return nflags;
 }
 
-/* Helper: fetch source attribute via internal search */
-static Attribute*
-automember_fetch_src_attr(
-    Operation               *op,
-    slap_overinst           *on,
+/* Helper: parse "(&(objectClass=<oc>)(<attr>=<probe>))" once, so each
+           lookup need only swap its value in for the probe value (see
+           automember_lookup_filter_fill()) */
+static Filter*
+automember_lookup_filter(
     ObjectClass             *oc,
-    BerValue                *ndn,
-    AttributeDescription    *attr_memberuid
+    AttributeDescription    *attr,
+    const char              *probe
 )
 {
-    Entry                   *e = NULL;
-    Attribute               *src = NULL;
-    Attribute               *ret = NULL;
-    int                     rc;
+    static const char       *filter_fmt = "(&(objectClass=%s)(%s=%s))";
+    struct berval           filter_str;
+    Filter                  *filter;
     
-    /* Read the entry from the underlying backend */
-    rc = overlay_entry_get_ov(op,
-                        ndn,
-                        oc,             /* no filter */
-                        attr_memberuid, /* limit to desired attribute only */
-                        0,              /* rw */
-                        &e,
-                        on);
-    if ( (rc == LDAP_SUCCESS) && (e != NULL) ) {
-        /* Locate the source attribute on the fetched entry (user attrs) */
-        src = attr_find(e->e_attrs, attr_memberuid);
-        if ( src ) {
-            /* Make an independent copy we can return to the caller */
-            ret = attr_dup( src );
-        }
-        /* Always release the fetched entry */
-        overlay_entry_release_ov(op, e, 0, on);
+    filter_str.bv_len = strlen(filter_fmt) - 6 + oc->soc_cname.bv_len + attr->ad_cname.bv_len + strlen(probe);
+    filter_str.bv_val = (char*)ch_malloc(filter_str.bv_len + 1);
+    snprintf(filter_str.bv_val, filter_str.bv_len + 1, filter_fmt, oc->soc_cname.bv_val, attr->ad_cname.bv_val, probe);
+    filter = str2filter(filter_str.bv_val);
+    if ( ! filter || filter->f_choice != LDAP_FILTER_AND ) {
+        Debug(LDAP_DEBUG_CONFIG, "automember: automember_lookup_filter:  unable to parse '%s'\n", filter_str.bv_val);
+        if ( filter ) filter_free(filter);
+        filter = NULL;
     }
-    return ret; /* may be NULL if attr not present */
+    ch_free(filter_str.bv_val);
+    return filter;
 }
 
-static int
-automember_populate_member_attr(
-    Operation           *op,
-    SlapReply           *rs,
-    slap_overinst       *on,
-    automember_t        *am,
-    int                 force_addition
+/* Helper: (re)build the lookup filters that depend on the 'member'
+           objectClass */
+static void
+automember_lookup_filters_build(
+    automember_t            *am
 )
 {
-    int                 rc = SLAP_CB_CONTINUE;
-    Entry               *orig_e = rs->sr_entry, *e = NULL;
-    int                 is_src_attr_requested = 0;
-    int                 is_synth_attr_requested = 0;
-    int                 is_src_operational = is_at_operational(am->attr_memberuid->ad_type) ? 1 : 0;
-    int                 is_synth_operational = is_at_operational(am->attr_member->ad_type) ? 1 : 0;
-    AttributeName       *an = op->ors_attrs;
-    
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  an = %p; attr_is_operational = %d/%d; is_forced = %d\n",
-                an, is_src_operational, is_synth_operational, force_addition);
-    
-    /* There's no point doing anything if the synth attribute wasn't
-       requested: */
-    if ( an == NULL ) {
-        /* NULL ors_attrs implies "all user attributes" were
-           requested, so the source attribute will be present if it
-           is NOT operational, and synth is implied to have been
-           requested if it is NOT operational: */
-        is_synth_attr_requested = ! is_synth_operational;
-        is_src_attr_requested = ! is_src_operational;
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  request is for all user attributes\n");
-    } else {
-        for ( ;
-            an->an_name.bv_val && !(is_synth_attr_requested && is_src_attr_requested) ;
-            an++
-        ) {
-            if ( bvmatch(&an->an_name, &slap_anlist_all_user_attributes[0].an_name) ) {
-                /* All user attributes ("*") requested, update presence booleans
-                   by OR'ing whether or not the attribute is NOT operational: */
-                is_synth_attr_requested |= ! is_synth_operational;
-                is_src_attr_requested |= ! is_src_operational;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  request is for all user attributes\n");
-            }
-            else if ( bvmatch(&an->an_name, &slap_anlist_all_operational_attributes[0].an_name) )
-            {
-                /* All operational attributes ("+") requested, update presence booleans
-                   by OR'ing whether or not the attribute is operational: */
-                is_synth_attr_requested |= is_synth_operational;
-                is_src_attr_requested |= is_src_operational;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  request is for all operational attributes\n");
-            }
-            else if ( an->an_desc == am->attr_memberuid ) {
-                /* The source attribute was explicitly requested: */
-                is_src_attr_requested = 1;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  source attribute explicitly requested\n");
-            }
-            else if ( an->an_desc == am->attr_member ) {
-                /* The synth attribute was explicitly requested: */
-                is_synth_attr_requested = 1;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  synth attribute explicitly requested\n");
-            }
-        }
-    }
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  attr_is_requested = %d/%d\n",
-                is_src_attr_requested, is_synth_attr_requested);
-    if ( force_addition || is_synth_attr_requested ) {
-        Attribute   *src = attr_find(orig_e->e_attrs, am->attr_memberuid);
-        Attribute   *dst = attr_find(orig_e->e_attrs, am->attr_member);
-        
-        if ( ! dst ) {
-            if ( ! is_src_attr_requested ) {
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  fetching source attribute (was not requested)\n");
-                src = automember_fetch_src_attr(op, on, am->oc_member, &orig_e->e_nname, am->attr_memberuid);
-                if ( ! src ) {
-                    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  unable to fetch full object\n");
-                }
-            }
-            /* Add synthesized attribute if we have source values */
-            if ( src ) {
-                if ( src->a_vals ) {
-                    int         attr_idx, out_idx;
-                    BerVarray   dst_vals = NULL;
-                    
-                    /* Count the number of attributes we're going to transform: */
-                    for ( attr_idx=0; src->a_vals[attr_idx].bv_val; attr_idx++ );
-                    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  source attribute located, %d value(s)\n", attr_idx);
-                    
-                    /* Allocate the BerVarray: */
-                    dst_vals = (BerVarray)ber_memalloc_x((attr_idx + 1) * sizeof(struct berval), op->o_tmpmemctx);
-                    if ( dst_vals ) {
-                        for ( attr_idx=0, out_idx=0; src->a_vals[attr_idx].bv_val; attr_idx++ ) {
-                            if ( automember_xform_uid_to_dn(op, am->synth_tmpl, &src->a_vals[attr_idx], &dst_vals[out_idx]) ) {
-                                out_idx++;
-                                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  added transform of attribute value '%s'\n",
-                                            src->a_vals[attr_idx].bv_val);
-                            } else {
-                                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  failed to transform attribute value '%s'\n",
-                                            src->a_vals[attr_idx].bv_val);
-                            }
-                        }
-                        if ( out_idx > 0 ) {
-                            /* Set the list terminator sentinel: */
-                            BER_BVZERO(&dst_vals[out_idx]);
-                            
-                            if ( out_idx < attr_idx ) {
-                                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_populate_member_attr:  expected %d value(s), produced %d\n", attr_idx, out_idx);
-                            }
-                            
-                            
-                            /* Add the new attribute: */
-                            e = ( rs->sr_flags & REP_ENTRY_MODIFIABLE ) ? orig_e : entry_dup(orig_e);
-                            if ( attr_merge(e, am->attr_member, dst_vals, NULL) != 0 ) {
-                                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  failed to append member attribute to entry\n");
-                            }
-                            if ( e != orig_e ) {
-                                rs_replace_entry(op, rs, on, e);
-                                rs->sr_flags &= ~REP_ENTRY_MASK;
-                                rs->sr_flags |= REP_ENTRY_MODIFIABLE | REP_ENTRY_MUSTBEFREED;
-                            }
-                        } else {
-                            Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_populate_member_attr:  expected %d value(s), produced none\n", attr_idx);
-                        }
-                        /* Release the value array: */
-                        ber_bvarray_free_x(dst_vals, op->o_tmpmemctx);
-                    } else {
-                        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  failed to allocate member attribute value array\n");
-                    }
-                } else {
-                    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  empty source values list\n");
-                }
-                if ( ! is_src_attr_requested ) attr_free(src);
-            }
-        } else {
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_member_attr:  synth attribute already present in reply payload\n");
-        }
+    if ( am->memberof_filter ) filter_free(am->memberof_filter);
+    am->memberof_filter = automember_lookup_filter(am->oc_member, am->attr_memberuid, AUTOMEMBER_TMPL_PROBE);
+    if ( am->nested_filter ) filter_free(am->nested_filter);
+    am->nested_filter = NULL;
+    if ( am->attr_nested ) {
+        /* The placeholder has to be a DN for a DN-syntax assertion: */
+        am->nested_filter = automember_lookup_filter(am->oc_member, am->attr_nested, "cn=" AUTOMEMBER_TMPL_PROBE);
     }
-    return rc;
 }
 
-struct automember_collect_memberof_context {
-    BerVarray   *dn_list;
-    void        *memctx;
-};
+/* Synthesis policy names, in AUTOMEMBER_SYNTH_* order: */
+static const struct berval automember_synth_names[] = {
+        BER_BVC("full"),
+        BER_BVC("explicit"),
+        BER_BVC("none"),
+        BER_BVNULL
+    };
 
+/* Helper: the AUTOMEMBER_SYNTH_* named by name, or -1 */
 static int
-automember_collect_memberof_dn_per_entry(
-    Operation       *op,
-    SlapReply       *rs
+automember_synth_mode(
+    struct berval   *name
 )
 {
-    struct automember_collect_memberof_context  *sc_ctxt = (struct automember_collect_memberof_context*)op->o_callback->sc_private;
+    int             i;
+    
+    for ( i = 0; ! BER_BVISNULL(&automember_synth_names[i]); i++ ) {
+        if ( name->bv_len == automember_synth_names[i].bv_len &&
+             strncasecmp(name->bv_val, automember_synth_names[i].bv_val, name->bv_len) == 0 ) return i;
+    }
+    return -1;
+}
 
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn_per_entry:  new entry found %p\n", rs->sr_entry);
-    if ( (rs->sr_type == REP_SEARCH) && rs->sr_entry ) {
-        int         n = 0;
-        BerVarray   dn_list = *(sc_ctxt->dn_list);
+/* Helper: release a list of synthesis policies */
+static void
+automember_policies_free(
+    automember_policy_t *p
+)
+{
+    while ( p ) {
+        automember_policy_t *next = p->p_next;
+        
+        if ( p->p_ndn.bv_val ) ch_free(p->p_ndn.bv_val);
+        if ( p->p_peer.bv_val ) ch_free(p->p_peer.bv_val);
+        if ( p->p_text.bv_val ) ch_free(p->p_text.bv_val);
+        ch_free(p);
+        p = next;
+    }
+}
 
-        if (dn_list) while (!BER_BVISNULL(&dn_list[n])) n++;
+/* Helper: release a list of additional synthesis rules */
+static void
+automember_rules_free(
+    automember_rule_t   *r
+)
+{
+    while ( r ) {
+        automember_rule_t   *next = r->r_next;
         
-        /* Reallocate the ber array with an additional slot: */
-        dn_list = (BerVarray)ber_memrealloc_x(dn_list, (n + 2) * sizeof(struct berval), sc_ctxt->memctx);
-        /* Add the new value to the list and set the list terminator sentinel: */
-        ber_dupbv_x(&dn_list[n], &rs->sr_entry->e_name, sc_ctxt->memctx);
-        BER_BVZERO(&dn_list[n+1]);
+        automember_tmpl_free(&r->r_ctmpl);
+        ch_free(r->r_tmpl);
+        if ( r->r_text.bv_val ) ch_free(r->r_text.bv_val);
+        ch_free(r);
+        r = next;
+    }
+}
+
+/* Helper: release a list of search bases */
+static void
+automember_bases_free(
+    automember_base_t   *b
+)
+{
+    while ( b ) {
+        automember_base_t   *next = b->b_next;
         
-        /* On realloc, the dn_list pointer may have changed -- reset
-           it in the callback context struct: */
-        *(sc_ctxt->dn_list) = dn_list;
+        ch_free(b->b_dn.bv_val);
+        ch_free(b->b_ndn.bv_val);
+        ch_free(b);
+        b = next;
     }
-    return LDAP_SUCCESS;
 }
 
-static int
-automember_collect_memberof_dn(
-    Operation           *op,
-    ObjectClass         *oc,
-    struct berval       *uid_value,
-    BerVarray           *out_dn_list
+/* Helper: copy a list of search bases */
+static automember_base_t*
+automember_bases_dup(
+    automember_base_t   *b
 )
 {
-    static const char   *filter_fmt = "(&(objectClass=%s)(memberUid=%s))";
-    slap_overinst       *on = (slap_overinst*)op->o_bd->bd_info;
-    BackendDB           be = *op->o_bd;
-    struct berval       filter_str;
-    Filter              *filter;
-    BerVarray           dn_list = NULL;
-    int                 rc;
+    automember_base_t   *copy = NULL, **bp = &copy;
     
-    /* Start by making sure nothing is returned by default... */    
-    *out_dn_list = NULL;
+    for ( ; b; b = b->b_next ) {
+        *bp = (automember_base_t*)ch_calloc(1, sizeof(automember_base_t));
+        ber_dupbv(&(*bp)->b_dn, &b->b_dn);
+        ber_dupbv(&(*bp)->b_ndn, &b->b_ndn);
+        (*bp)->b_scope = b->b_scope;
+        bp = &(*bp)->b_next;
+    }
+    return copy;
+}
+
+/* Release everything a configuration snapshot owns (but not the state it
+   shares with the others) */
+static void
+automember_conf_free(
+    automember_t        *am
+)
+{
+    if ( am->synth_tmpl && am->synth_tmpl != automember_default_synth_tmpl ) ch_free((void*)am->synth_tmpl);
+    automember_tmpl_free(&am->synth_ctmpl);
+    if ( am->synth_ntmpl ) ber_bvarray_free(am->synth_ntmpl);
+    if ( am->synth_nflags ) ch_free(am->synth_nflags);
+    if ( am->memberof_filter ) filter_free(am->memberof_filter);
+    if ( am->nested_filter ) filter_free(am->nested_filter);
+    automember_bases_free(am->group_bases);
+    automember_policies_free(am->policies);
+    automember_rules_free(am->rules);
+    if ( am->dispatch ) ch_free(am->dispatch);
+    automember_bases_free(am->resolve_base);
+    if ( am->snapshot_path ) ch_free(am->snapshot_path);
+    ch_free(am);
+}
+
+/* A private copy of a configuration snapshot, for a change to be made to
+   while readers go on using the original */
+static automember_t*
+automember_conf_dup(
+    automember_t        *am
+)
+{
+    automember_t        *copy = (automember_t*)ch_malloc(sizeof(automember_t));
+    automember_policy_t *p, **pp;
+    automember_rule_t   *r, **rp;
     
-    /* Preconditions:  uid_value is non-NULL and has a string value. */
-    filter_str.bv_len = strlen(filter_fmt) - 4 + strlen(oc->soc_cname.bv_val) + strlen(uid_value->bv_val);
-    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
-    if ( filter_str.bv_val == NULL ) {
-        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_collect_memberof_dn:  unable to allocate filter berval\n");
-        return LDAP_OTHER;
+    *copy = *am;
+    copy->retired_next = NULL;
+    if ( am->synth_tmpl != automember_default_synth_tmpl ) copy->synth_tmpl = ch_strdup(am->synth_tmpl);
+    automember_tmpl_compile(copy->synth_tmpl, &copy->synth_ctmpl);
+    copy->synth_ntmpl = NULL;
+    if ( am->synth_ntmpl ) ber_bvarray_dup_x(&copy->synth_ntmpl, am->synth_ntmpl, NULL);
+    copy->synth_nflags = automember_synth_nflags(copy->synth_ntmpl);
+    if ( am->memberof_filter ) copy->memberof_filter = filter_dup(am->memberof_filter, NULL);
+    if ( am->nested_filter ) copy->nested_filter = filter_dup(am->nested_filter, NULL);
+    copy->group_bases = automember_bases_dup(am->group_bases);
+    for ( pp = &copy->policies, p = am->policies; p; p = p->p_next, pp = &(*pp)->p_next ) {
+        *pp = (automember_policy_t*)ch_malloc(sizeof(automember_policy_t));
+        **pp = *p;
+        if ( p->p_ndn.bv_val ) ber_dupbv(&(*pp)->p_ndn, &p->p_ndn);
+        if ( p->p_peer.bv_val ) ber_dupbv(&(*pp)->p_peer, &p->p_peer);
+        ber_dupbv(&(*pp)->p_text, &p->p_text);
     }
-    rc = snprintf(filter_str.bv_val, filter_str.bv_len + 1, filter_fmt, oc->soc_cname.bv_val, uid_value->bv_val);
-    if ( rc > filter_str.bv_len ) {
-        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
-        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_collect_memberof_dn:  unexpected overflow of filter berval buffer\n");
-        return LDAP_OTHER;
+    *pp = NULL;
+    for ( rp = &copy->rules, r = am->rules; r; r = r->r_next, rp = &(*rp)->r_next ) {
+        *rp = (automember_rule_t*)ch_malloc(sizeof(automember_rule_t));
+        **rp = *r;
+        (*rp)->r_tmpl = ch_strdup(r->r_tmpl);
+        automember_tmpl_compile((*rp)->r_tmpl, &(*rp)->r_ctmpl);
+        ber_dupbv(&(*rp)->r_text, &r->r_text);
+    }
+    *rp = NULL;
+    if ( am->dispatch ) {
+        copy->dispatch = (automember_dispatch_t*)ch_malloc(am->n_dispatch * sizeof(automember_dispatch_t));
+        memcpy(copy->dispatch, am->dispatch, am->n_dispatch * sizeof(automember_dispatch_t));
     }
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn:  search filter string '%s' created\n", filter_str.bv_val);
+    copy->resolve_base = automember_bases_dup(am->resolve_base);
+    if ( am->snapshot_path ) copy->snapshot_path = ch_strdup(am->snapshot_path);
+    return copy;
+}
+
+/* Relative configuration OIDs */
+enum {
+    CFG_AUTOMEMBER_MEMBER_OBJECTCLASS = 1,
+    CFG_AUTOMEMBER_SYNTHTMPL,
+    CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS,
+    CFG_AUTOMEMBER_MEMBEROF_INDEX,
+    CFG_AUTOMEMBER_MEMBEROF_BATCH,
+    CFG_AUTOMEMBER_GROUP_BASE,
+    CFG_AUTOMEMBER_MATERIALIZE,
+    CFG_AUTOMEMBER_REBUILD,
+    CFG_AUTOMEMBER_MEMBEROF_NESTED,
+    CFG_AUTOMEMBER_MEMBER_MAX_VALUES,
+    CFG_AUTOMEMBER_POLICY,
+    CFG_AUTOMEMBER_RULE,
+    CFG_AUTOMEMBER_RESOLVE,
+    CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE,
+    CFG_AUTOMEMBER_MEMBEROF_SNAPSHOT,
+    CFG_AUTOMEMBER_MEMBEROF_PREFETCH
+};
+
+/* Search scope names, in LDAP_SCOPE_* order: */
+static const char *automember_scope_names[] = { "base", "one", "sub", "children" };
+
+/* Helper: append arg to *bv, space separated and quoted as the config
+           parser expects, so that an emitted value reads back the same */
+static void
+automember_config_arg_append(
+    struct berval   *bv,
+    const char      *arg
+)
+{
+    int             quote = ( *arg == '\0' || strpbrk(arg, " \t\"\\") != NULL );
+    char            *d;
     
-    /* Create the filter from the string: */
-    filter = str2filter_x(op, filter_str.bv_val);
-    if ( filter ) {
-        Operation                                   op2 = *op;
-        SlapReply                                   rs2 = { REP_RESULT };
-        slap_callback                               sc = {0};
-        struct automember_collect_memberof_context  sc_ctxt;
+    bv->bv_val = (char*)ch_realloc(bv->bv_val, bv->bv_len + 2 * strlen(arg) + 4);
+    d = bv->bv_val + bv->bv_len;
+    if ( bv->bv_len ) *d++ = ' ';
+    if ( quote ) *d++ = '"';
+    for ( ; *arg; arg++ ) {
+        if ( *arg == '"' || *arg == '\\' ) *d++ = '\\';
+        *d++ = *arg;
+    }
+    if ( quote ) *d++ = '"';
+    *d = '\0';
+    bv->bv_len = d - bv->bv_val;
+}
+
+/* Helper: a directive's arguments from first on, as configured */
+static void
+automember_config_text(
+    ConfigArgs      *c,
+    int             first,
+    struct berval   *text
+)
+{
+    BER_BVZERO(text);
+    for ( ; first < c->argc; first++ ) automember_config_arg_append(text, c->argv[first]);
+}
+
+/* Helper: emit a search base as "<dn> <scope>" */
+static void
+automember_config_emit_base(
+    ConfigArgs          *c,
+    automember_base_t   *b
+)
+{
+    struct berval       text = BER_BVNULL;
+    
+    automember_config_arg_append(&text, b->b_dn.bv_val);
+    automember_config_arg_append(&text, automember_scope_names[b->b_scope]);
+    ber_bvarray_add(&c->rvalue_vals, &text);
+}
+
+/* cn=config read:  the current value(s) of c->type, or 1 if it has none */
+static int
+automember_config_emit(
+    ConfigArgs      *c,
+    automember_t    *am
+)
+{
+    struct berval   bv;
+    
+    switch ( c->type ) {
+        case CFG_AUTOMEMBER_MEMBER_OBJECTCLASS:
+            if ( ! am->oc_member ) return 1;
+            value_add_one(&c->rvalue_vals, &am->oc_member->soc_cname);
+            break;
         
-        op2.o_bd            = &be;                        /* use current backend */
-        op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+        case CFG_AUTOMEMBER_SYNTHTMPL:
+            if ( ! am->synth_tmpl || am->synth_tmpl == automember_default_synth_tmpl ) return 1;
+            BER_BVZERO(&bv);
+            automember_config_arg_append(&bv, am->synth_tmpl);
+            ber_bvarray_add(&c->rvalue_vals, &bv);
+            break;
         
-        op2.o_tag           = LDAP_REQ_SEARCH;
-        op2.o_req_dn        = op->o_bd->be_suffix[0];
-        op2.o_req_ndn       = op->o_bd->be_nsuffix[0];
-        op2.o_dn            = op->o_bd->be_rootdn;
-        op2.o_ndn           = op->o_bd->be_rootndn;
-        op2.ors_scope       = LDAP_SCOPE_SUBTREE;
-        op2.ors_deref       = LDAP_DEREF_NEVER;
-        op2.ors_slimit      = SLAP_NO_LIMIT;
-        op2.ors_tlimit      = SLAP_NO_LIMIT;
-        op2.ors_attrs       = slap_anlist_no_attrs;      /* DNs only */
-        op2.ors_attrsonly   = 0;
-        op2.o_do_not_cache  = 1;
-        op2.ors_filter      = filter;
-        op2.ors_filterstr   = filter_str;
+        case CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS:
+            if ( ! am->oc_memberof ) return 1;
+            value_add_one(&c->rvalue_vals, &am->oc_memberof->soc_cname);
+            break;
         
-        /* Get our search callback context setup, so we can add DNs to the list: */
-        sc_ctxt.dn_list     = &dn_list;
-        sc_ctxt.memctx      = op->o_tmpmemctx;   /* Use the parent operation's temp context */
-        sc.sc_private       = &sc_ctxt;
-        sc.sc_response      = automember_collect_memberof_dn_per_entry;
-        op2.o_callback      = &sc;
+        case CFG_AUTOMEMBER_MEMBEROF_INDEX:
+            c->value_int = am->use_memberof_idx;
+            break;
         
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn:  search operation initialized\n");
+        case CFG_AUTOMEMBER_MEMBEROF_BATCH:
+            c->value_int = am->memberof_batch;
+            break;
         
-        /* Perform the search: */
-        rc = op2.o_bd->be_search(&op2, &rs2);
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn:  search operation completed (rc=%d)\n", rc);
+        case CFG_AUTOMEMBER_MEMBEROF_PREFETCH:
+            c->value_int = am->memberof_prefetch;
+            break;
         
-        /* Dispose of the filter and operation: */
-        filter_free_x(op, filter, 1);
-        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+        case CFG_AUTOMEMBER_GROUP_BASE: {
+            automember_base_t   *b;
+            
+            if ( ! am->group_bases ) return 1;
+            for ( b = am->group_bases; b; b = b->b_next ) automember_config_emit_base(c, b);
+            break;
+        }
         
-        /* Return the dn_list: */
-        if ( rc == LDAP_SUCCESS ) {
-            *out_dn_list = dn_list;
-        } else {
-            if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+        case CFG_AUTOMEMBER_MATERIALIZE:
+            c->value_int = am->materialize;
+            break;
+        
+        case CFG_AUTOMEMBER_REBUILD:
+            /* A request, not a setting: */
+            return 1;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_NESTED:
+            if ( ! am->attr_nested ) return 1;
+            value_add_one(&c->rvalue_vals, &am->attr_nested->ad_cname);
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBER_MAX_VALUES:
+            c->value_int = am->member_max_values;
+            break;
+        
+        case CFG_AUTOMEMBER_POLICY: {
+            automember_policy_t *p;
+            
+            if ( ! am->policies ) return 1;
+            for ( p = am->policies; p; p = p->p_next ) value_add_one(&c->rvalue_vals, &p->p_text);
+            break;
         }
-    } else {
-        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
-        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_collect_memberof_dn:  unable to allocate filter\n");
-        return LDAP_OTHER;
+        
+        case CFG_AUTOMEMBER_RULE: {
+            automember_rule_t   *r;
+            
+            if ( ! am->rules ) return 1;
+            for ( r = am->rules; r; r = r->r_next ) value_add_one(&c->rvalue_vals, &r->r_text);
+            break;
+        }
+        
+        case CFG_AUTOMEMBER_RESOLVE:
+            if ( ! am->resolve_base ) return 1;
+            automember_config_emit_base(c, am->resolve_base);
+            break;
+        
+        case CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE:
+            c->value_int = am->resolve_cache_size;
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_SNAPSHOT:
+            if ( ! am->snapshot_path ) return 1;
+            BER_BVZERO(&bv);
+            automember_config_arg_append(&bv, am->snapshot_path);
+            ber_bvarray_add(&c->rvalue_vals, &bv);
+            break;
+        
+        default:
+            return 1;
     }
-    return LDAP_SUCCESS;
+    return 0;
 }
 
+/* cn=config delete:  c->type back to its default or, for the ordered
+   directives, value c->valx (all of them if -1) removed */
 static int
-automember_populate_memberof_attr(
-    Operation           *op,
-    SlapReply           *rs,
-    slap_overinst       *on,
-    automember_t        *am,
-    int                 force_addition
+automember_config_delete(
+    ConfigArgs      *c,
+    automember_t    *am
 )
 {
-    int                 rc = SLAP_CB_CONTINUE;
-    Entry               *orig_e = rs->sr_entry, *e = NULL;
-    int                 is_synth_attr_requested = 0;
-    int                 is_synth_operational = is_at_operational(am->attr_memberof->ad_type) ? 1 : 0;
-    AttributeName       *an = op->ors_attrs;
-    
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  an = %p; attr_is_operational = %d; is_forced = %d\n",
-                an, is_synth_operational, force_addition);
-    
-    /* There's no point doing anything if the synth attribute wasn't
-       requested: */
-    if ( an == NULL ) {
-        /* NULL ors_attrs implies "all user attributes" were
-           requested, so the source attribute will be present if it
-           is NOT operational, and synth is implied to have been
-           requested if it is NOT operational: */
-        is_synth_attr_requested = ! is_synth_operational;
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  request is for all user attributes\n");
-    } else {
-        for ( ;
-            an->an_name.bv_val && !is_synth_attr_requested ;
-            an++
-        ) {
-            if ( bvmatch(&an->an_name, &slap_anlist_all_user_attributes[0].an_name) ) {
-                /* All user attributes ("*") requested, update presence booleans
-                   by OR'ing whether or not the attribute is NOT operational: */
-                is_synth_attr_requested |= ! is_synth_operational;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  request is for all user attributes\n");
-            }
-            else if ( bvmatch(&an->an_name, &slap_anlist_all_operational_attributes[0].an_name) )
-            {
-                /* All operational attributes ("+") requested, update presence booleans
-                   by OR'ing whether or not the attribute is operational: */
-                is_synth_attr_requested |= is_synth_operational;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  request is for all operational attributes\n");
-            }
-            else if ( an->an_desc == am->attr_memberof ) {
-                /* The synth attribute was explicitly requested: */
-                is_synth_attr_requested = 1;
-                Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  synth attribute explicitly requested\n");
-            }
-        }
-    }
-    Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  attr_is_requested = %d\n", is_synth_attr_requested);
-    
-    if ( force_addition || is_synth_attr_requested ) {
-        Attribute               *uid = attr_find(orig_e->e_attrs, am->attr_uid);
-        Attribute               *memberof = attr_find(orig_e->e_attrs, am->attr_memberof);
+    int             i;
+    
+    switch ( c->type ) {
+        case CFG_AUTOMEMBER_MEMBER_OBJECTCLASS:
+            am->oc_member = NULL;
+            if ( am->memberof_filter ) filter_free(am->memberof_filter);
+            if ( am->nested_filter ) filter_free(am->nested_filter);
+            am->memberof_filter = am->nested_filter = NULL;
+            automember_dispatch_build(am);
+            automember_idx_invalidate(&am->st->memberof_idx);
+            break;
         
-        if ( memberof == NULL ) {
-            BerVarray               dn_list = NULL;
-            int                     attr_idx;
+        case CFG_AUTOMEMBER_SYNTHTMPL:
+            if ( am->synth_tmpl && am->synth_tmpl != automember_default_synth_tmpl ) ch_free((void*)am->synth_tmpl);
+            am->synth_tmpl = automember_default_synth_tmpl;
+            automember_tmpl_free(&am->synth_ctmpl);
+            automember_tmpl_compile(am->synth_tmpl, &am->synth_ctmpl);
+            if ( am->synth_ntmpl ) ber_bvarray_free(am->synth_ntmpl);
+            am->synth_ntmpl = automember_synth_ntmpl(am->synth_tmpl);
+            if ( am->synth_nflags ) ch_free(am->synth_nflags);
+            am->synth_nflags = automember_synth_nflags(am->synth_ntmpl);
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS:
+            am->oc_memberof = NULL;
+            automember_dispatch_build(am);
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_INDEX:
+            am->use_memberof_idx = 1;
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_BATCH:
+            am->memberof_batch = 1;
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_PREFETCH:
+            am->memberof_prefetch = 0;
+            break;
+        
+        case CFG_AUTOMEMBER_GROUP_BASE: {
+            automember_base_t   **bp = &am->group_bases, *b;
             
-            if ( uid == NULL ) {
-                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO, "automember: automember_populate_memberof_attr:  no memberUid attribute on entry\n");
-                return SLAP_CB_CONTINUE;
-            }
-            if ( ! uid->a_vals || ! uid->a_vals[0].bv_val ) {
-                /* Empty attribute list: */
-                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO, "automember: automember_populate_memberof_attr:  no memberUid attribute values on entry\n");
-                return SLAP_CB_CONTINUE;
+            for ( i = 0; *bp; i++ ) {
+                if ( c->valx < 0 || i == c->valx ) {
+                    b = *bp;
+                    *bp = b->b_next;
+                    b->b_next = NULL;
+                    automember_bases_free(b);
+                } else {
+                    bp = &(*bp)->b_next;
+                }
             }
-            /* Count how many attribute values: */
-            for ( attr_idx=0; uid->a_vals[attr_idx].bv_val; attr_idx++ );
-            if ( attr_idx > 1 ) {
-                /* Too many values in attribute list: */
-                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_populate_memberof_attr:  too many memberUid attribute values (%d)\n", attr_idx);
-                return SLAP_CB_CONTINUE;
+            automember_idx_invalidate(&am->st->memberof_idx);
+            break;
+        }
+        
+        case CFG_AUTOMEMBER_MATERIALIZE:
+            am->materialize = 0;
+            break;
+        
+        case CFG_AUTOMEMBER_REBUILD:
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_NESTED:
+            am->attr_nested = NULL;
+            if ( am->oc_member ) automember_lookup_filters_build(am);
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBER_MAX_VALUES:
+            am->member_max_values = 0;
+            break;
+        
+        case CFG_AUTOMEMBER_POLICY: {
+            automember_policy_t **pp = &am->policies, *p;
+            
+            for ( i = 0; *pp; i++ ) {
+                if ( c->valx < 0 || i == c->valx ) {
+                    p = *pp;
+                    *pp = p->p_next;
+                    p->p_next = NULL;
+                    automember_policies_free(p);
+                } else {
+                    pp = &(*pp)->p_next;
+                }
             }
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_populate_memberof_attr:  lookup group memberships for uid '%s'\n", uid->a_vals[0].bv_val);
+            break;
+        }
+        
+        case CFG_AUTOMEMBER_RULE: {
+            automember_rule_t   **rp = &am->rules, *r;
             
-            /* We're ready to lookup group memberships for this user: */
-            rc = automember_collect_memberof_dn(op, am->oc_member, &uid->a_vals[0], &dn_list);
-            if ( (rc == LDAP_SUCCESS) && dn_list ) {                
-                e = ( rs->sr_flags & REP_ENTRY_MODIFIABLE ) ? orig_e : entry_dup(orig_e);
+            for ( i = 0; *rp; i++ ) {
+                if ( c->valx < 0 || i == c->valx ) {
+                    r = *rp;
+                    *rp = r->r_next;
+                    r->r_next = NULL;
+                    automember_rules_free(r);
+                } else {
+                    rp = &(*rp)->r_next;
+                }
+            }
+            /* The rules that remain take the lowest bits again: */
+            am->n_rules = 0;
+            for ( r = am->rules; r; r = r->r_next ) r->r_bit = 1u << (AUTOMEMBER_RULE_FIRST_BIT + am->n_rules++);
+            automember_dispatch_build(am);
+            break;
+        }
+        
+        case CFG_AUTOMEMBER_RESOLVE:
+            automember_bases_free(am->resolve_base);
+            am->resolve_base = NULL;
+            automember_resolve_flush(am);
+            break;
+        
+        case CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE:
+            am->resolve_cache_size = AUTOMEMBER_RESOLVE_CACHE_SIZE;
+            automember_resolve_flush(am);
+            break;
+        
+        case CFG_AUTOMEMBER_MEMBEROF_SNAPSHOT:
+            if ( am->snapshot_path ) ch_free(am->snapshot_path);
+            am->snapshot_path = NULL;
+            break;
+    }
+    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config_delete:  setting %d reset (value %d)\n", c->type, c->valx);
+    return 0;
+}
+
+/* Apply a directive to am: */
+static int
+automember_config_apply(
+    ConfigArgs      *c,
+    slap_overinst   *on,
+    automember_t    *am
+)
+{
+    const char      *text = NULL;
+    
+    switch ( c->op ) {
+    
+        case SLAP_CONFIG_EMIT:
+            return automember_config_emit(c, am);
+        
+        case LDAP_MOD_DELETE:
+            return automember_config_delete(c, am);
             
-                /* Add the memberOf attributes: */
-                if ( attr_merge(e, am->attr_memberof, dn_list, NULL) != 0 ) {
-                    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  failed to append memberOf attribute to entry\n");
+        default: {
+            switch ( c->type ) {
+                case CFG_AUTOMEMBER_MEMBER_OBJECTCLASS: {
+                    if ( c->argc != 2 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  expects 'automember-member-objectClass <oc-name>'");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->oc_member = oc_find(c->argv[1]);
+                    if ( ! am->oc_member ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                "automember: automember_config:  'member' objectClass '%s' is undefined", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    } else {
+                        Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  automember_config: set 'member' objectClass %s\n", c->argv[1]);
+                    }
+                    automember_lookup_filters_build(am);
+                    automember_dispatch_build(am);
+                    /* Groups are now a different set of entries: */
+                    automember_idx_invalidate(&am->st->memberof_idx);
+                    break;
                 }
-                if ( e != orig_e ) {
-                    rs_replace_entry(op, rs, on, e);
-                    rs->sr_flags &= ~REP_ENTRY_MASK;
-                    rs->sr_flags |= REP_ENTRY_MODIFIABLE | REP_ENTRY_MUSTBEFREED;
-                }                
-                ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+                
+                case CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS: {
+                    if ( c->argc != 2 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  expects 'automember-memberof-objectClass <oc-name>'");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->oc_memberof = oc_find(c->argv[1]);
+                    if ( ! am->oc_memberof ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                "automember: automember_config:  'memberof' objectClass '%s' is undefined", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    } else {
+                        Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  automember_config: set 'memberof' objectClass %s\n", c->argv[1]);
+                    }
+                    automember_dispatch_build(am);
+                    break;
+                }
+                
+                case CFG_AUTOMEMBER_SYNTHTMPL: {
+                    const char  *arg_copy;
+                    
+                    if ( c->argc != 2 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  expects 'automember-synth-template <tmpl-string>'");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    arg_copy = ber_strdup(c->argv[1]);
+                    if ( ! arg_copy ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  failed to duplicate template string ");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    if ( am->synth_tmpl && am->synth_tmpl != automember_default_synth_tmpl ) ch_free((void*)am->synth_tmpl);
+                    am->synth_tmpl = arg_copy;
+                    automember_tmpl_free(&am->synth_ctmpl);
+                    automember_tmpl_compile(am->synth_tmpl, &am->synth_ctmpl);
+                    if ( am->synth_ntmpl ) ber_bvarray_free(am->synth_ntmpl);
+                    am->synth_ntmpl = automember_synth_ntmpl(am->synth_tmpl);
+                    if ( am->synth_nflags ) ch_free(am->synth_nflags);
+                    am->synth_nflags = automember_synth_nflags(am->synth_ntmpl);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set synthtmpl %s\n", c->argv[1]);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBEROF_INDEX: {
+                    am->use_memberof_idx = c->value_int;
+                    if ( ! am->use_memberof_idx ) automember_idx_invalidate(&am->st->memberof_idx);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set memberof index %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBEROF_BATCH: {
+                    if ( c->value_int < 1 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  'automember-memberof-batch' must be at least 1");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->memberof_batch = c->value_int;
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set memberof batch %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBEROF_PREFETCH: {
+                    if ( c->value_int < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  'automember-memberof-prefetch' must not be negative");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+#ifndef AUTOMEMBER_CALLBACK_SEARCH
+                    if ( c->value_int > 0 ) {
+                        Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  'automember-memberof-prefetch' has no effect without the search callback\n");
+                    }
+#endif
+                    am->memberof_prefetch = c->value_int;
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set memberof prefetch %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_GROUP_BASE: {
+                    automember_base_t   *b, **bp;
+                    struct berval       dn, pdn, ndn;
+                    int                 scope = LDAP_SCOPE_SUBTREE, i;
+                    
+                    if ( c->argc == 3 && (scope = ldap_pvt_str2scope(c->argv[2])) < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  unknown scope '%s' (expects base, one, sub or children)", c->argv[2]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    ber_str2bv(c->argv[1], 0, 0, &dn);
+                    if ( dnPrettyNormal(NULL, &dn, &pdn, &ndn, NULL) != LDAP_SUCCESS ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  invalid group base DN '%s'", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    for ( i = 0; c->be->be_nsuffix && ! BER_BVISNULL(&c->be->be_nsuffix[i]); i++ ) {
+                        if ( dnIsSuffix(&ndn, &c->be->be_nsuffix[i]) ) break;
+                    }
+                    if ( ! c->be->be_nsuffix || BER_BVISNULL(&c->be->be_nsuffix[i]) ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  group base '%s' is not within this database", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        ch_free(pdn.bv_val);
+                        ch_free(ndn.bv_val);
+                        return 1;
+                    }
+                    /* Overlapping bases would return the same group twice: */
+                    for ( bp = &am->group_bases; *bp; bp = &(*bp)->b_next ) {
+                        if ( dnIsSuffix(&ndn, &(*bp)->b_ndn) || dnIsSuffix(&(*bp)->b_ndn, &ndn) ) {
+                            snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                     "automember: automember_config:  group base '%s' overlaps '%s'", c->argv[1], (*bp)->b_dn.bv_val);
+                            Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                            ch_free(pdn.bv_val);
+                            ch_free(ndn.bv_val);
+                            return 1;
+                        }
+                    }
+                    b = (automember_base_t*)ch_calloc(1, sizeof(automember_base_t));
+                    b->b_dn = pdn;
+                    b->b_ndn = ndn;
+                    b->b_scope = scope;
+                    *bp = b;
+                    /* Groups are now a different set of entries: */
+                    automember_idx_invalidate(&am->st->memberof_idx);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  added group base %s (scope %d)\n", pdn.bv_val, scope);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MATERIALIZE: {
+                    am->materialize = c->value_int;
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set materialize %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_REBUILD: {
+                    if ( c->value_int ) automember_rebuild_schedule(on);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  rebuild %s\n", c->value_int ? "requested" : "not requested");
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBEROF_NESTED: {
+                    AttributeDescription    *ad = NULL;
+                    
+                    if ( slap_str2ad(c->argv[1], &ad, &text) != LDAP_SUCCESS ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  nested group attribute '%s' is undefined (%s)", c->argv[1], text);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    /* Must be stored on the group and hold DNs: */
+                    if ( ad == am->attr_member || ad == am->attr_memberof || ! is_at_syntax(ad->ad_type, SLAPD_DN_SYNTAX) ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  nested group attribute '%s' must be a stored attribute of DN syntax", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->attr_nested = ad;
+                    if ( am->oc_member ) automember_lookup_filters_build(am);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set nested group attribute %s\n", c->argv[1]);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBER_MAX_VALUES: {
+                    if ( c->value_int < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  'automember-member-max-values' must be at least 0");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->member_max_values = c->value_int;
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set member max values %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_POLICY: {
+                    automember_policy_t *p, **pp;
+                    struct berval       arg;
+                    int                 i;
+                    
+                    ber_str2bv(c->argv[1], 0, 0, &arg);
+                    p = (automember_policy_t*)ch_calloc(1, sizeof(automember_policy_t));
+                    automember_config_text(c, 1, &p->p_text);
+                    if ( (p->p_synth = automember_synth_mode(&arg)) < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  unknown policy '%s' (expects full, explicit or none)", c->argv[1]);
+                        goto policy_fail;
+                    }
+                    for ( i = 2; i < c->argc; i++ ) {
+                        char    *v = strchr(c->argv[i], '=');
+                        
+                        if ( v == NULL ) {
+                            snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                     "automember: automember_config:  malformed policy criterion '%s'", c->argv[i]);
+                            goto policy_fail;
+                        }
+                        v++;
+                        if ( ! strncasecmp(c->argv[i], "dn=", 3) || ! strncasecmp(c->argv[i], "dn.exact=", 9) || ! strncasecmp(c->argv[i], "dn.subtree=", 11) ) {
+                            struct berval   dn;
+                            
+                            ber_str2bv(v, 0, 0, &dn);
+                            if ( p->p_ndn.bv_val || dnNormalize(0, NULL, NULL, &dn, &p->p_ndn, NULL) != LDAP_SUCCESS ) {
+                                snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                         "automember: automember_config:  invalid or repeated policy DN '%s'", c->argv[i]);
+                                goto policy_fail;
+                            }
+                            p->p_subtree = ! strncasecmp(c->argv[i], "dn.subtree=", 11);
+                        }
+                        else if ( ! strncasecmp(c->argv[i], "peer=", 5) && *v && ! p->p_peer.bv_val ) {
+                            ber_str2bv(v, 0, 1, &p->p_peer);
+                        }
+                        else if ( ! strncasecmp(c->argv[i], "op=", 3) ) {
+                            char    *tok, *next;
+                            
+                            for ( tok = v; tok && *tok; tok = next ) {
+                                if ( (next = strchr(tok, ',')) != NULL ) *next++ = '\0';
+                                if ( ! strcasecmp(tok, "search") ) p->p_ops |= AUTOMEMBER_POLICY_OP_SEARCH;
+                                else if ( ! strcasecmp(tok, "sync") ) p->p_ops |= AUTOMEMBER_POLICY_OP_SYNC;
+                                else if ( ! strcasecmp(tok, "paged") ) p->p_ops |= AUTOMEMBER_POLICY_OP_PAGED;
+                                else {
+                                    snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                             "automember: automember_config:  unknown policy operation '%s' (expects search, sync or paged)", tok);
+                                    goto policy_fail;
+                                }
+                            }
+                        }
+                        else {
+                            snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                     "automember: automember_config:  unknown or repeated policy criterion '%s'", c->argv[i]);
+                            goto policy_fail;
+                        }
+                    }
+                    for ( pp = &am->policies; *pp; pp = &(*pp)->p_next );
+                    *pp = p;
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  added policy %s (%d criteria)\n", c->argv[1], c->argc - 2);
+                    break;
+                    
+policy_fail:
+                    Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                    automember_policies_free(p);
+                    return 1;
+                }
+
+                case CFG_AUTOMEMBER_RULE: {
+                    automember_rule_t       *r, **rp;
+                    ObjectClass             *oc = oc_find(c->argv[1]);
+                    AttributeDescription    *src = NULL, *target = NULL;
+                    
+                    if ( ! oc ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  rule objectClass '%s' is undefined", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    if ( slap_str2ad(c->argv[2], &src, &text) != LDAP_SUCCESS || slap_str2ad(c->argv[4], &target, &text) != LDAP_SUCCESS ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  rule attribute '%s' is undefined (%s)", src ? c->argv[4] : c->argv[2], text);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    /* The target is synthesized, so it can be none of the
+                       attributes the overlay reads or writes itself: */
+                    if ( target == src || target == am->attr_member || target == am->attr_memberof ||
+                         target == am->attr_memberuid || target == am->attr_oc )
+                    {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  rule target attribute '%s' is already in use", c->argv[4]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    if ( am->n_rules == AUTOMEMBER_MAX_RULES ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  at most %d rules may be configured", AUTOMEMBER_MAX_RULES);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    r = (automember_rule_t*)ch_calloc(1, sizeof(automember_rule_t));
+                    r->r_bit = 1u << (AUTOMEMBER_RULE_FIRST_BIT + am->n_rules++);
+                    r->r_oc = oc;
+                    r->r_src = src;
+                    r->r_target = target;
+                    r->r_tmpl = ch_strdup(c->argv[3]);
+                    automember_config_text(c, 1, &r->r_text);
+                    automember_tmpl_compile(r->r_tmpl, &r->r_ctmpl);
+                    for ( rp = &am->rules; *rp; rp = &(*rp)->r_next );
+                    *rp = r;
+                    automember_dispatch_build(am);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  added rule %s: %s => %s\n", c->argv[1], c->argv[2], c->argv[4]);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_RESOLVE: {
+                    struct berval       dn, pdn, ndn;
+                    int                 scope = LDAP_SCOPE_SUBTREE, i;
+                    
+                    if ( c->argc == 3 && (scope = ldap_pvt_str2scope(c->argv[2])) < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  unknown scope '%s' (expects base, one, sub or children)", c->argv[2]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    ber_str2bv(c->argv[1], 0, 0, &dn);
+                    if ( dnPrettyNormal(NULL, &dn, &pdn, &ndn, NULL) != LDAP_SUCCESS ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  invalid resolve base DN '%s'", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    for ( i = 0; c->be->be_nsuffix && ! BER_BVISNULL(&c->be->be_nsuffix[i]); i++ ) {
+                        if ( dnIsSuffix(&ndn, &c->be->be_nsuffix[i]) ) break;
+                    }
+                    if ( ! c->be->be_nsuffix || BER_BVISNULL(&c->be->be_nsuffix[i]) ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  resolve base '%s' is not within this database", c->argv[1]);
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        ch_free(pdn.bv_val);
+                        ch_free(ndn.bv_val);
+                        return 1;
+                    }
+                    if ( ! am->resolve_base ) {
+                        am->resolve_base = (automember_base_t*)ch_calloc(1, sizeof(automember_base_t));
+                    } else {
+                        ch_free(am->resolve_base->b_dn.bv_val);
+                        ch_free(am->resolve_base->b_ndn.bv_val);
+                    }
+                    am->resolve_base->b_dn = pdn;
+                    am->resolve_base->b_ndn = ndn;
+                    am->resolve_base->b_scope = scope;
+                    /* Answers found under the old base no longer hold: */
+                    automember_resolve_flush(am);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set resolve base %s (scope %d)\n", pdn.bv_val, scope);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE: {
+                    if ( c->value_int < 0 ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  'automember-resolve-cache-size' must be at least 0");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    am->resolve_cache_size = c->value_int;
+                    automember_resolve_flush(am);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set resolve cache size %d\n", c->value_int);
+                    break;
+                }
+
+                case CFG_AUTOMEMBER_MEMBEROF_SNAPSHOT: {
+                    if ( ! *c->argv[1] ) {
+                        snprintf(c->cr_msg, sizeof(c->cr_msg),
+                                 "automember: automember_config:  expects 'automember-memberof-snapshot <path>'");
+                        Debug(LDAP_DEBUG_CONFIG, "%s\n", c->cr_msg);
+                        return 1;
+                    }
+                    if ( am->snapshot_path ) ch_free(am->snapshot_path);
+                    am->snapshot_path = ch_strdup(c->argv[1]);
+                    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  set memberOf snapshot file %s\n", am->snapshot_path);
+                    break;
+                }
+            }
+            break;
+        }
+    
+    }
+    return 0;
+}
+
+/* Configuration handler:  until the database opens nothing reads the
+   configuration, so it is changed in place.  After that each change is
+   made to a private copy, which then replaces the snapshot that readers
+   pick up (see AUTOMEMBER_CONF()).  The old one may still be in use by
+   operations under way, so it is retired rather than released, and freed
+   once they have finished (see automember_conf_reclaim()). */
+static int
+automember_config(
+    ConfigArgs      *c
+)
+{
+    slap_overinst   *on = (slap_overinst*)c->bi;
+    automember_t    *cur = AUTOMEMBER_CONF(on), *am = cur;
+    int             rc;
+    
+    if ( c->op == SLAP_CONFIG_EMIT ) return automember_config_apply(c, on, cur);
+    
+    if ( cur->st->be ) am = automember_conf_dup(cur);
+    rc = automember_config_apply(c, on, am);
+    if ( am == cur ) return rc;
+    if ( rc != 0 ) {
+        automember_conf_free(am);
+        return rc;
+    }
+    
+    __atomic_store_n(&am->st->conf, am, __ATOMIC_RELEASE);
+    ldap_pvt_thread_mutex_lock(&am->st->conf_mutex);
+    cur->retired_next = am->st->retired;
+    am->st->retired = cur;
+    ldap_pvt_thread_mutex_unlock(&am->st->conf_mutex);
+    
+    /* Operations that took the old snapshot may have rebuilt what the
+       change discarded, after it did; anything they built since is kept
+       only while they remain current, so discarding it again now leaves
+       nothing of the old configuration behind: */
+    switch ( c->type ) {
+        case CFG_AUTOMEMBER_MEMBER_OBJECTCLASS:
+        case CFG_AUTOMEMBER_MEMBEROF_INDEX:
+        case CFG_AUTOMEMBER_GROUP_BASE:
+            automember_idx_invalidate(&am->st->memberof_idx);
+            break;
+        
+        case CFG_AUTOMEMBER_RESOLVE:
+        case CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE:
+            automember_resolve_flush(am);
+            break;
+    }
+    automember_conf_reclaim(am->st);
+    Debug(LDAP_DEBUG_CONFIG, "automember: automember_config:  configuration snapshot replaced\n");
+    return 0;
+}
+
+/* Snapshot reclamation is by epochs:  each operation counts itself, for
+   as long as it holds a snapshot, in the slot of the epoch it started
+   in.  To free what has been superseded, the epoch is flipped:  every
+   operation that could have taken a superseded snapshot is then counted
+   in the old slot, which new operations no longer join, so it drains
+   even on a busy server.  Whoever empties it frees the lot.  (The
+   values of a multi-valued change each supersede a snapshot; they drain
+   together.) */
+
+/* Take the configuration in force for an operation (or pool task), to be
+   given back with automember_conf_put(on, *slot) when it is done */
+static automember_t*
+automember_conf_get(
+    slap_overinst       *on,
+    int                 *slot
+)
+{
+    automember_state_t  *st = AUTOMEMBER_STATE(on);
+    unsigned int        epoch;
+    
+    for ( ;; ) {
+        epoch = __atomic_load_n(&st->conf_epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&st->conf_readers[epoch & 1], 1UL, __ATOMIC_SEQ_CST);
+        if ( __atomic_load_n(&st->conf_epoch, __ATOMIC_SEQ_CST) == epoch ) break;
+        /* Flipped meanwhile:  count in the new slot instead */
+        automember_conf_put(on, epoch & 1);
+    }
+    *slot = epoch & 1;
+    return AUTOMEMBER_CONF(on);
+}
+
+/* Take another hold on the snapshot an operation holds in slot, for
+   something that may outlive the operation */
+#define automember_conf_hold(on, slot) \
+    __atomic_fetch_add(&AUTOMEMBER_STATE(on)->conf_readers[(slot)], 1UL, __ATOMIC_SEQ_CST)
+
+/* Free what has been superseded, as far as the operations under way
+   allow:  the draining snapshots once their slot has emptied, then the
+   retired ones, after flipping the epoch for their holders to drain in
+   turn */
+static void
+automember_conf_reclaim(
+    automember_state_t  *st
+)
+{
+    automember_t        *am;
+    
+    ldap_pvt_thread_mutex_lock(&st->conf_mutex);
+    for ( ;; ) {
+        if ( st->draining ) {
+            if ( __atomic_load_n(&st->conf_readers[st->drain_slot], __ATOMIC_SEQ_CST) != 0 ) break;
+            while ( (am = st->draining) != NULL ) {
+                __atomic_store_n(&st->draining, am->retired_next, __ATOMIC_SEQ_CST);
+                automember_conf_free(am);
+            }
+        }
+        if ( ! st->retired ) break;
+        st->drain_slot = st->conf_epoch & 1;
+        __atomic_store_n(&st->draining, st->retired, __ATOMIC_SEQ_CST);
+        st->retired = NULL;
+        __atomic_store_n(&st->conf_epoch, st->conf_epoch + 1, __ATOMIC_SEQ_CST);
+    }
+    ldap_pvt_thread_mutex_unlock(&st->conf_mutex);
+}
+
+static void
+automember_conf_put(
+    slap_overinst       *on,
+    int                 slot
+)
+{
+    automember_state_t  *st = AUTOMEMBER_STATE(on);
+    
+    /* The last out of a draining slot frees what it held: */
+    if ( __atomic_sub_fetch(&st->conf_readers[slot], 1UL, __ATOMIC_SEQ_CST) == 0 &&
+         __atomic_load_n(&st->draining, __ATOMIC_SEQ_CST) != NULL )
+    {
+        automember_conf_reclaim(st);
+    }
+}
+
+static ConfigTable automember_cfg[] = {
+    { "automember-member-objectclass", "oc-name",
+            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBER_OBJECTCLASS, automember_config,
+            "( OLcfgOvAt:100.1 NAME 'olcAutomemberMemberObjectClass' "
+                              "DESC 'Synthesize member attributes on entries of this class' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-synth-template", "tmpl-string",
+            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_SYNTHTMPL, automember_config,
+            "( OLcfgOvAt:100.2 NAME 'olcAutomemberSynthTemplate' "
+                              "DESC 'string template for member synthesis' "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-objectclass", "oc-name",
+            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_OBJECTCLASS, automember_config,
+            "( OLcfgOvAt:100.3 NAME 'olcAutomemberMemberOfObjectClass' "
+                              "DESC 'Synthesize memberOf attribute on entries of this class' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-index", "on|off",
+            2, 2, 0, ARG_ON_OFF | ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_INDEX, automember_config,
+            "( OLcfgOvAt:100.4 NAME 'olcAutomemberMemberOfIndex' "
+                              "DESC 'Answer memberOf from an in-memory memberUid index' "
+                              "SYNTAX OMsBoolean SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-batch", "count",
+            2, 2, 0, ARG_INT | ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_BATCH, automember_config,
+            "( OLcfgOvAt:100.5 NAME 'olcAutomemberMemberOfBatch' "
+                              "DESC 'Number of person entries whose memberOf is resolved together' "
+                              "SYNTAX OMsInteger SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-group-base", "dn> <scope",
+            2, 3, 0, ARG_MAGIC | CFG_AUTOMEMBER_GROUP_BASE, automember_config,
+            "( OLcfgOvAt:100.6 NAME 'olcAutomemberGroupBase' "
+                              "DESC 'Subtree searched for groups when resolving memberOf: <dn> [base|one|sub|children]' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString X-ORDERED 'VALUES' )",
+            NULL, NULL },
+    { "automember-materialize", "on|off",
+            2, 2, 0, ARG_ON_OFF | ARG_MAGIC | CFG_AUTOMEMBER_MATERIALIZE, automember_config,
+            "( OLcfgOvAt:100.7 NAME 'olcAutomemberMaterialize' "
+                              "DESC 'Store member and memberOf, maintained on write, rather than synthesize them' "
+                              "SYNTAX OMsBoolean SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-rebuild", "on|off",
+            2, 2, 0, ARG_ON_OFF | ARG_MAGIC | CFG_AUTOMEMBER_REBUILD, automember_config,
+            "( OLcfgOvAt:100.8 NAME 'olcAutomemberRebuild' "
+                              "DESC 'Rewrite the stored member and memberOf values of existing entries' "
+                              "SYNTAX OMsBoolean SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-nested", "attribute",
+            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_NESTED, automember_config,
+            "( OLcfgOvAt:100.9 NAME 'olcAutomemberMemberOfNested' "
+                              "DESC 'DN-valued group attribute listing nested groups; memberOf is expanded through it' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-member-max-values", "count",
+            2, 2, 0, ARG_INT | ARG_MAGIC | CFG_AUTOMEMBER_MEMBER_MAX_VALUES, automember_config,
+            "( OLcfgOvAt:100.10 NAME 'olcAutomemberMemberMaxValues' "
+                              "DESC 'Most member values returned per reply, the rest by range (0 = no limit)' "
+                              "SYNTAX OMsInteger SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-policy", "full|explicit|none> <criteria...",
+            2, 5, 0, ARG_MAGIC | CFG_AUTOMEMBER_POLICY, automember_config,
+            "( OLcfgOvAt:100.11 NAME 'olcAutomemberPolicy' "
+                              "DESC 'Synthesis for matching searches: full|explicit|none [dn[.exact|.subtree]=<dn>] [peer=<prefix>] [op=<ops>]' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString X-ORDERED 'VALUES' )",
+            NULL, NULL },
+    { "automember-rule", "oc-name> <source-attr> <tmpl-string> <target-attr",
+            5, 5, 0, ARG_MAGIC | CFG_AUTOMEMBER_RULE, automember_config,
+            "( OLcfgOvAt:100.12 NAME 'olcAutomemberRule' "
+                              "DESC 'Additional synthesis rule: <oc-name> <source-attr> <tmpl-string> <target-attr>' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString X-ORDERED 'VALUES' )",
+            NULL, NULL },
+    { "automember-resolve", "dn> <scope",
+            2, 3, 0, ARG_MAGIC | CFG_AUTOMEMBER_RESOLVE, automember_config,
+            "( OLcfgOvAt:100.13 NAME 'olcAutomemberResolve' "
+                              "DESC 'Subtree searched by uid for the DNs of members, in place of the synth template: <dn> [base|one|sub|children]' "
+                              "EQUALITY caseIgnoreMatch "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-resolve-cache-size", "count",
+            2, 2, 0, ARG_INT | ARG_MAGIC | CFG_AUTOMEMBER_RESOLVE_CACHE_SIZE, automember_config,
+            "( OLcfgOvAt:100.14 NAME 'olcAutomemberResolveCacheSize' "
+                              "DESC 'Most uid => DN answers cached by the resolver (0 = no caching)' "
+                              "SYNTAX OMsInteger SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-snapshot", "path",
+            2, 2, 0, ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_SNAPSHOT, automember_config,
+            "( OLcfgOvAt:100.15 NAME 'olcAutomemberMemberOfSnapshot' "
+                              "DESC 'File the memberOf index is saved to on shutdown and loaded from on startup' "
+                              "SYNTAX OMsDirectoryString SINGLE-VALUE )",
+            NULL, NULL },
+    { "automember-memberof-prefetch", "count",
+            2, 2, 0, ARG_INT | ARG_MAGIC | CFG_AUTOMEMBER_MEMBEROF_PREFETCH, automember_config,
+            "( OLcfgOvAt:100.16 NAME 'olcAutomemberMemberOfPrefetch' "
+                              "DESC 'Person entries whose memberOf is looked up ahead on pool threads (0 = none)' "
+                              "SYNTAX OMsInteger SINGLE-VALUE )",
+            NULL, NULL },
+    { NULL, NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL }
+};
+
+static ConfigOCs automember_ocs[] = {
+    { "( OLcfgOvOc:100.0 NAME 'olcAutomemberConfig' "
+                      "DESC 'Automember overlay configuration' "
+                      "SUP olcOverlayConfig "
+                      "MAY ( olcAutomemberMemberObjectClass $ olcAutomemberSynthTemplate $ olcAutomemberMemberOfObjectClass $ "
+                            "olcAutomemberMemberOfIndex $ olcAutomemberMemberOfBatch $ olcAutomemberGroupBase $ "
+                            "olcAutomemberMaterialize $ olcAutomemberRebuild $ olcAutomemberMemberOfNested $ "
+                            "olcAutomemberMemberMaxValues $ olcAutomemberPolicy $ olcAutomemberRule $ "
+                            "olcAutomemberResolve $ olcAutomemberResolveCacheSize $ olcAutomemberMemberOfSnapshot $ "
+                            "olcAutomemberMemberOfPrefetch ) )",
+            Cft_Overlay, automember_cfg, NULL, NULL },
+    { NULL, 0, NULL }
+};
+
+/**************************/
+
+/* Helper: number of bytes value v occupies once substituted for a token
+           with the given AUTOMEMBER_TOK_* flags (RFC 4514 escaping) */
+static ber_len_t
+automember_tmpl_value_len(
+    struct berval   *v,
+    unsigned char   flags
+)
+{
+    ber_len_t       len = v->bv_len, i;
+    
+    if ( ! (flags & AUTOMEMBER_TOK_ESCAPE) ) return len;
+    for ( i = 0; i < v->bv_len; i++ ) {
+        unsigned char   c = (unsigned char)v->bv_val[i];
+        
+        if ( c == '\0' ) {
+            len += 2;                               /* "\00"   */
+        } else if ( AUTOMEMBER_RDN_NEEDESCAPE(c) ||
+                    ((flags & AUTOMEMBER_TOK_VALUE_START) && i == 0 && (c == '#' || c == ' ')) ||
+                    ((flags & AUTOMEMBER_TOK_VALUE_END) && i == v->bv_len - 1 && c == ' ') )
+        {
+            len += 1;                               /* "\<c>"  */
+        }
+    }
+    return len;
+}
+
+/* Helper: copy value v into d as substituted for a token; returns the
+           byte after the copy */
+static char*
+automember_tmpl_value_fill(
+    char            *d,
+    struct berval   *v,
+    unsigned char   flags
+)
+{
+    ber_len_t       i;
+    
+    if ( ! (flags & AUTOMEMBER_TOK_ESCAPE) ) {
+        memcpy(d, v->bv_val, v->bv_len);
+        return d + v->bv_len;
+    }
+    for ( i = 0; i < v->bv_len; i++ ) {
+        unsigned char   c = (unsigned char)v->bv_val[i];
+        
+        if ( c == '\0' ) {
+            *d++ = '\\'; *d++ = '0'; *d++ = '0';
+            continue;
+        }
+        if ( AUTOMEMBER_RDN_NEEDESCAPE(c) ||
+             ((flags & AUTOMEMBER_TOK_VALUE_START) && i == 0 && (c == '#' || c == ' ')) ||
+             ((flags & AUTOMEMBER_TOK_VALUE_END) && i == v->bv_len - 1 && c == ' ') )
+        {
+            *d++ = '\\';
+        }
+        *d++ = c;
+    }
+    return d;
+}
+
+/* Helper: transform the source attribute values into the synthesized
+           values.  The returned BerVarray and every value in it share one
+           block allocated from memctx (NULL for the heap):  release it with
+           a single ber_memfree_x(), NOT ber_bvarray_free_x(). */
+static BerVarray
+automember_xform_uid_to_dn(
+    automember_tmpl_t   *tmpl,
+    BerVarray           src_vals,
+    int                 n_vals,
+    void                *memctx
+)
+{
+    BerVarray           dst_vals;
+    ber_len_t           total = (n_vals + 1) * sizeof(struct berval);
+    char                *d;
+    int                 i, t;
+    
+    /* Size every output value (plus its NUL) up front: */
+    for ( i = 0; i < n_vals; i++ ) {
+        total += tmpl->lit_len + 1;
+        for ( t = 0; t < tmpl->n_tokens; t++ ) total += automember_tmpl_value_len(&src_vals[i], tmpl->tok_flags[t]);
+    }
+    dst_vals = (BerVarray)ber_memalloc_x(total, memctx);
+    if ( ! dst_vals ) return NULL;
+    
+    /* The strings follow the array: */
+    d = (char*)&dst_vals[n_vals + 1];
+    for ( i = 0; i < n_vals; i++ ) {
+        dst_vals[i].bv_val = d;
+        for ( t = 0; t < tmpl->n_tokens; t++ ) {
+            if ( tmpl->lits[t].bv_len ) {
+                memcpy(d, tmpl->lits[t].bv_val, tmpl->lits[t].bv_len);
+                d += tmpl->lits[t].bv_len;
+            }
+            d = automember_tmpl_value_fill(d, &src_vals[i], tmpl->tok_flags[t]);
+        }
+        if ( tmpl->lits[t].bv_len ) {
+            memcpy(d, tmpl->lits[t].bv_val, tmpl->lits[t].bv_len);
+            d += tmpl->lits[t].bv_len;
+        }
+        dst_vals[i].bv_len = d - dst_vals[i].bv_val;
+        *d++ = '\0';
+    }
+    BER_BVZERO(&dst_vals[n_vals]);
+    
+    AUTOMEMBER_PROBE(xform, n_vals, total);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_xform_uid_to_dn:  %d value(s) expanded into %lu byte(s)\n", n_vals, (unsigned long)total);
+    return dst_vals;
+}
+
+/* Helper: the normalized forms of the member values synthesized from
+           n_vals uids (vals being those values), in one block allocated
+           from memctx as from automember_xform_uid_to_dn().  A plain uid is
+           spliced between the normalized template literals, folded if its
+           RDN ignores case; only any other goes through dnNormalize().
+           NULL if the template isn't a DN or a value won't normalize. */
+static BerVarray
+automember_member_nvals(
+    automember_t        *am,
+    BerVarray           uids,
+    BerVarray           vals,
+    int                 n_vals,
+    void                *memctx
+)
+{
+    BerVarray           segs = am->synth_ntmpl, nvals = NULL, slow = NULL;
+    ber_len_t           total = (n_vals + 1) * sizeof(struct berval), seg_len = 0, k;
+    char                *d;
+    int                 i, t, n_tokens, n_slow = 0;
+    
+    if ( ! segs ) return NULL;
+    for ( t = 0; ! BER_BVISNULL(&segs[t]); t++ ) seg_len += segs[t].bv_len;
+    n_tokens = t - 1;
+    
+    /* Size the block, normalizing the values that can't be spliced: */
+    for ( i = 0; i < n_vals; i++ ) {
+        struct berval   *uid = &uids[i];
+        
+        for ( k = 0; am->synth_nflags && k < uid->bv_len && AUTOMEMBER_NTOK_PLAIN(uid->bv_val[k]); k++ );
+        if ( uid->bv_len && k == uid->bv_len ) {
+            total += seg_len + n_tokens * uid->bv_len + 1;
+            continue;
+        }
+        if ( ! slow ) slow = (BerVarray)ber_memcalloc_x(n_vals, sizeof(struct berval), memctx);
+        if ( ! slow || dnNormalize(0, NULL, NULL, &vals[i], &slow[i], memctx) != LDAP_SUCCESS ) goto done;
+        total += slow[i].bv_len + 1;
+        n_slow++;
+    }
+    if ( (nvals = (BerVarray)ber_memalloc_x(total, memctx)) == NULL ) goto done;
+    
+    d = (char*)&nvals[n_vals + 1];
+    for ( i = 0; i < n_vals; i++ ) {
+        nvals[i].bv_val = d;
+        if ( slow && ! BER_BVISNULL(&slow[i]) ) {
+            memcpy(d, slow[i].bv_val, slow[i].bv_len);
+            d += slow[i].bv_len;
+        } else {
+            for ( t = 0; t < n_tokens; t++ ) {
+                memcpy(d, segs[t].bv_val, segs[t].bv_len);
+                d += segs[t].bv_len;
+                if ( am->synth_nflags[t] & AUTOMEMBER_NTOK_FOLD ) {
+                    for ( k = 0; k < uids[i].bv_len; k++ ) *d++ = TOLOWER((unsigned char)uids[i].bv_val[k]);
+                } else {
+                    memcpy(d, uids[i].bv_val, uids[i].bv_len);
+                    d += uids[i].bv_len;
+                }
+            }
+            memcpy(d, segs[t].bv_val, segs[t].bv_len);
+            d += segs[t].bv_len;
+        }
+        nvals[i].bv_len = d - nvals[i].bv_val;
+        *d++ = '\0';
+    }
+    BER_BVZERO(&nvals[n_vals]);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_member_nvals:  %d of %d value(s) spliced\n", n_vals - n_slow, n_vals);
+    
+done:
+    if ( slow ) {
+        for ( i = 0; i < n_vals; i++ ) {
+            if ( ! BER_BVISNULL(&slow[i]) ) ber_memfree_x(slow[i].bv_val, memctx);
+        }
+        ber_memfree_x(slow, memctx);
+    }
+    return nvals;
+}
+
+/* Helper: link a new attribute onto the end of e's attribute list, handing
+           it ownership of a heap block from automember_xform_uid_to_dn()
+           and of nvals, another such block holding the normalized values
+           (NULL:  the values serve as their own normalized forms).  No copy
+           is made; attr_free() releases each block with one free() thanks
+           to SLAP_ATTR_DONT_FREE_DATA. */
+static void
+automember_attr_attach(
+    Entry                   *e,
+    AttributeDescription    *ad,
+    BerVarray               vals,
+    BerVarray               nvals,
+    int                     n_vals
+)
+{
+    Attribute               *a = attr_alloc(ad), **ap;
+    
+    a->a_vals = vals;
+    a->a_nvals = nvals ? nvals : vals;
+    a->a_numvals = n_vals;
+    a->a_flags |= SLAP_ATTR_DONT_FREE_DATA;
+    
+    for ( ap = &e->e_attrs; *ap; ap = &(*ap)->a_next );
+    *ap = a;
+}
+
+/**************************/
+
+/* uid => DN resolver:  the synth template can only produce a member's DN
+   if everyone sits in one flat container.  With automember-resolve set,
+   each memberUid value is instead looked up as a uid beneath the
+   configured base, and the entry found (if exactly one) is the member.
+   Answers are cached, so a large group costs a lookup per member rather
+   than a search; the write hooks drop the answers for the uids of any
+   person added, renamed, deleted or given a different uid, and a rename
+   that may move people wholesale flushes the lot.
+
+   A miss searches without the shard lock held; an invalidation meanwhile
+   bumps the shard's generation, and the answer is then not cached (the
+   search may have seen the entry as it was). */
+
+/* Helper: the shard responsible for normalized uid nuid (FNV-1a) */
+static automember_resolve_shard_t*
+automember_resolve_shard(
+    automember_t        *am,
+    struct berval       *nuid
+)
+{
+    unsigned int        h = 2166136261u;
+    ber_len_t           i;
+
+    for ( i = 0; i < nuid->bv_len; i++ ) {
+        h ^= (unsigned char)nuid->bv_val[i];
+        h *= 16777619u;
+    }
+    return &am->st->resolve_shards[h % AUTOMEMBER_RESOLVE_SHARDS];
+}
+
+static int
+automember_resolved_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    const automember_resolved_t     *r1 = v1, *r2 = v2;
+
+    return ber_bvcmp(&r1->rv_nuid, &r2->rv_nuid);
+}
+
+static void
+automember_resolved_free(
+    void            *v
+)
+{
+    automember_resolved_t   *r = (automember_resolved_t*)v;
+
+    ch_free(r->rv_nuid.bv_val);
+    if ( r->rv_dn.bv_val ) ch_free(r->rv_dn.bv_val);
+    if ( r->rv_ndn.bv_val ) ch_free(r->rv_ndn.bv_val);
+    ch_free(r);
+}
+
+/* LRU list maintenance, with the shard locked: */
+static void
+automember_resolve_lru_unlink(
+    automember_resolve_shard_t  *shard,
+    automember_resolved_t       *r
+)
+{
+    if ( r->rv_prev ) r->rv_prev->rv_next = r->rv_next; else shard->lru_head = r->rv_next;
+    if ( r->rv_next ) r->rv_next->rv_prev = r->rv_prev; else shard->lru_tail = r->rv_prev;
+    r->rv_prev = r->rv_next = NULL;
+}
+
+static void
+automember_resolve_lru_push(
+    automember_resolve_shard_t  *shard,
+    automember_resolved_t       *r
+)
+{
+    r->rv_prev = NULL;
+    r->rv_next = shard->lru_head;
+    if ( shard->lru_head ) shard->lru_head->rv_prev = r; else shard->lru_tail = r;
+    shard->lru_head = r;
+}
+
+/* Forget the answer for normalized uid nuid (if there is one) */
+static void
+automember_resolve_invalidate(
+    automember_t        *am,
+    struct berval       *nuid
+)
+{
+    automember_resolve_shard_t  *shard = automember_resolve_shard(am, nuid);
+    automember_resolved_t       key, *r;
+
+    key.rv_nuid = *nuid;
+    ldap_pvt_thread_mutex_lock(&shard->mutex);
+    shard->generation++;
+    if ( (r = (automember_resolved_t*)ldap_avl_delete(&shard->uids, &key, automember_resolved_cmp)) != NULL ) {
+        automember_resolve_lru_unlink(shard, r);
+        shard->n_entries--;
+        automember_resolved_free(r);
+    }
+    ldap_pvt_thread_mutex_unlock(&shard->mutex);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_resolve_invalidate:  uid '%s' %s\n", nuid->bv_val, r ? "dropped" : "not cached");
+}
+
+/* Forget every answer */
+static void
+automember_resolve_flush(
+    automember_t        *am
+)
+{
+    int                 i;
+
+    for ( i = 0; i < AUTOMEMBER_RESOLVE_SHARDS; i++ ) {
+        automember_resolve_shard_t  *shard = &am->st->resolve_shards[i];
+
+        ldap_pvt_thread_mutex_lock(&shard->mutex);
+        shard->generation++;
+        if ( shard->uids ) ldap_avl_free(shard->uids, automember_resolved_free);
+        shard->uids = NULL;
+        shard->lru_head = shard->lru_tail = NULL;
+        shard->n_entries = 0;
+        ldap_pvt_thread_mutex_unlock(&shard->mutex);
+    }
+}
+
+struct automember_resolve_context {
+    struct berval       dn;                 /* The first entry found        */
+    struct berval       ndn;
+    int                 n_found;
+    void                *memctx;
+};
+
+static int
+automember_resolve_per_entry(
+    Operation           *op,
+    SlapReply           *rs
+)
+{
+    struct automember_resolve_context   *ctx = (struct automember_resolve_context*)op->o_callback->sc_private;
+
+    if ( (rs->sr_type == REP_SEARCH) && rs->sr_entry && (ctx->n_found++ == 0) ) {
+        ber_dupbv_x(&ctx->dn, &rs->sr_entry->e_name, ctx->memctx);
+        ber_dupbv_x(&ctx->ndn, &rs->sr_entry->e_nname, ctx->memctx);
+    }
+    return LDAP_SUCCESS;
+}
+
+/* Helper: search the resolve base for the entry with normalized uid nuid.
+           *dn and *ndn get its DN and normalized DN in temp memory, or
+           BER_BVNULL if there is no such entry or more than one.  Returns
+           the search's result code. */
+static int
+automember_resolve_search(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *nuid,
+    struct berval       *dn,
+    struct berval       *ndn
+)
+{
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    SlapReply           rs2 = { REP_RESULT };
+    slap_callback       sc = {0};
+    struct automember_resolve_context   sc_ctxt;
+    Filter              uid_f = { 0 };
+    AttributeAssertion  uid_ava = { 0 };
+    int                 rc;
+
+    /* The value is normalized already, so can go straight into the
+       assertion: */
+    uid_ava.aa_desc     = am->attr_uid;
+    uid_ava.aa_value    = *nuid;
+    uid_f.f_choice      = LDAP_FILTER_EQUALITY;
+    uid_f.f_ava         = &uid_ava;
+
+    op2.o_bd            = &be;                        /* use current backend */
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.o_req_dn        = am->resolve_base->b_dn;
+    op2.o_req_ndn       = am->resolve_base->b_ndn;
+    op2.ors_scope       = am->resolve_base->b_scope;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = slap_anlist_no_attrs;      /* DNs only */
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+    op2.ors_filter      = &uid_f;
+    BER_BVZERO(&op2.ors_filterstr);
+    if ( LogTest(LDAP_DEBUG_TRACE) ) {
+        filter2bv_x(op, &uid_f, &op2.ors_filterstr);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_resolve_search:  search filter '%s'\n", op2.ors_filterstr.bv_val);
+    }
+
+    memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+    sc_ctxt.memctx      = op->o_tmpmemctx;
+    sc.sc_private       = &sc_ctxt;
+    sc.sc_response      = automember_resolve_per_entry;
+    op2.o_callback      = &sc;
+
+    AUTOMEMBER_BE_SEARCH(rc, "resolve", &op2, &rs2);
+    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_RESOLVE_SEARCHES, 1);
+    /* An empty base holds nobody: */
+    if ( rc == LDAP_NO_SUCH_OBJECT ) rc = LDAP_SUCCESS;
+    if ( ! BER_BVISNULL(&op2.ors_filterstr) ) op->o_tmpfree(op2.ors_filterstr.bv_val, op->o_tmpmemctx);
+
+    if ( sc_ctxt.n_found > 1 ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_resolve_search:  uid '%s' is held by %d entries, not resolved\n",
+                    nuid->bv_val, sc_ctxt.n_found);
+        op->o_tmpfree(sc_ctxt.dn.bv_val, op->o_tmpmemctx);
+        op->o_tmpfree(sc_ctxt.ndn.bv_val, op->o_tmpmemctx);
+        BER_BVZERO(&sc_ctxt.dn);
+        BER_BVZERO(&sc_ctxt.ndn);
+    }
+    if ( rc != LDAP_SUCCESS && ! BER_BVISNULL(&sc_ctxt.dn) ) {
+        op->o_tmpfree(sc_ctxt.dn.bv_val, op->o_tmpmemctx);
+        op->o_tmpfree(sc_ctxt.ndn.bv_val, op->o_tmpmemctx);
+        BER_BVZERO(&sc_ctxt.dn);
+        BER_BVZERO(&sc_ctxt.ndn);
+    }
+    *dn = sc_ctxt.dn;
+    *ndn = sc_ctxt.ndn;
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_resolve_search:  uid '%s' => '%s' (rc=%d)\n",
+                nuid->bv_val, BER_BVISNULL(dn) ? "" : dn->bv_val, rc);
+    return rc;
+}
+
+/* Helper: the DN and normalized DN (in temp memory) of the person whose
+           uid is uid_value, or BER_BVNULL if there is none, from the cache
+           when possible */
+static void
+automember_resolve_uid(
+    Operation                   *op,
+    slap_overinst               *on,
+    automember_t                *am,
+    struct berval               *uid_value,
+    struct berval               *dn,
+    struct berval               *ndn
+)
+{
+    automember_resolve_shard_t  *shard;
+    automember_resolved_t       key, *r;
+    struct berval               nuid = BER_BVNULL;
+    unsigned long               generation;
+    int                         per_shard;
+
+    BER_BVZERO(dn);
+    BER_BVZERO(ndn);
+    if ( attr_normalize_one(am->attr_uid, uid_value, &nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) return;
+    key.rv_nuid = BER_BVISNULL(&nuid) ? *uid_value : nuid;
+    shard = automember_resolve_shard(am, &key.rv_nuid);
+
+    ldap_pvt_thread_mutex_lock(&shard->mutex);
+    if ( (r = (automember_resolved_t*)ldap_avl_find(shard->uids, &key, automember_resolved_cmp)) != NULL ) {
+        automember_resolve_lru_unlink(shard, r);
+        automember_resolve_lru_push(shard, r);
+        if ( ! BER_BVISNULL(&r->rv_dn) ) {
+            ber_dupbv_x(dn, &r->rv_dn, op->o_tmpmemctx);
+            ber_dupbv_x(ndn, &r->rv_ndn, op->o_tmpmemctx);
+        }
+    }
+    generation = shard->generation;
+    ldap_pvt_thread_mutex_unlock(&shard->mutex);
+
+    if ( r ) {
+        AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_RESOLVE_HITS, 1);
+    }
+    else if ( automember_resolve_search(op, on, am, &key.rv_nuid, dn, ndn) == LDAP_SUCCESS && am->resolve_cache_size > 0 ) {
+        per_shard = (am->resolve_cache_size + AUTOMEMBER_RESOLVE_SHARDS - 1) / AUTOMEMBER_RESOLVE_SHARDS;
+
+        ldap_pvt_thread_mutex_lock(&shard->mutex);
+        if ( shard->generation == generation && AUTOMEMBER_CONF_IS_CURRENT(on, am) &&
+             ! ldap_avl_find(shard->uids, &key, automember_resolved_cmp) )
+        {
+            r = (automember_resolved_t*)ch_calloc(1, sizeof(automember_resolved_t));
+            ber_dupbv(&r->rv_nuid, &key.rv_nuid);
+            if ( ! BER_BVISNULL(dn) ) {
+                ber_dupbv(&r->rv_dn, dn);
+                ber_dupbv(&r->rv_ndn, ndn);
+            }
+            ldap_avl_insert(&shard->uids, r, automember_resolved_cmp, ldap_avl_dup_error);
+            automember_resolve_lru_push(shard, r);
+            shard->n_entries++;
+
+            /* Evict the least recently used beyond the shard's share: */
+            while ( shard->n_entries > per_shard ) {
+                r = shard->lru_tail;
+                automember_resolve_lru_unlink(shard, r);
+                ldap_avl_delete(&shard->uids, r, automember_resolved_cmp);
+                shard->n_entries--;
+                automember_resolved_free(r);
+            }
+        }
+        ldap_pvt_thread_mutex_unlock(&shard->mutex);
+    }
+    if ( ! BER_BVISNULL(&nuid) ) ber_memfree_x(nuid.bv_val, op->o_tmpmemctx);
+}
+
+/* Helper: copy the n values in bvs into one block allocated from memctx,
+           laid out as by automember_xform_uid_to_dn() */
+static BerVarray
+automember_vals_pack(
+    struct berval       *bvs,
+    int                 n,
+    void                *memctx
+)
+{
+    BerVarray           vals;
+    ber_len_t           total = (n + 1) * sizeof(struct berval);
+    char                *d;
+    int                 i;
+
+    for ( i = 0; i < n; i++ ) total += bvs[i].bv_len + 1;
+    if ( (vals = (BerVarray)ber_memalloc_x(total, memctx)) == NULL ) return NULL;
+    d = (char*)&vals[n + 1];
+    for ( i = 0; i < n; i++ ) {
+        vals[i].bv_val = d;
+        vals[i].bv_len = bvs[i].bv_len;
+        memcpy(d, bvs[i].bv_val, bvs[i].bv_len);
+        d += bvs[i].bv_len;
+        *d++ = '\0';
+    }
+    BER_BVZERO(&vals[n]);
+    return vals;
+}
+
+/* Helper: a group's member values for n_vals of its memberUid values:
+           expanded through the synth template or, with a resolver
+           configured, the DNs of the people with those uids (anyone not
+           found is left out).  The values share one block allocated from
+           memctx, as from automember_xform_uid_to_dn(); *n_out gets how
+           many there are (NULL is returned if none).  If out_nvals isn't
+           NULL it gets their normalized forms likewise, or NULL if they
+           could not be had (see automember_member_nvals()). */
+static BerVarray
+automember_member_values(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    BerVarray           uids,
+    int                 n_vals,
+    void                *memctx,
+    int                 *n_out,
+    BerVarray           *out_nvals
+)
+{
+    struct berval       *dns, *ndns;
+    BerVarray           vals = NULL;
+    int                 i, n = 0;
+
+    if ( out_nvals ) *out_nvals = NULL;
+    if ( ! am->resolve_base ) {
+        *n_out = n_vals;
+        vals = automember_xform_uid_to_dn(&am->synth_ctmpl, uids, n_vals, memctx);
+        if ( vals && out_nvals ) *out_nvals = automember_member_nvals(am, uids, vals, n_vals, memctx);
+        return vals;
+    }
+
+    /* The resolver hands back each person's normalized DN with the DN: */
+    dns = (struct berval*)op->o_tmpcalloc(2 * (n_vals + 1), sizeof(struct berval), op->o_tmpmemctx);
+    ndns = dns + n_vals + 1;
+    for ( i = 0; i < n_vals; i++ ) {
+        automember_resolve_uid(op, on, am, &uids[i], &dns[n], &ndns[n]);
+        if ( BER_BVISNULL(&dns[n]) ) {
+            Debug(LDAP_DEBUG_TRACE, "automember: automember_member_values:  uid '%s' not resolved, left out\n", uids[i].bv_val);
+            continue;
+        }
+        n++;
+    }
+    if ( n && (vals = automember_vals_pack(dns, n, memctx)) != NULL && out_nvals ) {
+        *out_nvals = automember_vals_pack(ndns, n, memctx);
+    }
+    for ( i = 0; i < n; i++ ) {
+        op->o_tmpfree(dns[i].bv_val, op->o_tmpmemctx);
+        op->o_tmpfree(ndns[i].bv_val, op->o_tmpmemctx);
+    }
+    op->o_tmpfree(dns, op->o_tmpmemctx);
+    *n_out = n;
+    return vals;
+}
+
+/* Helper: the uid (in temp memory) of the entry with normalized DN ndn,
+           if it lies beneath the resolve base and has exactly one */
+static int
+automember_resolve_dn_to_uid(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *ndn,
+    struct berval       *uid
+)
+{
+    Entry               *e = NULL;
+    Attribute           *a;
+
+    BER_BVZERO(uid);
+    if ( ! dnIsSuffixScope(ndn, &am->resolve_base->b_ndn, am->resolve_base->b_scope) ) return 0;
+    if ( overlay_entry_get_ov(op, ndn, NULL, am->attr_uid, 0, &e, on) != LDAP_SUCCESS || ! e ) return 0;
+    if ( (a = attr_find(e->e_attrs, am->attr_uid)) && a->a_numvals == 1 ) ber_dupbv_x(uid, &a->a_vals[0], op->o_tmpmemctx);
+    overlay_entry_release_ov(op, e, 0, on);
+    return ! BER_BVISNULL(uid);
+}
+
+/**************************/
+
+/* Reply entries that are not ours to modify (straight from the backend's
+   cache, say) are not copied whole just to add the synthesized attributes:
+   the reply goes out as a wrapper instead, with DNs of its own and a copy
+   of each of the original's attribute headers flagged
+   SLAP_ATTR_DONT_FREE_VALS | SLAP_ATTR_DONT_FREE_DATA, so the values stay
+   the original's, behind the private synthesized attributes.  A large
+   group thus costs a header per attribute rather than a copy of every
+   memberUid value.  The wrapper can be entry_free()d like any other entry
+   and goes out REP_ENTRY_MUSTBEFREED (but not modifiable, its values not
+   being its own), while the original is held by the search state,
+   unreleased, until our callback's cleanup (automember_entry_unwrap())
+   runs once the entry has been sent and hands it back to its owner. */
+
+/* Helper: wrap rs->sr_entry as above; returns non-zero if it did */
+static int
+automember_entry_wrap(
+    SlapReply                   *rs,
+    automember_t                *am,
+    automember_search_ctx_t     *ctx
+)
+{
+    Entry                       *e = rs->sr_entry, *w;
+    Attribute                   *a, **ap;
+    
+    /* One entry is sent at a time, so this ought not happen: */
+    if ( ctx->wrap ) return 0;
+    
+    w = entry_alloc();
+    ber_dupbv(&w->e_name, &e->e_name);
+    ber_dupbv(&w->e_nname, &e->e_nname);
+    w->e_id = e->e_id;
+    w->e_ocflags = e->e_ocflags;
+    for ( a = e->e_attrs, ap = &w->e_attrs; a; a = a->a_next, ap = &(*ap)->a_next ) {
+        *ap = attr_alloc(a->a_desc);
+        (*ap)->a_vals = a->a_vals;
+        (*ap)->a_nvals = a->a_nvals;
+        (*ap)->a_numvals = a->a_numvals;
+        (*ap)->a_flags = a->a_flags | SLAP_ATTR_DONT_FREE_VALS | SLAP_ATTR_DONT_FREE_DATA;
+    }
+    *ap = NULL;
+    
+    ctx->wrap = w;
+    ctx->wrap_orig = e;
+    ctx->wrap_orig_flags = rs->sr_flags & REP_ENTRY_MASK;
+    rs->sr_entry = w;
+    rs->sr_flags &= ~REP_ENTRY_MASK;
+    rs->sr_flags |= REP_ENTRY_MUSTBEFREED;
+    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRY_WRAPS, 1);
+    return 1;
+}
+
+/* Helper: the wrapped entry has been sent; free the wrapper and put the
+           original back in the reply for its owner to dispose of.  If
+           someone above us replaced the wrapper, they disposed of it as
+           its MUSTBEFREED flag said, and the original is disposed of here
+           as its own flags say (as rs_replace_entry() would have). */
+static void
+automember_entry_unwrap(
+    Operation                   *op,
+    SlapReply                   *rs,
+    automember_search_ctx_t     *ctx
+)
+{
+    if ( rs->sr_entry == ctx->wrap ) {
+        entry_free(ctx->wrap);
+        rs->sr_entry = ctx->wrap_orig;
+        rs->sr_flags &= ~REP_ENTRY_MASK;
+        rs->sr_flags |= ctx->wrap_orig_flags;
+    } else if ( ctx->wrap_orig_flags & REP_ENTRY_MUSTRELEASE ) {
+        overlay_entry_release_ov(op, ctx->wrap_orig, 0, ctx->on);
+    } else if ( ctx->wrap_orig_flags & REP_ENTRY_MUSTBEFREED ) {
+        entry_free(ctx->wrap_orig);
+    }
+    ctx->wrap = ctx->wrap_orig = NULL;
+    ctx->wrap_orig_flags = 0;
+}
+
+/* Helper: give rs->sr_entry the attributes in the chain attrs (whose
+           ownership passes to the reply entry).  An entry that's not ours
+           to modify is wrapped (see above) during a search, and otherwise
+           copied:  the copy replaces the original through
+           rs_replace_entry(), which disposes of the original as its flags
+           say, and goes out to be freed by the frontend. */
+static void
+automember_entry_add_attrs(
+    Operation                   *op,
+    SlapReply                   *rs,
+    slap_overinst               *on,
+    automember_t                *am,
+    Attribute                   *attrs
+)
+{
+    automember_search_ctx_t     *ctx;
+    Entry                       *e = rs->sr_entry;
+    Attribute                   **ap;
+    
+    if ( attrs == NULL ) return;
+    
+    if ( ! (rs->sr_flags & REP_ENTRY_MODIFIABLE) ) {
+        ctx = automember_search_ctx_find(op, on);
+        if ( ctx && ((e == ctx->wrap) || automember_entry_wrap(rs, am, ctx)) ) {
+            /* Private attributes go ahead of the shared ones: */
+            for ( ap = &attrs; *ap; ap = &(*ap)->a_next );
+            *ap = rs->sr_entry->e_attrs;
+            rs->sr_entry->e_attrs = attrs;
+            return;
+        }
+        e = entry_dup(e);
+        AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRY_COPIES, 1);
+        rs_replace_entry(op, rs, on, e);
+        rs->sr_flags &= ~REP_ENTRY_MASK;
+        rs->sr_flags |= REP_ENTRY_MODIFIABLE | REP_ENTRY_MUSTBEFREED;
+    }
+    for ( ap = &e->e_attrs; *ap; ap = &(*ap)->a_next );
+    *ap = attrs;
+}
+
+/**************************/
+
+/* Helper: fetch source attribute via internal search */
+static Attribute*
+automember_fetch_src_attr(
+    Operation               *op,
+    slap_overinst           *on,
+    ObjectClass             *oc,
+    BerValue                *ndn,
+    AttributeDescription    *attr_memberuid
+)
+{
+    Entry                   *e = NULL;
+    Attribute               *src = NULL;
+    Attribute               *ret = NULL;
+    int                     rc;
+    
+    AUTOMEMBER_PROBE(fetch__src__entry, ndn->bv_val, attr_memberuid->ad_cname.bv_val);
+    /* Read the entry from the underlying backend */
+    rc = overlay_entry_get_ov(op,
+                        ndn,
+                        oc,             /* no filter */
+                        attr_memberuid, /* limit to desired attribute only */
+                        0,              /* rw */
+                        &e,
+                        on);
+    if ( (rc == LDAP_SUCCESS) && (e != NULL) ) {
+        /* Locate the source attribute on the fetched entry (user attrs) */
+        src = attr_find(e->e_attrs, attr_memberuid);
+        if ( src ) {
+            /* Make an independent copy we can return to the caller */
+            ret = attr_dup( src );
+        }
+        /* Always release the fetched entry */
+        overlay_entry_release_ov(op, e, 0, on);
+    }
+    AUTOMEMBER_PROBE(fetch__src__return, ndn->bv_val, ret ? ret->a_numvals : 0, rc);
+    return ret; /* may be NULL if attr not present */
+}
+
+/* How an attribute list asks for an attribute: */
+#define AUTOMEMBER_REQ_ALL      1               /* Among all user/operational attrs */
+#define AUTOMEMBER_REQ_NAMED    2               /* By name                          */
+
+/* Helper: does the attribute list an (as in ors_attrs) ask for ad?  Returns
+           0 or the AUTOMEMBER_REQ_* saying how. */
+static int
+automember_attr_is_requested(
+    AttributeName           *an,
+    AttributeDescription    *ad
+)
+{
+    int                     is_operational = is_at_operational(ad->ad_type) ? 1 : 0;
+    int                     how = 0;
+    
+    /* NULL ors_attrs implies "all user attributes" were requested: */
+    if ( an == NULL ) return is_operational ? 0 : AUTOMEMBER_REQ_ALL;
+    for ( ; an->an_name.bv_val; an++ ) {
+        if ( bvmatch(&an->an_name, &slap_anlist_all_user_attributes[0].an_name) ) {
+            /* All user attributes ("*") requested: */
+            if ( ! is_operational ) how = AUTOMEMBER_REQ_ALL;
+        }
+        else if ( bvmatch(&an->an_name, &slap_anlist_all_operational_attributes[0].an_name) ) {
+            /* All operational attributes ("+") requested: */
+            if ( is_operational ) how = AUTOMEMBER_REQ_ALL;
+        }
+        else if ( an->an_desc == ad ) {
+            /* Explicitly requested: */
+            return AUTOMEMBER_REQ_NAMED;
+        }
+    }
+    return how;
+}
+
+/* Helper: parse the digits of a range bound at *p (not past end) */
+static int
+automember_range_bound(
+    const char      **p,
+    const char      *end,
+    int             *bound
+)
+{
+    const char      *s = *p;
+    int             v = 0;
+    
+    if ( s == end || ! isdigit((unsigned char)*s) ) return 0;
+    for ( ; s < end && isdigit((unsigned char)*s); s++ ) {
+        if ( v > (INT_MAX - (*s - '0')) / 10 ) return 0;
+        v = 10 * v + (*s - '0');
+    }
+    *p = s;
+    *bound = v;
+    return 1;
+}
+
+/* Helper: is name an AD-style ranged request for ad, "<ad>;range=<lo>-<hi>"
+           or "<ad>;range=<lo>-*"?  If so, return the bounds (hi -1 for "*").
+           Options may not contain '=', so slapd leaves such names without
+           a description and they can only be recognized by name. */
+static int
+automember_attr_range_parse(
+    AttributeDescription    *ad,
+    struct berval           *name,
+    int                     *lo,
+    int                     *hi
+)
+{
+    static const struct berval  range_opt = BER_BVC(";range=");
+    const char                  *p = name->bv_val, *end = name->bv_val + name->bv_len;
+    
+    if ( name->bv_len <= ad->ad_cname.bv_len + range_opt.bv_len ) return 0;
+    if ( strncasecmp(p, ad->ad_cname.bv_val, ad->ad_cname.bv_len) != 0 ) return 0;
+    p += ad->ad_cname.bv_len;
+    if ( strncasecmp(p, range_opt.bv_val, range_opt.bv_len) != 0 ) return 0;
+    p += range_opt.bv_len;
+    
+    if ( ! automember_range_bound(&p, end, lo) || p == end || *p++ != '-' ) return 0;
+    if ( p + 1 == end && *p == '*' ) {
+        *hi = -1;
+        return 1;
+    }
+    return automember_range_bound(&p, end, hi) && (p == end) && (*hi >= *lo);
+}
+
+/* Work out what a search's attribute list asks of us; none of it can
+   change for the rest of the search, so this is done once, up front. */
+static void
+automember_attr_req_analyze(
+    automember_t            *am,
+    AttributeName           *an,
+    automember_attr_req_t   *req
+)
+{
+    AttributeName           *first_an = an;
+    automember_rule_t       *r;
+    
+    req->member = automember_attr_is_requested(an, am->attr_member);
+    req->memberuid = automember_attr_is_requested(an, am->attr_memberuid);
+    req->memberof = automember_attr_is_requested(an, am->attr_memberof);
+    req->member_range = 0;
+    req->range_ads = NULL;
+    
+    /* A range asked for stands in for member (the first one counts): */
+    for ( ; an && an->an_name.bv_val; an++ ) {
+        if ( an->an_desc == NULL && automember_attr_range_parse(am->attr_member, &an->an_name, &req->range_lo, &req->range_hi) ) {
+            req->member = AUTOMEMBER_REQ_NAMED;
+            req->member_range = 1;
+            break;
+        }
+    }
+    req->rules = req->rules_named = req->rules_src = 0;
+    for ( r = am->rules; r; r = r->r_next ) {
+        int                 how = automember_attr_is_requested(first_an, r->r_target);
+        
+        if ( how ) req->rules |= r->r_bit;
+        if ( how == AUTOMEMBER_REQ_NAMED ) req->rules_named |= r->r_bit;
+        if ( automember_attr_is_requested(first_an, r->r_src) ) req->rules_src |= r->r_bit;
+    }
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_attr_req_analyze:  member = %d (memberUid = %d, range = %d); memberOf = %d; rules = %#x\n",
+                req->member, req->memberuid, req->member_range, req->memberof, req->rules);
+}
+
+/* Helper: the description the values of a ranged reply go out under,
+           "member;range=<lo>-<hi>" (hi -1 for "*").  It has member's type,
+           so access controls and the attribute lists that take in member
+           take it in too.  They last for the search and are kept in req. */
+static AttributeDescription*
+automember_range_ad(
+    Operation               *op,
+    automember_t            *am,
+    automember_attr_req_t   *req,
+    int                     lo,
+    int                     hi
+)
+{
+    AttributeDescription    *ad;
+    char                    opt[64];
+    ber_len_t               type_len = am->attr_member->ad_cname.bv_len, opt_len;
+    
+    if ( hi < 0 ) {
+        opt_len = snprintf(opt, sizeof(opt), ";range=%d-*", lo);
+    } else {
+        opt_len = snprintf(opt, sizeof(opt), ";range=%d-%d", lo, hi);
+    }
+    for ( ad = req->range_ads; ad; ad = ad->ad_next ) {
+        if ( ad->ad_cname.bv_len == type_len + opt_len && memcmp(ad->ad_cname.bv_val + type_len, opt, opt_len) == 0 ) return ad;
+    }
+    
+    ad = (AttributeDescription*)op->o_tmpcalloc(1, sizeof(AttributeDescription) + type_len + opt_len + 1, op->o_tmpmemctx);
+    ad->ad_type = am->attr_member->ad_type;
+    ad->ad_cname.bv_val = (char*)(ad + 1);
+    ad->ad_cname.bv_len = type_len + opt_len;
+    memcpy(ad->ad_cname.bv_val, am->attr_member->ad_cname.bv_val, type_len);
+    memcpy(ad->ad_cname.bv_val + type_len, opt, opt_len + 1);
+    ad->ad_next = req->range_ads;
+    req->range_ads = ad;
+    return ad;
+}
+
+/* Helper: which of a group's n_vals memberUid values go in this reply, and
+           under what description.  That is all of them as member, unless a
+           range was asked for or there are more than the configured maximum:
+           then it's the slice from *first as "member;range=<lo>-<hi>", or
+           "member;range=<lo>-*" when the slice reaches the last value (as
+           Active Directory does).  Returns 0 if the range starts past the
+           last value. */
+static int
+automember_member_slice(
+    Operation               *op,
+    automember_t            *am,
+    automember_attr_req_t   *req,
+    int                     n_vals,
+    int                     *first,
+    int                     *count,
+    AttributeDescription    **ad
+)
+{
+    int                     lo = 0, hi = n_vals - 1;
+    
+    if ( req->member_range ) {
+        lo = req->range_lo;
+        if ( lo >= n_vals ) return 0;
+        if ( req->range_hi >= 0 && req->range_hi < hi ) hi = req->range_hi;
+    }
+    if ( am->member_max_values > 0 && hi - lo >= am->member_max_values ) hi = lo + am->member_max_values - 1;
+    
+    *first = lo;
+    *count = hi - lo + 1;
+    *ad = am->attr_member;
+    if ( req->member_range || hi < n_vals - 1 ) {
+        *ad = automember_range_ad(op, am, req, lo, ( hi == n_vals - 1 ) ? -1 : hi);
+    }
+    return 1;
+}
+
+/* Helper: synthesize dst_ad on the reply entry (of class oc) from its
+           src_ad values through ctmpl (NULL for member, whose values come
+           from automember_member_values()).  src_present says whether the
+           search brings src_ad back with the entry; req, if given, is
+           consulted for a range of values to return (member only). */
+static void
+automember_synthesize_attr(
+    Operation               *op,
+    SlapReply               *rs,
+    slap_overinst           *on,
+    automember_t            *am,
+    ObjectClass             *oc,
+    AttributeDescription    *src_ad,
+    int                     src_present,
+    automember_tmpl_t       *ctmpl,
+    AttributeDescription    *dst_ad,
+    automember_attr_req_t   *req
+)
+{
+    Entry                   *orig_e = rs->sr_entry;
+    Attribute               *src = attr_find(orig_e->e_attrs, src_ad);
+    Attribute               *dst = attr_find(orig_e->e_attrs, dst_ad);
+    int                     is_src_fetched = 0;
+    
+    if ( dst ) {
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  synth attribute already present in reply payload\n");
+        return;
+    }
+    
+    /* The search hook widens the attribute list so the backend
+       normally hands us the source values with the entry; only
+       go back for them if it didn't: */
+    if ( ! src && ! src_present ) {
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  fetching source attribute (was not requested)\n");
+        src = automember_fetch_src_attr(op, on, oc, &orig_e->e_nname, src_ad);
+        AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_SOURCE_FETCHES, 1);
+        if ( ! src ) {
+            Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_synthesize_attr:  unable to fetch full object\n");
+        }
+        is_src_fetched = 1;
+    }
+    /* Add synthesized attribute if we have source values */
+    if ( src ) {
+        if ( src->a_vals ) {
+            int                     attr_idx, first = 0, count;
+            BerVarray               dst_vals = NULL, dst_nvals = NULL;
+            
+            /* Count the number of attributes we're going to transform: */
+            for ( attr_idx=0; src->a_vals[attr_idx].bv_val; attr_idx++ );
+            Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  source attribute located, %d value(s)\n", attr_idx);
+            count = attr_idx;
+            
+            if ( attr_idx == 0 ) {
+                Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  empty source values list\n");
+            }
+            else if ( req && ! automember_member_slice(op, am, req, attr_idx, &first, &count, &dst_ad) ) {
+                Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  range starts past the last of %d value(s)\n", attr_idx);
+            }
+            else {
+                /* Expand the values wanted in one go, straight into the heap
+                   block the new attribute will own: */
+                if ( ctmpl ) {
+                    dst_vals = automember_xform_uid_to_dn(ctmpl, src->a_vals + first, count, NULL);
+                } else {
+                    dst_vals = automember_member_values(op, on, am, src->a_vals + first, count, NULL, &count, &dst_nvals);
+                }
+                if ( dst_vals ) {
+                    Entry       synth = { 0 };
+                    
+                    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_VALUES_EXPANDED, count);
+                    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED, 1);
+                    AUTOMEMBER_PROBE(synthesize, orig_e->e_nname.bv_val, dst_ad->ad_cname.bv_val, attr_idx, count, dst_nvals != NULL);
+                    automember_attr_attach(&synth, dst_ad, dst_vals, dst_nvals, count);
+                    automember_entry_add_attrs(op, rs, on, am, synth.e_attrs);
+                } else if ( count == 0 ) {
+                    Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  no source value resolved\n");
+                } else {
+                    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_synthesize_attr:  failed to allocate %s attribute values\n", dst_ad->ad_cname.bv_val);
+                }
+            }
+        } else {
+            Debug(LDAP_DEBUG_TRACE, "automember: automember_synthesize_attr:  empty source values list\n");
+        }
+        if ( is_src_fetched ) attr_free(src);
+    }
+}
+
+static int
+automember_populate_member_attr(
+    Operation                   *op,
+    SlapReply                   *rs,
+    slap_overinst               *on,
+    automember_t                *am,
+    automember_attr_req_t       *req
+)
+{
+    automember_timer_t  timer;
+    
+    AUTOMEMBER_PROBE(populate__member__entry, rs->sr_entry->e_nname.bv_val);
+    AUTOMEMBER_TIMER_START(am, timer);
+    if ( req->member ) {
+        automember_synthesize_attr(op, rs, on, am, am->oc_member, am->attr_memberuid, req->memberuid,
+                    NULL, am->attr_member, req);
+    }
+    AUTOMEMBER_TIMER_STOP(am, AUTOMEMBER_PATH_MEMBER, timer);
+    AUTOMEMBER_PROBE(populate__member__return, rs->sr_entry->e_nname.bv_val);
+    return SLAP_CB_CONTINUE;
+}
+
+/* Synthesize the targets of the additional rules in mask (as dispatched
+   for the entry) that the search asked for */
+static int
+automember_populate_rules_attr(
+    Operation                   *op,
+    SlapReply                   *rs,
+    slap_overinst               *on,
+    automember_t                *am,
+    automember_attr_req_t       *req,
+    unsigned int                mask
+)
+{
+    automember_rule_t   *r;
+    automember_timer_t  timer;
+    
+    AUTOMEMBER_TIMER_START(am, timer);
+    for ( r = am->rules; r; r = r->r_next ) {
+        if ( mask & req->rules & r->r_bit ) {
+            automember_synthesize_attr(op, rs, on, am, r->r_oc, r->r_src, (req->rules_src & r->r_bit),
+                        &r->r_ctmpl, r->r_target, NULL);
+        }
+    }
+    AUTOMEMBER_TIMER_STOP(am, AUTOMEMBER_PATH_MEMBER, timer);
+    return SLAP_CB_CONTINUE;
+}
+
+/**************************/
+
+/* Entry dispatch:  rather than test every reply entry against each
+   configured class in turn (is_entry_objectclass_or_sub() walks the
+   objectClass values every time), each class in the schema is given the
+   mask of rules it (or a superclass) selects, once, whenever the classes
+   or rules change.  An entry's rules are then the union of its classes'
+   masks, found in one pass. */
+
+/* Helper: the mask of rules class oc selects */
+static unsigned int
+automember_dispatch_mask(
+    automember_t        *am,
+    ObjectClass         *oc
+)
+{
+    automember_rule_t   *r;
+    unsigned int        mask = 0;
+    
+    if ( am->oc_member && is_object_subclass(am->oc_member, oc) ) mask |= AUTOMEMBER_DISPATCH_MEMBER;
+    if ( am->oc_memberof && is_object_subclass(am->oc_memberof, oc) ) mask |= AUTOMEMBER_DISPATCH_MEMBEROF;
+    for ( r = am->rules; r; r = r->r_next ) {
+        if ( is_object_subclass(r->r_oc, oc) ) mask |= r->r_bit;
+    }
+    return mask;
+}
+
+static int
+automember_dispatch_cmp(
+    const void          *v1,
+    const void          *v2
+)
+{
+    const automember_dispatch_t *d1 = v1, *d2 = v2;
+    
+    return ( d1->d_oc < d2->d_oc ) ? -1 : ( d1->d_oc > d2->d_oc );
+}
+
+/* (Re)build the table; am is a snapshot no reader has yet (see
+   automember_config()). */
+static void
+automember_dispatch_build(
+    automember_t        *am
+)
+{
+    ObjectClass         *oc, *iter;
+    int                 n = 0;
+    
+    if ( am->dispatch ) ch_free(am->dispatch);
+    am->dispatch = NULL;
+    am->n_dispatch = 0;
+    
+    /* Until the database opens the schema may still be growing: */
+    if ( ! am->st->be ) return;
+    
+    for ( oc = oc_start(&iter); oc; oc = oc_next(&iter) ) n++;
+    if ( n == 0 ) return;
+    am->dispatch = (automember_dispatch_t*)ch_malloc(n * sizeof(automember_dispatch_t));
+    for ( oc = oc_start(&iter); oc && am->n_dispatch < n; oc = oc_next(&iter) ) {
+        am->dispatch[am->n_dispatch].d_oc = oc;
+        am->dispatch[am->n_dispatch++].d_mask = automember_dispatch_mask(am, oc);
+    }
+    qsort(am->dispatch, am->n_dispatch, sizeof(automember_dispatch_t), automember_dispatch_cmp);
+    Debug(LDAP_DEBUG_CONFIG, "automember: automember_dispatch_build:  %d objectClass(es) mapped\n", am->n_dispatch);
+}
+
+/* The rules that apply to entry e */
+static unsigned int
+automember_dispatch(
+    automember_t        *am,
+    Entry               *e
+)
+{
+    Attribute           *a = attr_find(e->e_attrs, am->attr_oc);
+    unsigned int        mask = 0;
+    int                 i;
+    
+    if ( a == NULL ) return 0;
+    for ( i = 0; a->a_nvals[i].bv_val; i++ ) {
+        automember_dispatch_t   key, *d;
+        
+        if ( (key.d_oc = oc_bvfind(&a->a_nvals[i])) == NULL ) continue;
+        d = am->dispatch ? bsearch(&key, am->dispatch, am->n_dispatch, sizeof(automember_dispatch_t), automember_dispatch_cmp) : NULL;
+        /* Classes added to the schema since the table was built: */
+        mask |= d ? d->d_mask : automember_dispatch_mask(am, key.d_oc);
+    }
+    return mask;
+}
+
+/* One uid being resolved by a batched memberOf search: */
+typedef struct automember_memberof_key {
+    struct berval   nuid;           /* uid normalized as memberUid would match it */
+    BerVarray       dn_list;        /* DNs of the groups listing nuid             */
+    BerVarray       ndn_list;       /* ...and their normalized forms              */
+} automember_memberof_key_t;
+
+struct automember_collect_memberof_context {
+    BerVarray                   *dn_list;       /* Single uid:  flat list of DNs    */
+    BerVarray                   *ndn_list;      /* ...and their normalized forms    */
+    automember_memberof_key_t   *keys;          /* Batched uids:  sorted by nuid    */
+    int                         n_keys;
+    int                         n_found;        /* Entries seen                     */
+    AttributeDescription        *attr_memberuid;
+    void                        *memctx;
+};
+
+/* Helper: append a copy of dn to a NULL-terminated BerVarray */
+static void
+automember_dn_list_append(
+    BerVarray       *dn_list_ptr,
+    struct berval   *dn,
+    void            *memctx
+)
+{
+    int         n = 0;
+    BerVarray   dn_list = *dn_list_ptr;
+
+    if (dn_list) while (!BER_BVISNULL(&dn_list[n])) n++;
+    
+    /* Reallocate the ber array with an additional slot: */
+    dn_list = (BerVarray)ber_memrealloc_x(dn_list, (n + 2) * sizeof(struct berval), memctx);
+    /* Add the new value to the list and set the list terminator sentinel: */
+    ber_dupbv_x(&dn_list[n], dn, memctx);
+    BER_BVZERO(&dn_list[n+1]);
+    
+    /* On realloc, the dn_list pointer may have changed: */
+    *dn_list_ptr = dn_list;
+}
+
+static int
+automember_memberof_key_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    const automember_memberof_key_t *k1 = v1, *k2 = v2;
+
+    return ber_bvcmp(&k1->nuid, &k2->nuid);
+}
+
+static int
+automember_collect_memberof_dn_per_entry(
+    Operation       *op,
+    SlapReply       *rs
+)
+{
+    struct automember_collect_memberof_context  *sc_ctxt = (struct automember_collect_memberof_context*)op->o_callback->sc_private;
+
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn_per_entry:  new entry found %p\n", rs->sr_entry);
+    if ( (rs->sr_type == REP_SEARCH) && rs->sr_entry ) {
+        sc_ctxt->n_found++;
+        if ( sc_ctxt->keys ) {
+            Attribute   *a = attr_find(rs->sr_entry->e_attrs, sc_ctxt->attr_memberuid);
+            int         i;
+            
+            /* File the group's DN under every batched uid it lists: */
+            for ( i = 0; a && a->a_nvals && ! BER_BVISNULL(&a->a_nvals[i]); i++ ) {
+                automember_memberof_key_t   key, *match;
+                
+                key.nuid = a->a_nvals[i];
+                match = (automember_memberof_key_t*)bsearch(&key, sc_ctxt->keys, sc_ctxt->n_keys,
+                                    sizeof(automember_memberof_key_t), automember_memberof_key_cmp);
+                if ( match ) {
+                    automember_dn_list_append(&match->dn_list, &rs->sr_entry->e_name, sc_ctxt->memctx);
+                    automember_dn_list_append(&match->ndn_list, &rs->sr_entry->e_nname, sc_ctxt->memctx);
+                }
+            }
+        } else {
+            automember_dn_list_append(sc_ctxt->dn_list, &rs->sr_entry->e_name, sc_ctxt->memctx);
+            if ( sc_ctxt->ndn_list ) automember_dn_list_append(sc_ctxt->ndn_list, &rs->sr_entry->e_nname, sc_ctxt->memctx);
+        }
+    }
+    return LDAP_SUCCESS;
+}
+
+/* Helper: could the entry named ndn be found by a search for groups? */
+static int
+automember_group_in_bases(
+    automember_t        *am,
+    struct berval       *ndn
+)
+{
+    automember_base_t   *b;
+    
+    if ( ! am->group_bases ) return 1;
+    for ( b = am->group_bases; b; b = b->b_next ) {
+        if ( dnIsSuffixScope(ndn, &b->b_ndn, b->b_scope) ) return 1;
+    }
+    return 0;
+}
+
+/* Run the internal search op2 (set up in every respect but its base and
+   scope) over each group base in turn, or the whole database if none are
+   configured.  kind says what the search is for (see AUTOMEMBER_BE_SEARCH). */
+static int
+automember_group_search(
+    automember_t        *am,
+    Operation           *op2,
+    const char          *kind
+)
+{
+    automember_base_t   *b;
+    int                 rc = LDAP_SUCCESS;
+    
+    if ( ! am->group_bases ) {
+        SlapReply       rs2 = { REP_RESULT };
+        
+        op2->o_req_dn   = op2->o_bd->be_suffix[0];
+        op2->o_req_ndn  = op2->o_bd->be_nsuffix[0];
+        op2->ors_scope  = LDAP_SCOPE_SUBTREE;
+        AUTOMEMBER_BE_SEARCH(rc, kind, op2, &rs2);
+        return rc;
+    }
+    for ( b = am->group_bases; b && (rc == LDAP_SUCCESS); b = b->b_next ) {
+        SlapReply       rs2 = { REP_RESULT };
+        
+        op2->o_req_dn   = b->b_dn;
+        op2->o_req_ndn  = b->b_ndn;
+        op2->ors_scope  = b->b_scope;
+        AUTOMEMBER_BE_SEARCH(rc, kind, op2, &rs2);
+        /* A base with nothing in it yet holds no groups: */
+        if ( rc == LDAP_NO_SUCH_OBJECT ) rc = LDAP_SUCCESS;
+    }
+    return rc;
+}
+
+/* Helper: fill the caller's stack Filters with a copy of a lookup filter
+           (see automember_lookup_filter()) carrying nval in place of its
+           placeholder; the objectClass node is shared as parsed */
+static void
+automember_lookup_filter_fill(
+    Filter              *tmpl,
+    struct berval       *nval,
+    Filter              *and_f,
+    Filter              *oc_f,
+    Filter              *val_f,
+    AttributeAssertion  *val_ava
+)
+{
+    *and_f = *tmpl;
+    *oc_f = *and_f->f_and;
+    *val_f = *oc_f->f_next;
+    *val_ava = *val_f->f_ava;
+    val_ava->aa_value = *nval;
+    val_f->f_ava = val_ava;
+    val_f->f_next = NULL;
+    oc_f->f_next = val_f;
+    and_f->f_and = oc_f;
+    and_f->f_next = NULL;
+}
+
+static int
+automember_collect_memberof_dn(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *uid_value,
+    BerVarray           *out_dn_list,
+    BerVarray           *out_ndn_list
+)
+{
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    slap_callback       sc = {0};
+    struct automember_collect_memberof_context  sc_ctxt;
+    Filter              and_f, oc_f, uid_f;
+    AttributeAssertion  uid_ava;
+    struct berval       nuid = BER_BVNULL;
+    BerVarray           dn_list = NULL, ndn_list = NULL;
+    int                 rc;
+    
+    /* Start by making sure nothing is returned by default... */    
+    *out_dn_list = NULL;
+    if ( out_ndn_list ) *out_ndn_list = NULL;
+    
+    if ( ! am->memberof_filter ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_collect_memberof_dn:  no memberOf filter configured\n");
+        return LDAP_OTHER;
+    }
+    
+    /* The assertion value goes into the filter as-is (so needs no
+       escaping), but must be normalized as the filter parser would have: */
+    if ( attr_normalize_one(am->attr_memberuid, uid_value, &nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) {
+        return LDAP_INVALID_SYNTAX;
+    }
+    AUTOMEMBER_PROBE(collect__memberof__entry, uid_value->bv_val);
+    
+    /* Stack copy of the prebuilt filter with our uid in place of the
+       placeholder: */
+    automember_lookup_filter_fill(am->memberof_filter, BER_BVISNULL(&nuid) ? uid_value : &nuid,
+                &and_f, &oc_f, &uid_f, &uid_ava);
+    
+    op2.o_bd            = &be;                        /* use current backend */
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = slap_anlist_no_attrs;      /* DNs only */
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+    op2.ors_filter      = &and_f;
+    
+    /* The local database searches on the Filter alone; the string form is
+       only wanted for the log: */
+    BER_BVZERO(&op2.ors_filterstr);
+    if ( LogTest(LDAP_DEBUG_TRACE) ) {
+        filter2bv_x(op, &and_f, &op2.ors_filterstr);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn:  search filter '%s'\n", op2.ors_filterstr.bv_val);
+    }
+    
+    /* Get our search callback context setup, so we can add DNs to the list: */
+    memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+    sc_ctxt.dn_list     = &dn_list;
+    if ( out_ndn_list ) sc_ctxt.ndn_list = &ndn_list;
+    sc_ctxt.memctx      = op->o_tmpmemctx;   /* Use the parent operation's temp context */
+    sc.sc_private       = &sc_ctxt;
+    sc.sc_response      = automember_collect_memberof_dn_per_entry;
+    op2.o_callback      = &sc;
+    
+    /* Perform the search: */
+    rc = automember_group_search(am, &op2, "memberof");
+    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_MEMBEROF_SEARCHES, 1);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn:  search operation completed (rc=%d)\n", rc);
+    
+    if ( ! BER_BVISNULL(&op2.ors_filterstr) ) op->o_tmpfree(op2.ors_filterstr.bv_val, op->o_tmpmemctx);
+    if ( ! BER_BVISNULL(&nuid) ) ber_memfree_x(nuid.bv_val, op->o_tmpmemctx);
+    
+    /* Return the dn_list: */
+    if ( rc == LDAP_SUCCESS ) {
+        *out_dn_list = dn_list;
+        if ( out_ndn_list ) *out_ndn_list = ndn_list;
+    } else {
+        if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+        if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+    }
+    AUTOMEMBER_PROBE(collect__memberof__return, uid_value->bv_val, sc_ctxt.n_found, rc);
+    return LDAP_SUCCESS;
+}
+
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+
+/* Resolve memberOf for several uids with a single internal search: the
+   keys (sorted by nuid, no duplicates) each receive the DNs of the groups
+   that list them. */
+static int
+automember_collect_memberof_dn_batch(
+    Operation                   *op,
+    slap_overinst               *on,
+    automember_t                *am,
+    automember_memberof_key_t   *keys,
+    int                         n_keys
+)
+{
+    static const char   *filter_head = "(&(objectClass=";
+    BackendDB           be = *op->o_bd;
+    struct berval       *esc_vals;
+    struct berval       filter_str;
+    struct berval       *at_name = &am->attr_memberuid->ad_cname;
+    Filter              *filter;
+    char                *p;
+    int                 i, rc;
+
+    /* Escape each value and size the filter string: */
+    esc_vals = (struct berval*)ber_memcalloc_x(n_keys, sizeof(struct berval), op->o_tmpmemctx);
+    filter_str.bv_len = strlen(filter_head) + am->oc_member->soc_cname.bv_len + STRLENOF(")(|") + STRLENOF("))");
+    for ( i = 0; i < n_keys; i++ ) {
+        filter_escape_value_x(&keys[i].nuid, &esc_vals[i], op->o_tmpmemctx);
+        filter_str.bv_len += STRLENOF("(=)") + at_name->bv_len + esc_vals[i].bv_len;
+    }
+    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
+    p = lutil_strcopy(filter_str.bv_val, filter_head);
+    p = lutil_strncopy(p, am->oc_member->soc_cname.bv_val, am->oc_member->soc_cname.bv_len);
+    p = lutil_strcopy(p, ")(|");
+    for ( i = 0; i < n_keys; i++ ) {
+        *p++ = '(';
+        p = lutil_strncopy(p, at_name->bv_val, at_name->bv_len);
+        *p++ = '=';
+        p = lutil_strncopy(p, esc_vals[i].bv_val, esc_vals[i].bv_len);
+        *p++ = ')';
+        ber_memfree_x(esc_vals[i].bv_val, op->o_tmpmemctx);
+    }
+    p = lutil_strcopy(p, "))");
+    ber_memfree_x(esc_vals, op->o_tmpmemctx);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn_batch:  search filter string '%s' created\n", filter_str.bv_val);
+
+    filter = str2filter_x(op, filter_str.bv_val);
+    if ( filter ) {
+        Operation                                   op2 = *op;
+        slap_callback                               sc = {0};
+        struct automember_collect_memberof_context  sc_ctxt;
+        AttributeName                               an[2];
+
+        /* Each group's memberUid values say which uids it answers for: */
+        memset(an, 0, sizeof(an));
+        an[0].an_name       = *at_name;
+        an[0].an_desc       = am->attr_memberuid;
+
+        op2.o_bd            = &be;                        /* use current backend */
+        op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+
+        op2.o_tag           = LDAP_REQ_SEARCH;
+        op2.o_dn            = op->o_bd->be_rootdn;
+        op2.o_ndn           = op->o_bd->be_rootndn;
+        op2.ors_deref       = LDAP_DEREF_NEVER;
+        op2.ors_slimit      = SLAP_NO_LIMIT;
+        op2.ors_tlimit      = SLAP_NO_LIMIT;
+        op2.ors_attrs       = an;
+        op2.ors_attrsonly   = 0;
+        op2.o_do_not_cache  = 1;
+        op2.ors_filter      = filter;
+        op2.ors_filterstr   = filter_str;
+
+        memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+        sc_ctxt.keys            = keys;
+        sc_ctxt.n_keys          = n_keys;
+        sc_ctxt.attr_memberuid  = am->attr_memberuid;
+        sc_ctxt.memctx          = op->o_tmpmemctx;
+        sc.sc_private       = &sc_ctxt;
+        sc.sc_response      = automember_collect_memberof_dn_per_entry;
+        op2.o_callback      = &sc;
+
+        rc = automember_group_search(am, &op2, "memberof-batch");
+        AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_MEMBEROF_SEARCHES, 1);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_collect_memberof_dn_batch:  search operation completed for %d uid(s) (rc=%d)\n", n_keys, rc);
+
+        filter_free_x(op, filter, 1);
+        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+
+        if ( rc != LDAP_SUCCESS ) {
+            for ( i = 0; i < n_keys; i++ ) {
+                if ( keys[i].dn_list ) ber_bvarray_free_x(keys[i].dn_list, op->o_tmpmemctx);
+                if ( keys[i].ndn_list ) ber_bvarray_free_x(keys[i].ndn_list, op->o_tmpmemctx);
+                keys[i].dn_list = NULL;
+                keys[i].ndn_list = NULL;
+            }
+        }
+        return rc;
+    }
+    ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_collect_memberof_dn_batch:  unable to allocate filter\n");
+    return LDAP_OTHER;
+}
+
+#endif
+
+/**************************/
+
+/* Nested groups:  with automember-memberof-nested set, a group may list
+   other groups (by DN) in that attribute, and a person's memberOf then
+   includes every group reachable upward from the groups listing its uid.
+   The groups a group is nested in come from one internal search,
+
+     (&(objectClass=<member-oc>)(<nested-attr>=<group>))
+
+   memoized for the rest of the client's search so that each group is
+   looked up at most once however many entries reach it.  A visited set
+   stops cycles and leaves each group in memberOf exactly once. */
+
+/* The groups one group is directly nested in: */
+typedef struct automember_nested_parents {
+    struct berval           p_ndn;              /* The group                    */
+    BerVarray               p_dns;              /* Groups listing it            */
+    BerVarray               p_ndns;             /* ...normalized                */
+} automember_nested_parents_t;
+
+static int
+automember_nested_parents_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    const automember_nested_parents_t   *p1 = v1, *p2 = v2;
+    
+    return ber_bvcmp(&p1->p_ndn, &p2->p_ndn);
+}
+
+/* Visited groups are keyed by their (NUL-terminated) normalized DN: */
+static int
+automember_nested_ndn_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    return strcmp((const char*)v1, (const char*)v2);
+}
+
+static int
+automember_nested_parents_free(
+    void            *v,
+    void            *arg
+)
+{
+    automember_nested_parents_t *p = (automember_nested_parents_t*)v;
+    Operation                   *op = (Operation*)arg;
+    
+    op->o_tmpfree(p->p_ndn.bv_val, op->o_tmpmemctx);
+    if ( p->p_dns ) ber_bvarray_free_x(p->p_dns, op->o_tmpmemctx);
+    if ( p->p_ndns ) ber_bvarray_free_x(p->p_ndns, op->o_tmpmemctx);
+    op->o_tmpfree(p, op->o_tmpmemctx);
+    return 0;
+}
+
+/* Helper: release a memo tree */
+static void
+automember_nested_memo_clear(
+    Operation       *op,
+    Avlnode         **parents
+)
+{
+    if ( *parents ) {
+        ldap_avl_apply(*parents, automember_nested_parents_free, op, -1, AVL_POSTORDER);
+        ldap_avl_free(*parents, NULL);
+        *parents = NULL;
+    }
+}
+
+/* Helper: the groups the group ndn is directly nested in, from the memo
+           or else an internal search (whose result is then memoized) */
+static automember_nested_parents_t*
+automember_nested_parents(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    Avlnode             **parents,
+    struct berval       *ndn
+)
+{
+    automember_nested_parents_t key, *p;
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    slap_callback       sc = {0};
+    struct automember_collect_memberof_context  sc_ctxt;
+    Filter              and_f, oc_f, dn_f;
+    AttributeAssertion  dn_ava;
+    int                 rc;
+    
+    key.p_ndn = *ndn;
+    p = (automember_nested_parents_t*)ldap_avl_find(*parents, &key, automember_nested_parents_cmp);
+    if ( p ) return p;
+    
+    p = (automember_nested_parents_t*)op->o_tmpcalloc(1, sizeof(automember_nested_parents_t), op->o_tmpmemctx);
+    ber_dupbv_x(&p->p_ndn, ndn, op->o_tmpmemctx);
+    
+    /* The group's DN is already normalized as the assertion needs: */
+    automember_lookup_filter_fill(am->nested_filter, ndn, &and_f, &oc_f, &dn_f, &dn_ava);
+    
+    op2.o_bd            = &be;                        /* use current backend */
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = slap_anlist_no_attrs;      /* DNs only */
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+    op2.ors_filter      = &and_f;
+    BER_BVZERO(&op2.ors_filterstr);
+    if ( LogTest(LDAP_DEBUG_TRACE) ) {
+        filter2bv_x(op, &and_f, &op2.ors_filterstr);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_nested_parents:  search filter '%s'\n", op2.ors_filterstr.bv_val);
+    }
+    
+    memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+    sc_ctxt.dn_list     = &p->p_dns;
+    sc_ctxt.ndn_list    = &p->p_ndns;
+    sc_ctxt.memctx      = op->o_tmpmemctx;
+    sc.sc_private       = &sc_ctxt;
+    sc.sc_response      = automember_collect_memberof_dn_per_entry;
+    op2.o_callback      = &sc;
+    
+    rc = automember_group_search(am, &op2, "nested");
+    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_MEMBEROF_SEARCHES, 1);
+    if ( ! BER_BVISNULL(&op2.ors_filterstr) ) op->o_tmpfree(op2.ors_filterstr.bv_val, op->o_tmpmemctx);
+    if ( rc != LDAP_SUCCESS ) {
+        /* Remembered as having no parents, rather than retried per entry: */
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_nested_parents:  search for groups containing '%s' failed (rc=%d)\n", ndn->bv_val, rc);
+        if ( p->p_dns ) ber_bvarray_free_x(p->p_dns, op->o_tmpmemctx);
+        if ( p->p_ndns ) ber_bvarray_free_x(p->p_ndns, op->o_tmpmemctx);
+        p->p_dns = p->p_ndns = NULL;
+    }
+    ldap_avl_insert(parents, p, automember_nested_parents_cmp, ldap_avl_dup_error);
+    return p;
+}
+
+/* Helper: append group (dn, ndn) to the result unless already visited */
+static void
+automember_nested_visit(
+    Operation           *op,
+    Avlnode             **visited,
+    BerVarray           *out_dns,
+    BerVarray           *out_ndns,
+    struct berval       *dn,
+    struct berval       *ndn
+)
+{
+    int                 n = 0;
+    
+    if ( ldap_avl_find(*visited, ndn->bv_val, automember_nested_ndn_cmp) ) return;
+    automember_dn_list_append(out_dns, dn, op->o_tmpmemctx);
+    automember_dn_list_append(out_ndns, ndn, op->o_tmpmemctx);
+    
+    /* The appended copy's string stays put however often the array is
+       reallocated, so it can key the visited set: */
+    while ( ! BER_BVISNULL(&(*out_ndns)[n + 1]) ) n++;
+    ldap_avl_insert(visited, (*out_ndns)[n].bv_val, automember_nested_ndn_cmp, ldap_avl_dup_error);
+}
+
+/* Replace *dn_list (a person's direct groups, in temp memory) with those
+   groups plus every group they are nested in, each listed once.  If
+   ndn_list isn't NULL, *ndn_list holds the normalized forms of the direct
+   groups' DNs (if to hand) and is likewise replaced. */
+static void
+automember_nested_expand(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    BerVarray           *dn_list,
+    BerVarray           *ndn_list
+)
+{
+    automember_search_ctx_t *ctx = automember_search_ctx_find(op, on);
+    Avlnode             *local_parents = NULL;
+    Avlnode             **parents = ctx ? &ctx->nested_parents : &local_parents;
+    Avlnode             *visited = NULL;
+    BerVarray           in_dns = *dn_list, in_ndns = ndn_list ? *ndn_list : NULL, out_dns = NULL, out_ndns = NULL;
+    int                 i, j;
+    
+    for ( i = 0; in_dns && ! BER_BVISNULL(&in_dns[i]); i++ ) {
+        struct berval   ndn;
+        
+        if ( in_ndns ) {
+            automember_nested_visit(op, &visited, &out_dns, &out_ndns, &in_dns[i], &in_ndns[i]);
+            continue;
+        }
+        if ( dnNormalize(0, NULL, NULL, &in_dns[i], &ndn, op->o_tmpmemctx) != LDAP_SUCCESS ) continue;
+        automember_nested_visit(op, &visited, &out_dns, &out_ndns, &in_dns[i], &ndn);
+        op->o_tmpfree(ndn.bv_val, op->o_tmpmemctx);
+    }
+    
+    /* Breadth first:  the result doubles as the queue of groups whose
+       parents have yet to be looked at: */
+    for ( i = 0; out_ndns && ! BER_BVISNULL(&out_ndns[i]); i++ ) {
+        automember_nested_parents_t *p = automember_nested_parents(op, on, am, parents, &out_ndns[i]);
+        
+        for ( j = 0; p->p_ndns && ! BER_BVISNULL(&p->p_ndns[j]); j++ ) {
+            automember_nested_visit(op, &visited, &out_dns, &out_ndns, &p->p_dns[j], &p->p_ndns[j]);
+        }
+    }
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_nested_expand:  %d group(s) after expansion\n", i);
+    
+    ldap_avl_free(visited, NULL);
+    automember_nested_memo_clear(op, &local_parents);
+    if ( in_dns ) ber_bvarray_free_x(in_dns, op->o_tmpmemctx);
+    if ( in_ndns ) ber_bvarray_free_x(in_ndns, op->o_tmpmemctx);
+    *dn_list = out_dns;
+    if ( ndn_list ) {
+        *ndn_list = out_ndns;
+    } else if ( out_ndns ) {
+        ber_bvarray_free_x(out_ndns, op->o_tmpmemctx);
+    }
+}
+
+/* Helper: add memberOf values for the groups in dn_list (both lists are
+           left as they are) to entry e, expanded through nested groups if
+           configured.  ndn_list, the groups' normalized DNs (from their
+           e_nname, or the index), is attached as the normalized values so
+           nothing downstream need normalize them again; without it the
+           values are attached unnormalized, as attr_merge() leaves them. */
+static int
+automember_memberof_merge(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    Entry               *e,
+    BerVarray           dn_list,
+    BerVarray           ndn_list
+)
+{
+    BerVarray           all_dns = NULL, all_ndns = NULL;
+    int                 rc;
+    
+    if ( ! am->nested_filter ) return attr_merge(e, am->attr_memberof, dn_list, ndn_list);
+    
+    ber_bvarray_dup_x(&all_dns, dn_list, op->o_tmpmemctx);
+    if ( ndn_list ) ber_bvarray_dup_x(&all_ndns, ndn_list, op->o_tmpmemctx);
+    /* The expansion normalizes every DN it visits, so always has them: */
+    automember_nested_expand(op, on, am, &all_dns, &all_ndns);
+    rc = all_dns ? attr_merge(e, am->attr_memberof, all_dns, all_ndns) : 0;
+    if ( all_dns ) ber_bvarray_free_x(all_dns, op->o_tmpmemctx);
+    if ( all_ndns ) ber_bvarray_free_x(all_ndns, op->o_tmpmemctx);
+    return rc;
+}
+
+/**************************/
+
+/* memberOf reverse index:  rather than search the backend for groups
+   listing a uid on every person entry returned, keep a map of memberUid
+   values to the groups that list them.  The index is built on first use
+   and kept current by the write hooks; anything the hooks cannot follow
+   surgically just invalidates it so the next lookup rebuilds it. */
+
+static int
+automember_idx_group_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    const automember_idx_group_t    *g1 = v1, *g2 = v2;
+
+    return ber_bvcmp(&g1->g_ndn, &g2->g_ndn);
+}
+
+static int
+automember_idx_uid_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    const automember_idx_uid_t      *u1 = v1, *u2 = v2;
+
+    return ber_bvcmp(&u1->u_uid, &u2->u_uid);
+}
+
+static void
+automember_idx_group_free(
+    void            *v
+)
+{
+    automember_idx_group_t  *g = (automember_idx_group_t*)v;
+
+    ch_free(g->g_dn.bv_val);
+    ch_free(g->g_ndn.bv_val);
+    if ( g->g_uids ) ber_bvarray_free(g->g_uids);
+    ch_free(g);
+}
+
+static void
+automember_idx_uid_free(
+    void            *v
+)
+{
+    automember_idx_uid_t    *u = (automember_idx_uid_t*)v;
+
+    ch_free(u->u_uid.bv_val);
+    ch_free(u->u_groups);
+    ch_free(u);
+}
+
+/* Drop everything in the index; the next lookup rebuilds it.  Called
+   with the write lock held (or on an index not yet shared).  is_valid is
+   also read without the lock, as a hint, so it's stored atomically. */
+static void
+automember_idx_clear(
+    automember_index_t  *idx
+)
+{
+    if ( idx->uids ) ldap_avl_free(idx->uids, automember_idx_uid_free);
+    if ( idx->groups ) ldap_avl_free(idx->groups, automember_idx_group_free);
+    idx->uids = NULL;
+    idx->groups = NULL;
+    __atomic_store_n(&idx->is_valid, 0, __ATOMIC_RELEASE);
+}
+
+static void
+automember_idx_invalidate(
+    automember_index_t  *idx
+)
+{
+    ldap_pvt_thread_rdwr_wlock(&idx->rwlock);
+    __atomic_add_fetch(&idx->generation, 1, __ATOMIC_RELEASE);
+    automember_idx_clear(idx);
+    ldap_pvt_thread_rdwr_wunlock(&idx->rwlock);
+}
+
+/* Remove the group with normalized DN ndn from the index (if present): */
+static void
+automember_idx_remove_group(
+    automember_index_t  *idx,
+    struct berval       *ndn
+)
+{
+    automember_idx_group_t  key, *g;
+    int                     uid_idx;
+
+    key.g_ndn = *ndn;
+    g = (automember_idx_group_t*)ldap_avl_delete(&idx->groups, &key, automember_idx_group_cmp);
+    if ( ! g ) return;
+
+    /* Unlink the group from every uid it listed: */
+    for ( uid_idx = 0; g->g_uids && ! BER_BVISNULL(&g->g_uids[uid_idx]); uid_idx++ ) {
+        automember_idx_uid_t    ukey, *u;
+        int                     i;
+
+        ukey.u_uid = g->g_uids[uid_idx];
+        u = (automember_idx_uid_t*)ldap_avl_find(idx->uids, &ukey, automember_idx_uid_cmp);
+        if ( ! u ) continue;
+        for ( i = 0; i < u->u_ngroups; i++ ) {
+            if ( u->u_groups[i] == g ) {
+                u->u_groups[i] = u->u_groups[--u->u_ngroups];
+                break;
+            }
+        }
+        if ( u->u_ngroups == 0 ) {
+            ldap_avl_delete(&idx->uids, u, automember_idx_uid_cmp);
+            automember_idx_uid_free(u);
+        }
+    }
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_idx_remove_group:  removed '%s'\n", g->g_dn.bv_val);
+    automember_idx_group_free(g);
+}
+
+/* Add (or replace) a group and link it to each of its memberUid values: */
+static void
+automember_idx_add_group(
+    automember_index_t  *idx,
+    struct berval       *dn,
+    struct berval       *ndn,
+    Attribute           *memberuid
+)
+{
+    automember_idx_group_t  *g;
+    int                     uid_idx;
+
+    automember_idx_remove_group(idx, ndn);
+
+    g = (automember_idx_group_t*)ch_calloc(1, sizeof(automember_idx_group_t));
+    ber_dupbv(&g->g_dn, dn);
+    ber_dupbv(&g->g_ndn, ndn);
+    if ( memberuid && memberuid->a_nvals ) {
+        for ( uid_idx = 0; ! BER_BVISNULL(&memberuid->a_nvals[uid_idx]); uid_idx++ ) {
+            ber_bvarray_add(&g->g_uids, ber_dupbv(NULL, &memberuid->a_nvals[uid_idx]));
+        }
+    }
+    if ( ldap_avl_insert(&idx->groups, g, automember_idx_group_cmp, ldap_avl_dup_error) ) {
+        /* Cannot happen since we just removed it, but don't leak: */
+        automember_idx_group_free(g);
+        return;
+    }
+    for ( uid_idx = 0; g->g_uids && ! BER_BVISNULL(&g->g_uids[uid_idx]); uid_idx++ ) {
+        automember_idx_uid_t    ukey, *u;
+
+        ukey.u_uid = g->g_uids[uid_idx];
+        u = (automember_idx_uid_t*)ldap_avl_find(idx->uids, &ukey, automember_idx_uid_cmp);
+        if ( ! u ) {
+            u = (automember_idx_uid_t*)ch_calloc(1, sizeof(automember_idx_uid_t));
+            ber_dupbv(&u->u_uid, &g->g_uids[uid_idx]);
+            ldap_avl_insert(&idx->uids, u, automember_idx_uid_cmp, ldap_avl_dup_error);
+        }
+        u->u_groups = (automember_idx_group_t**)ch_realloc(u->u_groups, (u->u_ngroups + 1) * sizeof(automember_idx_group_t*));
+        u->u_groups[u->u_ngroups++] = g;
+    }
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_idx_add_group:  added '%s'\n", g->g_dn.bv_val);
+}
+
+struct automember_idx_build_context {
+    automember_t        *am;
+    automember_index_t  *idx;
+};
+
+static int
+automember_idx_build_per_entry(
+    Operation       *op,
+    SlapReply       *rs
+)
+{
+    struct automember_idx_build_context *bc = (struct automember_idx_build_context*)op->o_callback->sc_private;
+    automember_t                        *am = bc->am;
+
+    if ( (rs->sr_type == REP_SEARCH) && rs->sr_entry ) {
+        automember_idx_add_group(bc->idx,
+                        &rs->sr_entry->e_name,
+                        &rs->sr_entry->e_nname,
+                        attr_find(rs->sr_entry->e_attrs, am->attr_memberuid));
+    }
+    return LDAP_SUCCESS;
+}
+
+/* Populate idx, a private (empty) index, from every group in the
+   database.  No lock is held:  see automember_idx_install(). */
+static int
+automember_idx_build(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    automember_index_t  *idx
+)
+{
+    static const char   *filter_fmt = "(objectClass=%s)";
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    slap_callback       sc = {0};
+    struct automember_idx_build_context bc;
+    AttributeName       an[2];
+    struct berval       filter_str;
+    int                 rc;
+
+    filter_str.bv_len = strlen(filter_fmt) - 2 + am->oc_member->soc_cname.bv_len;
+    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
+    if ( filter_str.bv_val == NULL ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_idx_build:  unable to allocate filter berval\n");
+        return LDAP_OTHER;
+    }
+    snprintf(filter_str.bv_val, filter_str.bv_len + 1, filter_fmt, am->oc_member->soc_cname.bv_val);
+    op2.ors_filter = str2filter_x(op, filter_str.bv_val);
+    if ( ! op2.ors_filter ) {
+        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_idx_build:  unable to allocate filter\n");
+        return LDAP_OTHER;
+    }
+    op2.ors_filterstr   = filter_str;
+
+    memset(an, 0, sizeof(an));
+    an[0].an_name       = am->attr_memberuid->ad_cname;
+    an[0].an_desc       = am->attr_memberuid;
+
+    op2.o_bd            = &be;
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = an;
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+
+    bc.am               = am;
+    bc.idx              = idx;
+    sc.sc_private       = &bc;
+    sc.sc_response      = automember_idx_build_per_entry;
+    op2.o_callback      = &sc;
+
+    rc = automember_group_search(am, &op2, "index-build");
+    filter_free_x(op, op2.ors_filter, 1);
+    ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+
+    if ( rc == LDAP_SUCCESS ) {
+        idx->is_valid = 1;
+        Debug(LDAP_DEBUG_STATS, "automember: automember_idx_build:  memberOf index built\n");
+    } else {
+        automember_idx_clear(idx);
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_idx_build:  search failed (rc=%d), index disabled until next lookup\n", rc);
+    }
+    return rc;
+}
+
+/* Swap the freshly built index fresh in for the instance's, holding the
+   write lock only for the swap.  Writes the index follows may have
+   landed while fresh was built (after the generation gen was read), and
+   the build may have missed them, so then fresh is thrown away; so it is
+   if the configuration changed meanwhile.  Returns non-zero if fresh was
+   installed; either way it's left empty. */
+static int
+automember_idx_install(
+    slap_overinst       *on,
+    automember_t        *am,
+    automember_index_t  *fresh,
+    unsigned long       gen
+)
+{
+    automember_index_t  *idx = &am->st->memberof_idx;
+    int                 installed = 0;
+
+    ldap_pvt_thread_rdwr_wlock(&idx->rwlock);
+    if ( idx->generation == gen && ! idx->is_valid && AUTOMEMBER_CONF_IS_CURRENT(on, am) ) {
+        automember_idx_clear(idx);
+        idx->groups = fresh->groups;
+        idx->uids = fresh->uids;
+        __atomic_store_n(&idx->is_valid, 1, __ATOMIC_RELEASE);
+        fresh->groups = NULL;
+        fresh->uids = NULL;
+        installed = 1;
+    }
+    ldap_pvt_thread_rdwr_wunlock(&idx->rwlock);
+    automember_idx_clear(fresh);
+    return installed;
+}
+
+/* Copy the DNs of the groups listing the (normalized) uid into a BerVarray
+   allocated in the operation's temp memory, and their normalized DNs too
+   if out_ndn_list isn't NULL.  Called with a lock held. */
+static void
+automember_idx_copy_dns(
+    Operation           *op,
+    automember_index_t  *idx,
+    struct berval       *nuid,
+    BerVarray           *out_dn_list,
+    BerVarray           *out_ndn_list
+)
+{
+    automember_idx_uid_t    ukey, *u;
+    BerVarray               dn_list = NULL, ndn_list = NULL;
+    int                     i;
+
+    ukey.u_uid = *nuid;
+    u = (automember_idx_uid_t*)ldap_avl_find(idx->uids, &ukey, automember_idx_uid_cmp);
+    if ( u && u->u_ngroups ) {
+        dn_list = (BerVarray)ber_memalloc_x((u->u_ngroups + 1) * sizeof(struct berval), op->o_tmpmemctx);
+        if ( out_ndn_list ) ndn_list = (BerVarray)ber_memalloc_x((u->u_ngroups + 1) * sizeof(struct berval), op->o_tmpmemctx);
+        for ( i = 0; i < u->u_ngroups; i++ ) {
+            ber_dupbv_x(&dn_list[i], &u->u_groups[i]->g_dn, op->o_tmpmemctx);
+            if ( ndn_list ) ber_dupbv_x(&ndn_list[i], &u->u_groups[i]->g_ndn, op->o_tmpmemctx);
+        }
+        BER_BVZERO(&dn_list[i]);
+        if ( ndn_list ) BER_BVZERO(&ndn_list[i]);
+    }
+    *out_dn_list = dn_list;
+    if ( out_ndn_list ) *out_ndn_list = ndn_list;
+}
+
+/* Answer memberOf for uid_value from the index.  Returns LDAP_SUCCESS when
+   the index answered (*out_dn_list may be NULL:  no memberships), anything
+   else means the caller must fall back to searching the backend.  The
+   normalized DNs go to *out_ndn_list, unless that is NULL. */
+static int
+automember_idx_lookup(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *uid_value,
+    BerVarray           *out_dn_list,
+    BerVarray           *out_ndn_list
+)
+{
+    automember_index_t  *idx = &am->st->memberof_idx;
+    struct berval       nuid = BER_BVNULL;
+    int                 rc = LDAP_SUCCESS;
+
+    *out_dn_list = NULL;
+    if ( out_ndn_list ) *out_ndn_list = NULL;
+
+    /* Group keys are normalized memberUid values, so normalize the uid the
+       same way the (memberUid=<uid>) filter would have: */
+    if ( attr_normalize_one(am->attr_memberuid, uid_value, &nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) {
+        return LDAP_INVALID_SYNTAX;
+    }
+
+    /* Never wait for the index:  while it's unbuilt, or a write holds
+       it, searching is quicker. */
+    rc = LDAP_OTHER;
+    if ( ! __atomic_load_n(&idx->is_valid, __ATOMIC_ACQUIRE) ) {
+        /* Build it on a pool thread and search meanwhile: */
+        automember_idx_schedule(on, am);
+    } else if ( ldap_pvt_thread_rdwr_rtrylock(&idx->rwlock) == 0 ) {
+        if ( idx->is_valid ) {
+            automember_idx_copy_dns(op, idx, BER_BVISNULL(&nuid) ? uid_value : &nuid, out_dn_list, out_ndn_list);
+            rc = LDAP_SUCCESS;
+        }
+        ldap_pvt_thread_rdwr_runlock(&idx->rwlock);
+        if ( rc != LDAP_SUCCESS ) automember_idx_schedule(on, am);
+    }
+    if ( ! BER_BVISNULL(&nuid) ) ber_memfree_x(nuid.bv_val, op->o_tmpmemctx);
+
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_idx_lookup:  uid '%s' %s\n", uid_value->bv_val,
+                (rc == LDAP_SUCCESS) ? "answered from index" : "not answered, falling back");
+    return rc;
+}
+
+static int
+automember_idx_is_subordinate(
+    void            *v,
+    void            *arg
+)
+{
+    automember_idx_group_t  *g = (automember_idx_group_t*)v;
+
+    return dnIsSuffix(&g->g_ndn, (struct berval*)arg) ? -1 : 0;
+}
+
+/* Bring the index up to date after a successful write.  Groups are re-read
+   after the write commits (rather than diffed from the request), with the
+   write lock held, so concurrent writes to one group always leave the
+   index holding the last committed state. */
+static void
+automember_idx_update(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am
+)
+{
+    automember_index_t  *idx = &am->st->memberof_idx;
+    struct berval       *ndn = &op->o_req_ndn;
+    Entry               *e = NULL;
+
+    ldap_pvt_thread_rdwr_wlock(&idx->rwlock);
+    /* Counted even while the index is unbuilt, for the build under way: */
+    __atomic_add_fetch(&idx->generation, 1, __ATOMIC_RELEASE);
+    if ( ! idx->is_valid ) goto done;
+    if ( ! AUTOMEMBER_CONF_IS_CURRENT(on, am) ) {
+        /* The index may follow a newer configuration than this write: */
+        automember_idx_clear(idx);
+        goto done;
+    }
+
+    switch ( op->o_tag ) {
+        case LDAP_REQ_ADD:
+            if ( is_entry_objectclass_or_sub(op->ora_e, am->oc_member) && automember_group_in_bases(am, ndn) ) {
+                automember_idx_add_group(idx, &op->ora_e->e_name, &op->ora_e->e_nname,
+                                attr_find(op->ora_e->e_attrs, am->attr_memberuid));
+            }
+            break;
+
+        case LDAP_REQ_DELETE:
+            automember_idx_remove_group(idx, ndn);
+            break;
+
+        case LDAP_REQ_MODRDN:
+            automember_idx_remove_group(idx, ndn);
+            /* Renaming a subtree moves any groups beneath it; that isn't
+               worth tracking surgically: */
+            if ( ldap_avl_apply(idx->groups, automember_idx_is_subordinate, ndn, -1, AVL_INORDER) == -1 ) {
+                Debug(LDAP_DEBUG_TRACE, "automember: automember_idx_update:  groups renamed with subtree, invalidating index\n");
+                automember_idx_clear(idx);
+                goto done;
+            }
+            ndn = &op->orr_nnewDN;
+            /* FALLTHRU */
+
+        case LDAP_REQ_MODIFY:
+            if ( overlay_entry_get_ov(op, ndn, NULL, NULL, 0, &e, on) == LDAP_SUCCESS && e ) {
+                if ( is_entry_objectclass_or_sub(e, am->oc_member) && automember_group_in_bases(am, ndn) ) {
+                    automember_idx_add_group(idx, &e->e_name, &e->e_nname, attr_find(e->e_attrs, am->attr_memberuid));
+                } else {
+                    automember_idx_remove_group(idx, ndn);
+                }
+                overlay_entry_release_ov(op, e, 0, on);
+            } else {
+                Debug(LDAP_DEBUG_TRACE, "automember: automember_idx_update:  unable to re-read '%s', invalidating index\n", ndn->bv_val);
+                automember_idx_clear(idx);
+            }
+            break;
+    }
+
+done:
+    ldap_pvt_thread_rdwr_wunlock(&idx->rwlock);
+}
+
+/**************************/
+
+/* memberOf index snapshot:  after a restart the index would otherwise be
+   rebuilt by searching every group, on the first memberOf lookup (with
+   the backend's caches still cold).  With automember-memberof-snapshot
+   set, the index is saved to a file when the database closes (and when
+   the background build below completes), tagged with the database's
+   contextCSN and the configuration it reflects.  When the database opens
+   the file is mapped read-only and, if both tags still match, the index
+   is populated straight from it; if not, the index is built from the
+   database in the background.  Either way the work is done at startup
+   rather than on the clients' time.
+
+   The file is a compressed sparse row table, in host byte order:
+
+     header
+     groups[n_groups]   each group's DN and normalized DN (pool offsets)
+     uids[n_uids]       each normalized memberUid value, in index order,
+                        and its first edge
+     edges[n_edges]     group numbers:  uid i is listed by the groups in
+                        edges[uids[i].su_first] up to the next uid's first
+     pool               the strings, each NUL-terminated */
+
+#define AUTOMEMBER_SNAP_MAGIC       "AMSNAP01"
+#define AUTOMEMBER_SNAP_BYTEORDER   0x01020304u
+
+typedef struct automember_snap_header {
+    char                    sh_magic[8];
+    uint32_t                sh_byteorder;
+    uint32_t                sh_n_groups;
+    uint32_t                sh_n_uids;
+    uint32_t                sh_n_edges;
+    uint32_t                sh_pool_len;
+    uint32_t                sh_csn;             /* contextCSN value(s)          */
+    uint32_t                sh_csn_len;
+    uint32_t                sh_conf;            /* automember_snapshot_conf()   */
+    uint32_t                sh_conf_len;
+    uint32_t                sh_reserved;
+} automember_snap_header_t;
+
+typedef struct automember_snap_group {
+    uint32_t                sg_dn;
+    uint32_t                sg_dn_len;
+    uint32_t                sg_ndn;
+    uint32_t                sg_ndn_len;
+} automember_snap_group_t;
+
+typedef struct automember_snap_uid {
+    uint32_t                su_uid;
+    uint32_t                su_uid_len;
+    uint32_t                su_first;
+} automember_snap_uid_t;
+
+/* Helper: the database's contextCSN value(s), space separated, on the heap
+           (BER_BVNULL if it has none) */
+static void
+automember_snapshot_csn(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *csn
+)
+{
+    AttributeDescription    *ad = slap_schema.si_ad_contextCSN;
+    Entry               *e = NULL;
+    Attribute           *a;
+    char                *p;
+    int                 i;
+
+    BER_BVZERO(csn);
+    if ( overlay_entry_get_ov(op, &am->st->be->be_nsuffix[0], NULL, ad, 0, &e, on) != LDAP_SUCCESS || ! e ) return;
+    if ( (a = attr_find(e->e_attrs, ad)) != NULL && a->a_numvals ) {
+        for ( i = 0; i < a->a_numvals; i++ ) csn->bv_len += a->a_vals[i].bv_len + 1;
+        csn->bv_val = p = (char*)ch_malloc(csn->bv_len);
+        for ( i = 0; i < a->a_numvals; i++ ) {
+            if ( i ) *p++ = ' ';
+            p = lutil_strncopy(p, a->a_vals[i].bv_val, a->a_vals[i].bv_len);
+        }
+        *p = '\0';
+        csn->bv_len--;
+    }
+    overlay_entry_release_ov(op, e, 0, on);
+}
+
+/* Helper: what the index holds depends on, as a string on the heap:  the
+           group objectClass and the group bases */
+static void
+automember_snapshot_conf(
+    automember_t        *am,
+    struct berval       *conf
+)
+{
+    automember_base_t   *b;
+    ber_len_t           len = am->oc_member->soc_cname.bv_len + 1;
+    char                *p;
+
+    for ( b = am->group_bases; b; b = b->b_next ) len += b->b_ndn.bv_len + 16;
+    conf->bv_val = p = (char*)ch_malloc(len);
+    p = lutil_strcopy(p, am->oc_member->soc_cname.bv_val);
+    for ( b = am->group_bases; b; b = b->b_next ) {
+        p += snprintf(p, len - (p - conf->bv_val), " %s;%d", b->b_ndn.bv_val, b->b_scope);
+    }
+    conf->bv_len = p - conf->bv_val;
+}
+
+/* Collects the index's groups or uids, in order, for writing: */
+struct automember_snapshot_collect {
+    void                **items;
+    uint32_t            n_items;
+    uint32_t            max_items;
+};
+
+static int
+automember_snapshot_collect(
+    void                *v,
+    void                *arg
+)
+{
+    struct automember_snapshot_collect  *c = (struct automember_snapshot_collect*)arg;
+
+    if ( c->n_items == c->max_items ) {
+        c->max_items = c->max_items ? c->max_items * 2 : 1024;
+        c->items = (void**)ch_realloc(c->items, c->max_items * sizeof(void*));
+    }
+    c->items[c->n_items++] = v;
+    return 0;
+}
+
+static int
+automember_snapshot_group_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    return automember_idx_group_cmp(*(void* const*)v1, *(void* const*)v2);
+}
+
+/* Helper: append bv to the string pool at *pool_len, noting where it went */
+static void
+automember_snapshot_pool_add(
+    char                *pool,
+    uint32_t            *pool_len,
+    struct berval       *bv,
+    uint32_t            *off,
+    uint32_t            *len
+)
+{
+    *off = *pool_len;
+    *len = bv->bv_len;
+    memcpy(pool + *pool_len, bv->bv_val, bv->bv_len);
+    pool[*pool_len + bv->bv_len] = '\0';
+    *pool_len += bv->bv_len + 1;
+}
+
+/* Write the index (if valid) to the snapshot file, tagged with csn and
+   conf.  The file is written alongside and renamed into place, so a
+   reader never sees it half written. */
+static int
+automember_snapshot_save(
+    automember_t        *am,
+    struct berval       *csn,
+    struct berval       *conf
+)
+{
+    automember_index_t  *idx = &am->st->memberof_idx;
+    struct automember_snapshot_collect  groups = { 0 }, uids = { 0 };
+    automember_snap_header_t    *h;
+    automember_snap_group_t     *sg;
+    automember_snap_uid_t       *su;
+    uint32_t            *edges, n_edges = 0, pool_len = 0, i, j;
+    unsigned long long  pool_max, size;
+    char                *buf = NULL, *pool, *tmp_path;
+    FILE                *fp;
+    int                 rc = LDAP_OTHER;
+
+    if ( BER_BVISEMPTY(csn) ) {
+        Debug(LDAP_DEBUG_STATS, "automember: automember_snapshot_save:  database has no contextCSN, snapshot not saved\n");
+        return LDAP_OTHER;
+    }
+
+    ldap_pvt_thread_rdwr_rlock(&idx->rwlock);
+    if ( ! idx->is_valid ) {
+        ldap_pvt_thread_rdwr_runlock(&idx->rwlock);
+        return LDAP_OTHER;
+    }
+    ldap_avl_apply(idx->groups, automember_snapshot_collect, &groups, -1, AVL_INORDER);
+    ldap_avl_apply(idx->uids, automember_snapshot_collect, &uids, -1, AVL_INORDER);
+
+    pool_max = csn->bv_len + 1 + conf->bv_len + 1;
+    for ( i = 0; i < groups.n_items; i++ ) {
+        automember_idx_group_t  *g = (automember_idx_group_t*)groups.items[i];
+
+        pool_max += g->g_dn.bv_len + 1 + g->g_ndn.bv_len + 1;
+    }
+    for ( i = 0; i < uids.n_items; i++ ) {
+        automember_idx_uid_t    *u = (automember_idx_uid_t*)uids.items[i];
+
+        pool_max += u->u_uid.bv_len + 1;
+        n_edges += u->u_ngroups;
+    }
+    size = sizeof(automember_snap_header_t) + (unsigned long long)groups.n_items * sizeof(automember_snap_group_t) +
+                (unsigned long long)uids.n_items * sizeof(automember_snap_uid_t) + (unsigned long long)n_edges * sizeof(uint32_t) + pool_max;
+    if ( pool_max > UINT32_MAX || size > (size_t)-1 ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_snapshot_save:  index too large for a snapshot\n");
+        goto done;
+    }
+
+    buf = (char*)ch_calloc(1, size);
+    h = (automember_snap_header_t*)buf;
+    sg = (automember_snap_group_t*)(h + 1);
+    su = (automember_snap_uid_t*)(sg + groups.n_items);
+    edges = (uint32_t*)(su + uids.n_items);
+    pool = (char*)(edges + n_edges);
+
+    memcpy(h->sh_magic, AUTOMEMBER_SNAP_MAGIC, sizeof(h->sh_magic));
+    h->sh_byteorder = AUTOMEMBER_SNAP_BYTEORDER;
+    h->sh_n_groups = groups.n_items;
+    h->sh_n_uids = uids.n_items;
+    h->sh_n_edges = n_edges;
+    automember_snapshot_pool_add(pool, &pool_len, csn, &h->sh_csn, &h->sh_csn_len);
+    automember_snapshot_pool_add(pool, &pool_len, conf, &h->sh_conf, &h->sh_conf_len);
+    for ( i = 0; i < groups.n_items; i++ ) {
+        automember_idx_group_t  *g = (automember_idx_group_t*)groups.items[i];
+
+        automember_snapshot_pool_add(pool, &pool_len, &g->g_dn, &sg[i].sg_dn, &sg[i].sg_dn_len);
+        automember_snapshot_pool_add(pool, &pool_len, &g->g_ndn, &sg[i].sg_ndn, &sg[i].sg_ndn_len);
+    }
+    n_edges = 0;
+    for ( i = 0; i < uids.n_items; i++ ) {
+        automember_idx_uid_t    *u = (automember_idx_uid_t*)uids.items[i];
+
+        automember_snapshot_pool_add(pool, &pool_len, &u->u_uid, &su[i].su_uid, &su[i].su_uid_len);
+        su[i].su_first = n_edges;
+        /* The groups were collected in ndn order, so each is found by
+           bisection: */
+        for ( j = 0; j < u->u_ngroups; j++ ) {
+            void    **gp = bsearch(&u->u_groups[j], groups.items, groups.n_items, sizeof(void*), automember_snapshot_group_cmp);
+
+            edges[n_edges++] = gp - groups.items;
+        }
+    }
+    h->sh_pool_len = pool_len;
+    ldap_pvt_thread_rdwr_runlock(&idx->rwlock);
+
+    tmp_path = (char*)ch_malloc(strlen(am->snapshot_path) + sizeof(".tmp"));
+    sprintf(tmp_path, "%s.tmp", am->snapshot_path);
+    if ( (fp = fopen(tmp_path, "wb")) != NULL ) {
+        int     ok = (fwrite(buf, 1, size, fp) == size);
+
+        if ( fclose(fp) != 0 ) ok = 0;
+        if ( ok && rename(tmp_path, am->snapshot_path) == 0 ) {
+            rc = LDAP_SUCCESS;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    if ( rc == LDAP_SUCCESS ) {
+        Log(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO, "automember: automember_snapshot_save:  %u group(s), %u uid(s) saved to '%s'\n",
+                    h->sh_n_groups, h->sh_n_uids, am->snapshot_path);
+    } else {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_snapshot_save:  unable to write '%s': %s\n",
+                    am->snapshot_path, strerror(errno));
+    }
+    ch_free(tmp_path);
+    ch_free(buf);
+    ch_free(groups.items);
+    ch_free(uids.items);
+    return rc;
+
+done:
+    ldap_pvt_thread_rdwr_runlock(&idx->rwlock);
+    if ( groups.items ) ch_free(groups.items);
+    if ( uids.items ) ch_free(uids.items);
+    return rc;
+}
+
+/* Helper: is (off, len) a NUL-terminated string within the pool? */
+#define AUTOMEMBER_SNAP_STR_OK(h, off, len) \
+    ((off) < (h)->sh_pool_len && (len) < (h)->sh_pool_len - (off))
+
+/* Populate idx, a private (empty) index, from the snapshot file, provided
+   it is intact and tagged with csn and conf. */
+static int
+automember_snapshot_load(
+    automember_t        *am,
+    automember_index_t  *idx,
+    struct berval       *csn,
+    struct berval       *conf
+)
+{
+    automember_snap_header_t    *h;
+    automember_snap_group_t     *sg;
+    automember_snap_uid_t       *su;
+    automember_idx_group_t      **groups = NULL;
+    uint32_t            *edges, *fill = NULL, i, j;
+    struct stat         st;
+    char                *base, *pool;
+    const char          *why = NULL;
+    int                 fd;
+
+    if ( BER_BVISEMPTY(csn) ) {
+        Debug(LDAP_DEBUG_STATS, "automember: automember_snapshot_load:  database has no contextCSN, snapshot not trusted\n");
+        return LDAP_OTHER;
+    }
+    if ( (fd = open(am->snapshot_path, O_RDONLY)) < 0 ) {
+        Debug(LDAP_DEBUG_STATS, "automember: automember_snapshot_load:  no snapshot at '%s'\n", am->snapshot_path);
+        return LDAP_OTHER;
+    }
+    if ( fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(automember_snap_header_t) ) {
+        close(fd);
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_snapshot_load:  '%s' is truncated\n", am->snapshot_path);
+        return LDAP_OTHER;
+    }
+    base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( base == (char*)MAP_FAILED ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_snapshot_load:  unable to map '%s': %s\n", am->snapshot_path, strerror(errno));
+        return LDAP_OTHER;
+    }
+
+    /* Nothing in the file is trusted until it has been checked: */
+    h = (automember_snap_header_t*)base;
+    sg = (automember_snap_group_t*)(h + 1);
+    su = (automember_snap_uid_t*)(sg + h->sh_n_groups);
+    edges = (uint32_t*)(su + h->sh_n_uids);
+    pool = (char*)(edges + h->sh_n_edges);
+    if ( memcmp(h->sh_magic, AUTOMEMBER_SNAP_MAGIC, sizeof(h->sh_magic)) != 0 || h->sh_byteorder != AUTOMEMBER_SNAP_BYTEORDER ) {
+        why = "not a snapshot written on this kind of host";
+        goto fail;
+    }
+    if ( (unsigned long long)st.st_size != sizeof(automember_snap_header_t) +
+                (unsigned long long)h->sh_n_groups * sizeof(automember_snap_group_t) +
+                (unsigned long long)h->sh_n_uids * sizeof(automember_snap_uid_t) +
+                (unsigned long long)h->sh_n_edges * sizeof(uint32_t) + h->sh_pool_len )
+    {
+        why = "truncated";
+        goto fail;
+    }
+    if ( ! AUTOMEMBER_SNAP_STR_OK(h, h->sh_csn, h->sh_csn_len) || ! AUTOMEMBER_SNAP_STR_OK(h, h->sh_conf, h->sh_conf_len) ) {
+        why = "corrupt";
+        goto fail;
+    }
+    if ( h->sh_csn_len != csn->bv_len || memcmp(pool + h->sh_csn, csn->bv_val, csn->bv_len) != 0 ) {
+        why = "older than the database";
+        goto fail;
+    }
+    if ( h->sh_conf_len != conf->bv_len || memcmp(pool + h->sh_conf, conf->bv_val, conf->bv_len) != 0 ) {
+        why = "for another configuration";
+        goto fail;
+    }
+
+    /* Groups first, each with room for exactly as many uids as list it: */
+    groups = (automember_idx_group_t**)ch_calloc(h->sh_n_groups + 1, sizeof(automember_idx_group_t*));
+    fill = (uint32_t*)ch_calloc(h->sh_n_groups + 1, sizeof(uint32_t));
+    for ( i = 0; i < h->sh_n_edges; i++ ) {
+        if ( edges[i] >= h->sh_n_groups ) {
+            why = "corrupt";
+            goto fail;
+        }
+        fill[edges[i]]++;
+    }
+    for ( i = 0; i < h->sh_n_groups; i++ ) {
+        automember_idx_group_t  *g;
+
+        if ( ! AUTOMEMBER_SNAP_STR_OK(h, sg[i].sg_dn, sg[i].sg_dn_len) || ! AUTOMEMBER_SNAP_STR_OK(h, sg[i].sg_ndn, sg[i].sg_ndn_len) ) {
+            why = "corrupt";
+            goto fail;
+        }
+        g = (automember_idx_group_t*)ch_calloc(1, sizeof(automember_idx_group_t));
+        ber_str2bv(pool + sg[i].sg_dn, sg[i].sg_dn_len, 1, &g->g_dn);
+        ber_str2bv(pool + sg[i].sg_ndn, sg[i].sg_ndn_len, 1, &g->g_ndn);
+        if ( fill[i] ) g->g_uids = (BerVarray)ch_calloc(fill[i] + 1, sizeof(struct berval));
+        if ( ldap_avl_insert(&idx->groups, g, automember_idx_group_cmp, ldap_avl_dup_error) ) {
+            automember_idx_group_free(g);
+            why = "corrupt";
+            goto fail;
+        }
+        groups[i] = g;
+        fill[i] = 0;
+    }
+
+    /* ...then each uid, linked both ways: */
+    for ( i = 0; i < h->sh_n_uids; i++ ) {
+        uint32_t                last = ( i + 1 < h->sh_n_uids ) ? su[i + 1].su_first : h->sh_n_edges;
+        automember_idx_uid_t    *u;
+
+        if ( ! AUTOMEMBER_SNAP_STR_OK(h, su[i].su_uid, su[i].su_uid_len) || su[i].su_first >= last || last > h->sh_n_edges ) {
+            why = "corrupt";
+            goto fail;
+        }
+        u = (automember_idx_uid_t*)ch_calloc(1, sizeof(automember_idx_uid_t));
+        ber_str2bv(pool + su[i].su_uid, su[i].su_uid_len, 1, &u->u_uid);
+        u->u_groups = (automember_idx_group_t**)ch_malloc((last - su[i].su_first) * sizeof(automember_idx_group_t*));
+        if ( ldap_avl_insert(&idx->uids, u, automember_idx_uid_cmp, ldap_avl_dup_error) ) {
+            automember_idx_uid_free(u);
+            why = "corrupt";
+            goto fail;
+        }
+        for ( j = su[i].su_first; j < last; j++ ) {
+            automember_idx_group_t  *g = groups[edges[j]];
+
+            u->u_groups[u->u_ngroups++] = g;
+            ber_dupbv(&g->g_uids[fill[edges[j]]++], &u->u_uid);
+        }
+    }
+    idx->is_valid = 1;
+    Log(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO, "automember: automember_snapshot_load:  %u group(s), %u uid(s) loaded from '%s'\n",
+                h->sh_n_groups, h->sh_n_uids, am->snapshot_path);
+    ch_free(groups);
+    ch_free(fill);
+    munmap(base, st.st_size);
+    return LDAP_SUCCESS;
+
+fail:
+    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_snapshot_load:  '%s' is %s, ignored\n", am->snapshot_path, why);
+    automember_idx_clear(idx);
+    if ( groups ) ch_free(groups);
+    if ( fill ) ch_free(fill);
+    munmap(base, st.st_size);
+    return LDAP_OTHER;
+}
+
+/* Helper: set op up as an internal operation on the database, below us */
+static void
+automember_snapshot_op(
+    Operation           *op,
+    BackendDB           *be,
+    slap_overinst       *on,
+    automember_t        *am
+)
+{
+    *be = *am->st->be;
+    be->bd_info = (BackendInfo*)on;
+    op->o_bd = be;
+    op->o_dn = be->be_rootdn;
+    op->o_ndn = be->be_rootndn;
+}
+
+/* Is a snapshot to be kept? */
+#define AUTOMEMBER_SNAPSHOT_ENABLED(am) \
+    ((am)->snapshot_path && (am)->use_memberof_idx && (am)->oc_member && (am)->st->be && (slapMode & SLAP_SERVER_MODE))
+
+/* Times a build is redone when writes keep landing while it runs: */
+#define AUTOMEMBER_IDX_BUILD_TRIES  3
+
+/* Build the index afresh and install it (see automember_idx_install()),
+   building again if writes raced the build.  With csn non-NULL the
+   snapshot tagged with csn and conf is tried first; *from_db is set if
+   the index installed was this build's, read from the database. */
+static int
+automember_idx_refresh(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    struct berval           *csn,
+    struct berval           *conf,
+    int                     *from_db
+)
+{
+    automember_index_t      *idx = &am->st->memberof_idx;
+    int                     tries, rc;
+
+    *from_db = 0;
+    for ( tries = 0; tries < AUTOMEMBER_IDX_BUILD_TRIES; tries++ ) {
+        automember_index_t  fresh;
+        unsigned long       gen = __atomic_load_n(&idx->generation, __ATOMIC_ACQUIRE);
+
+        memset(&fresh, 0, sizeof(fresh));
+        if ( tries == 0 && csn && automember_snapshot_load(am, &fresh, csn, conf) == LDAP_SUCCESS ) {
+            *from_db = 0;
+        } else if ( (rc = automember_idx_build(op, on, am, &fresh)) == LDAP_SUCCESS ) {
+            *from_db = 1;
+        } else {
+            return rc;
+        }
+        if ( automember_idx_install(on, am, &fresh, gen) ) return LDAP_SUCCESS;
+        *from_db = 0;
+        /* Another build got there first: */
+        if ( __atomic_load_n(&idx->is_valid, __ATOMIC_ACQUIRE) ) return LDAP_SUCCESS;
+        if ( ! AUTOMEMBER_CONF_IS_CURRENT(on, am) ) break;
+        Debug(LDAP_DEBUG_STATS, "automember: automember_idx_refresh:  groups changed during build, building again\n");
+    }
+    Debug(LDAP_DEBUG_STATS, "automember: automember_idx_refresh:  index discarded, groups or configuration changed during build\n");
+    return LDAP_OTHER;
+}
+
+/* (Re)build the index on a pool thread:  from the snapshot if one is kept
+   and still current (at startup), else from the database, saving a fresh
+   snapshot if one is kept.  Scheduled when the database opens, and by
+   lookups that find the index invalid, which search meanwhile. */
+static void*
+automember_idx_task(
+    void                    *thrctx,
+    void                    *arg
+)
+{
+    slap_overinst           *on = (slap_overinst*)arg;
+    int                     conf_slot;
+    automember_t            *am = automember_conf_get(on, &conf_slot);
+    automember_index_t      *idx = &am->st->memberof_idx;
+    Connection              conn = { 0 };
+    OperationBuffer         opbuf;
+    Operation               *op;
+    BackendDB               be;
+    struct berval           csn = BER_BVNULL, conf = BER_BVNULL;
+    int                     snapshot = AUTOMEMBER_SNAPSHOT_ENABLED(am);
+    int                     built = 0;
+
+    connection_fake_init(&conn, &opbuf, thrctx);
+    op = &opbuf.ob_op;
+    automember_snapshot_op(op, &be, on, am);
+
+    /* Read before the index is:  writes in between can only make a saved
+       snapshot look older than it is, never newer. */
+    if ( snapshot ) {
+        automember_snapshot_csn(op, on, am, &csn);
+        automember_snapshot_conf(am, &conf);
+    }
+
+    /* The index is built without its lock, so lookups meanwhile search: */
+    if ( ! __atomic_load_n(&idx->is_valid, __ATOMIC_ACQUIRE) && am->use_memberof_idx && am->oc_member &&
+         automember_idx_refresh(op, on, am, snapshot ? &csn : NULL, &conf, &built) != LDAP_SUCCESS )
+    {
+        built = 0;
+    }
+    /* An invalidation after this point is seen by the next lookup, which
+       schedules another build: */
+    __atomic_store_n(&idx->build_pending, 0, __ATOMIC_RELEASE);
+
+    if ( built && snapshot ) automember_snapshot_save(am, &csn, &conf);
+    if ( csn.bv_val ) ch_free(csn.bv_val);
+    if ( conf.bv_val ) ch_free(conf.bv_val);
+    automember_conf_put(on, conf_slot);
+    return NULL;
+}
+
+/* Queue a build of the index, unless one is already queued or running */
+static void
+automember_idx_schedule(
+    slap_overinst           *on,
+    automember_t            *am
+)
+{
+    automember_index_t      *idx = &am->st->memberof_idx;
+
+    if ( __atomic_exchange_n(&idx->build_pending, 1, __ATOMIC_ACQ_REL) ) return;
+    if ( ldap_pvt_thread_pool_submit(&connection_pool, automember_idx_task, on) != 0 ) {
+        __atomic_store_n(&idx->build_pending, 0, __ATOMIC_RELEASE);
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_idx_schedule:  unable to schedule the memberOf index build\n");
+    }
+}
+
+
+/* Helper: the (single) uid value of a person entry, or NULL if it has
+           none or more than one */
+static struct berval*
+automember_entry_uid(
+    automember_t        *am,
+    Entry               *e
+)
+{
+    Attribute           *uid = attr_find(e->e_attrs, am->attr_uid);
+    int                 attr_idx;
+    
+    if ( uid == NULL ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO, "automember: automember_entry_uid:  no uid attribute on entry\n");
+        return NULL;
+    }
+    if ( ! uid->a_vals || ! uid->a_vals[0].bv_val ) {
+        /* Empty attribute list: */
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO, "automember: automember_entry_uid:  no uid attribute values on entry\n");
+        return NULL;
+    }
+    /* Count how many attribute values: */
+    for ( attr_idx=0; uid->a_vals[attr_idx].bv_val; attr_idx++ );
+    if ( attr_idx > 1 ) {
+        /* Too many values in attribute list: */
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_entry_uid:  too many uid attribute values (%d)\n", attr_idx);
+        return NULL;
+    }
+    return &uid->a_vals[0];
+}
+
+/* Helper: the DNs of the groups listing uid_value (NULL if none),
+           allocated in the operation's temp memory, with their normalized
+           DNs in *out_ndn_list if that isn't NULL */
+static int
+automember_uid_memberof(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *uid_value,
+    BerVarray           *out_dn_list,
+    BerVarray           *out_ndn_list
+)
+{
+    int                 rc = LDAP_OTHER;
+    
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_uid_memberof:  lookup group memberships for uid '%s'\n", uid_value->bv_val);
+    
+    /* Try the index first and fall back to searching the backend: */
+    if ( am->use_memberof_idx ) {
+        rc = automember_idx_lookup(op, on, am, uid_value, out_dn_list, out_ndn_list);
+    }
+    if ( rc != LDAP_SUCCESS ) {
+        rc = automember_collect_memberof_dn(op, on, am, uid_value, out_dn_list, out_ndn_list);
+    }
+    return rc;
+}
+
+/* Helper: as automember_uid_memberof(), for person entry e's uid */
+static int
+automember_person_memberof(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    Entry               *e,
+    BerVarray           *out_dn_list,
+    BerVarray           *out_ndn_list
+)
+{
+    struct berval       *uid_value = automember_entry_uid(am, e);
+    
+    *out_dn_list = NULL;
+    if ( out_ndn_list ) *out_ndn_list = NULL;
+    if ( uid_value == NULL ) return LDAP_SUCCESS;
+    return automember_uid_memberof(op, on, am, uid_value, out_dn_list, out_ndn_list);
+}
+
+static int
+automember_populate_memberof_attr(
+    Operation                   *op,
+    SlapReply                   *rs,
+    slap_overinst               *on,
+    automember_t                *am,
+    const automember_attr_req_t *req
+)
+{
+    int                 rc = SLAP_CB_CONTINUE;
+    Entry               *orig_e = rs->sr_entry;
+    automember_timer_t  timer;
+    
+    AUTOMEMBER_TIMER_START(am, timer);
+    if ( req->memberof ) {
+        Attribute               *memberof = attr_find(orig_e->e_attrs, am->attr_memberof);
+        
+        if ( memberof == NULL ) {
+            BerVarray               dn_list = NULL, ndn_list = NULL;
+            
+            rc = automember_person_memberof(op, on, am, orig_e, &dn_list, &ndn_list);
+            if ( (rc == LDAP_SUCCESS) && dn_list ) {                
+                Entry                   synth = { 0 };
+                
+                AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED, 1);
+            
+                /* Build the memberOf attribute on its own (the entry has
+                   none, so there's nothing to merge with) and add it: */
+                if ( automember_memberof_merge(op, on, am, &synth, dn_list, ndn_list) != 0 ) {
+                    Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_populate_member_attr:  failed to append memberOf attribute to entry\n");
+                    attrs_free(synth.e_attrs);
+                } else {
+                    automember_entry_add_attrs(op, rs, on, am, synth.e_attrs);
+                }
+                ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+                if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+            }
+            rc = SLAP_CB_CONTINUE;
+        }
+    }
+    AUTOMEMBER_TIMER_STOP(am, AUTOMEMBER_PATH_MEMBEROF, timer);
+    return rc;
+}
+
+/**************************/
+
+/* Materialize mode:  rather than synthesizing member and memberOf on every
+   read, the overlay stores them and keeps them current as groups and
+   people are written.  memberUid remains the attribute clients maintain:
+
+     group add              member computed onto the new entry; memberOf
+                            added to each listed person
+     group modify           member replaced; memberOf added to (removed
+                            from) the people whose uids came (went)
+     group delete/modrdn    memberOf removed from (renamed on) each listed
+                            person
+     person add             memberOf computed onto the new entry
+     person modify/modrdn   memberOf recomputed if the uid may have changed
+
+   Reads are then served by the backend as-is.  automember_rebuild_task()
+   brings existing data into line. */
+
+/* Per-write state, hung off our callback: */
+typedef struct automember_write_ctx {
+    slap_callback           sc;             /* MUST be first */
+    slap_overinst           *on;
+    automember_t            *am;            /* The configuration it started with   */
+    int                     conf_slot;      /* ...as held                          */
+    int                     is_group;       /* Group membership may have changed   */
+    int                     is_person;      /* Person's uid may have changed       */
+    BerVarray               old_uids;       /* Group's normalized memberUid values
+                                               before the write                    */
+    int                     uids_changed;   /* Entry's uid values may have changed */
+    BerVarray               old_person_uids;/* ...its normalized uid values before
+                                               the write                           */
+    BerVarray               new_person_uids;/* ...and after it (when materializing) */
+    int                     resolve_flush;  /* People may have moved wholesale     */
+} automember_write_ctx_t;
+
+/* Our own writes carry one of these on o_extra, so the write hook lets
+   them through rather than reacting to (and repeating) them: */
+typedef struct automember_internal_mark {
+    OpExtra                 oe;             /* oe_key is &automember_internal_key */
+    slap_overinst           *on;
+} automember_internal_mark_t;
+
+static char automember_internal_key;
+
+/* Helper: was op issued by this overlay instance itself? */
+static int
+automember_op_is_internal(
+    Operation               *op,
+    slap_overinst           *on
+)
+{
+    OpExtra                 *oex;
+
+    LDAP_SLIST_FOREACH( oex, &op->o_extra, oe_next ) {
+        if ( oex->oe_key == &automember_internal_key && ((automember_internal_mark_t*)oex)->on == on ) return 1;
+    }
+    return 0;
+}
+
+static int
+automember_bv_cmp(
+    const void      *v1,
+    const void      *v2
+)
+{
+    return ber_bvcmp((const struct berval*)v1, (const struct berval*)v2);
+}
+
+/* Helper: the values of a that are not in b, as a shallow NULL-terminated
+           list (NULL if there are none); both are sorted in place */
+static BerVarray
+automember_bvarray_minus(
+    BerVarray       a,
+    BerVarray       b,
+    void            *memctx
+)
+{
+    BerVarray       out;
+    int             n_a = 0, n_b = 0, n = 0, i, j = 0;
+    
+    if ( a ) while ( ! BER_BVISNULL(&a[n_a]) ) n_a++;
+    if ( b ) while ( ! BER_BVISNULL(&b[n_b]) ) n_b++;
+    if ( n_a == 0 ) return NULL;
+    
+    qsort(a, n_a, sizeof(struct berval), automember_bv_cmp);
+    if ( n_b ) qsort(b, n_b, sizeof(struct berval), automember_bv_cmp);
+    
+    out = (BerVarray)ber_memalloc_x((n_a + 1) * sizeof(struct berval), memctx);
+    for ( i = 0; i < n_a; i++ ) {
+        while ( j < n_b && ber_bvcmp(&b[j], &a[i]) < 0 ) j++;
+        if ( j < n_b && ber_bvcmp(&b[j], &a[i]) == 0 ) continue;
+        out[n++] = a[i];
+    }
+    BER_BVZERO(&out[n]);
+    if ( n == 0 ) {
+        ber_memfree_x(out, memctx);
+        out = NULL;
+    }
+    return out;
+}
+
+/* Helper: do the stored values of a match vals (in any order)? */
+static int
+automember_values_match(
+    Attribute       *a,
+    BerVarray       vals
+)
+{
+    int             n = 0, i, j;
+    
+    if ( vals ) while ( ! BER_BVISNULL(&vals[n]) ) n++;
+    if ( ! a ) return n == 0;
+    if ( a->a_numvals != n ) return 0;
+    for ( i = 0; i < n; i++ ) {
+        for ( j = 0; j < a->a_numvals && ! bvmatch(&a->a_vals[j], &vals[i]); j++ );
+        if ( j == a->a_numvals ) return 0;
+    }
+    return 1;
+}
+
+/* Helper: fill in a single internal modification */
+static void
+automember_mod_init(
+    Modifications           *mod,
+    short                   mod_op,
+    AttributeDescription    *ad,
+    BerVarray               vals,
+    BerVarray               nvals
+)
+{
+    memset(mod, 0, sizeof(*mod));
+    mod->sml_op = mod_op;
+    mod->sml_flags = SLAP_MOD_INTERNAL;
+    mod->sml_desc = ad;
+    mod->sml_type = ad->ad_cname;
+    mod->sml_values = vals;
+    mod->sml_nvalues = nvals;
+    if ( vals ) while ( ! BER_BVISNULL(&vals[mod->sml_numvals]) ) mod->sml_numvals++;
+}
+
+/* Helper: apply mods to an entry in the underlying database, provided it
+           matches assertion (if not NULL) */
+static int
+automember_internal_modify(
+    Operation           *op,
+    slap_overinst       *on,
+    struct berval       *dn,
+    struct berval       *ndn,
+    Modifications       *mods,
+    Filter              *assertion
+)
+{
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    SlapReply           rs2 = { REP_RESULT };
+    slap_callback       sc = { NULL, slap_null_cb, NULL, NULL };
+    automember_internal_mark_t  mark;
+    int                 rc;
+    
+    /* The write passes down the whole stack, ourselves included: */
+    mark.oe.oe_key      = &automember_internal_key;
+    mark.on             = on;
+    LDAP_SLIST_INSERT_HEAD(&op2.o_extra, &mark.oe, oe_next);
+    
+    op2.o_bd            = &be;
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    op2.o_tag           = LDAP_REQ_MODIFY;
+    op2.o_req_dn        = *dn;
+    op2.o_req_ndn       = *ndn;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.orm_modlist     = mods;
+    op2.orm_increment   = 0;
+    op2.orm_no_opattrs  = 0;
+    op2.o_callback      = &sc;
+    /* Never the client's assertion: */
+    op2.o_assertion     = assertion;
+    op2.o_assert        = assertion ? SLAP_CONTROL_CRITICAL : SLAP_CONTROL_NONE;
+    
+    rc = op2.o_bd->be_modify(&op2, &rs2);
+    if ( rc == LDAP_ASSERTION_FAILED && assertion ) {
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_internal_modify:  '%s' changed meanwhile, not modified\n", dn->bv_val);
+    } else if ( rc != LDAP_SUCCESS ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_internal_modify:  modify of '%s' failed (rc=%d)\n", dn->bv_val, rc);
+    }
+    return rc;
+}
+
+/* Helper: replace the stored values of ad on an entry (no values deletes
+           the attribute), provided it matches assertion (if not NULL) */
+static int
+automember_replace_values(
+    Operation               *op,
+    slap_overinst           *on,
+    struct berval           *dn,
+    struct berval           *ndn,
+    AttributeDescription    *ad,
+    BerVarray               vals,
+    Filter                  *assertion
+)
+{
+    Modifications           mod;
+    BerVarray               nvals = NULL;
+    int                     rc;
+    
+    if ( vals && attr_normalize(ad, vals, &nvals, op->o_tmpmemctx) != LDAP_SUCCESS ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_replace_values:  unable to normalize %s values for '%s'\n",
+                    ad->ad_cname.bv_val, dn->bv_val);
+        return LDAP_INVALID_SYNTAX;
+    }
+    automember_mod_init(&mod, LDAP_MOD_REPLACE, ad, vals, nvals);
+    rc = automember_internal_modify(op, on, dn, ndn, &mod, assertion);
+    if ( nvals ) ber_bvarray_free_x(nvals, op->o_tmpmemctx);
+    return rc;
+}
+
+/* Remove one group DN from (del_dn) and/or add another to (add_dn) the
+   memberOf values of every person whose uid is listed */
+static void
+automember_people_memberof(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    BerVarray           uids,
+    struct berval       *del_dn,
+    struct berval       *del_ndn,
+    struct berval       *add_dn,
+    struct berval       *add_ndn
+)
+{
+    static const char   *filter_head = "(&(objectClass=";
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    SlapReply           rs2 = { REP_RESULT };
+    slap_callback       sc = {0};
+    struct automember_collect_memberof_context  sc_ctxt;
+    struct berval       *at_name = &am->attr_uid->ad_cname;
+    struct berval       *esc_vals;
+    struct berval       filter_str;
+    BerVarray           dn_list = NULL, ndn_list = NULL;
+    char                *p;
+    int                 i, n_uids = 0, rc;
+    
+    if ( ! uids || ! am->oc_memberof ) return;
+    while ( ! BER_BVISNULL(&uids[n_uids]) ) n_uids++;
+    if ( n_uids == 0 ) return;
+    
+    /* Find the people:  (&(objectClass=<oc>)(|(uid=<uid-1>)(uid=<uid-2>)...)) */
+    esc_vals = (struct berval*)ber_memcalloc_x(n_uids, sizeof(struct berval), op->o_tmpmemctx);
+    filter_str.bv_len = strlen(filter_head) + am->oc_memberof->soc_cname.bv_len + STRLENOF(")(|") + STRLENOF("))");
+    for ( i = 0; i < n_uids; i++ ) {
+        filter_escape_value_x(&uids[i], &esc_vals[i], op->o_tmpmemctx);
+        filter_str.bv_len += STRLENOF("(=)") + at_name->bv_len + esc_vals[i].bv_len;
+    }
+    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
+    p = lutil_strcopy(filter_str.bv_val, filter_head);
+    p = lutil_strncopy(p, am->oc_memberof->soc_cname.bv_val, am->oc_memberof->soc_cname.bv_len);
+    p = lutil_strcopy(p, ")(|");
+    for ( i = 0; i < n_uids; i++ ) {
+        *p++ = '(';
+        p = lutil_strncopy(p, at_name->bv_val, at_name->bv_len);
+        *p++ = '=';
+        p = lutil_strncopy(p, esc_vals[i].bv_val, esc_vals[i].bv_len);
+        *p++ = ')';
+        ber_memfree_x(esc_vals[i].bv_val, op->o_tmpmemctx);
+    }
+    lutil_strcopy(p, "))");
+    ber_memfree_x(esc_vals, op->o_tmpmemctx);
+    
+    op2.ors_filter = str2filter_x(op, filter_str.bv_val);
+    if ( ! op2.ors_filter ) {
+        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_people_memberof:  unable to allocate filter\n");
+        return;
+    }
+    op2.ors_filterstr   = filter_str;
+    
+    op2.o_bd            = &be;
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_req_dn        = op->o_bd->be_suffix[0];
+    op2.o_req_ndn       = op->o_bd->be_nsuffix[0];
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.ors_scope       = LDAP_SCOPE_SUBTREE;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = slap_anlist_no_attrs;      /* DNs only */
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+    
+    memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+    sc_ctxt.dn_list     = &dn_list;
+    sc_ctxt.ndn_list    = &ndn_list;
+    sc_ctxt.memctx      = op->o_tmpmemctx;
+    sc.sc_private       = &sc_ctxt;
+    sc.sc_response      = automember_collect_memberof_dn_per_entry;
+    op2.o_callback      = &sc;
+    
+    AUTOMEMBER_BE_SEARCH(rc, "materialize", &op2, &rs2);
+    filter_free_x(op, op2.ors_filter, 1);
+    ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_people_memberof:  %d uid(s) searched (rc=%d)\n", n_uids, rc);
+    
+    /* The write has already committed, so update whoever was found: */
+    for ( i = 0; dn_list && ! BER_BVISNULL(&dn_list[i]); i++ ) {
+        Modifications   mods[2], *ml = NULL;
+        struct berval   del_vals[2], del_nvals[2], add_vals[2], add_nvals[2];
+        
+        if ( add_dn ) {
+            add_vals[0] = *add_dn; BER_BVZERO(&add_vals[1]);
+            add_nvals[0] = *add_ndn; BER_BVZERO(&add_nvals[1]);
+            automember_mod_init(&mods[1], SLAP_MOD_SOFTADD, am->attr_memberof, add_vals, add_nvals);
+            ml = &mods[1];
+        }
+        if ( del_dn ) {
+            del_vals[0] = *del_dn; BER_BVZERO(&del_vals[1]);
+            del_nvals[0] = *del_ndn; BER_BVZERO(&del_nvals[1]);
+            automember_mod_init(&mods[0], SLAP_MOD_SOFTDEL, am->attr_memberof, del_vals, del_nvals);
+            mods[0].sml_next = ml;
+            ml = &mods[0];
+        }
+        if ( ml ) automember_internal_modify(op, on, &dn_list[i], &ndn_list[i], ml, NULL);
+    }
+    if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+    if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+}
+
+/* Recompute the stored memberOf of the person at ndn */
+static void
+automember_person_refresh(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    struct berval       *ndn
+)
+{
+    Entry               *e = NULL;
+    BerVarray           dn_list = NULL;
+    struct berval       dn;
+    int                 rc;
+    
+    if ( overlay_entry_get_ov(op, ndn, NULL, NULL, 0, &e, on) != LDAP_SUCCESS || ! e ) return;
+    if ( ! is_entry_objectclass_or_sub(e, am->oc_memberof) ) {
+        overlay_entry_release_ov(op, e, 0, on);
+        return;
+    }
+    rc = automember_person_memberof(op, on, am, e, &dn_list, NULL);
+    ber_dupbv_x(&dn, &e->e_name, op->o_tmpmemctx);
+    overlay_entry_release_ov(op, e, 0, on);
+    
+    if ( rc == LDAP_SUCCESS ) automember_replace_values(op, on, &dn, ndn, am->attr_memberof, dn_list, NULL);
+    if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+    ber_memfree_x(dn.bv_val, op->o_tmpmemctx);
+}
+
+/* Bring a modified group's member values, and the memberOf values of the
+   people who joined or left it, into line with its memberUid values */
+static void
+automember_group_refresh(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    struct berval           *ndn = &op->o_req_ndn;
+    Entry                   *e = NULL;
+    Attribute               *a;
+    BerVarray               new_uids = NULL, member_vals = NULL, joined, left;
+    struct berval           dn;
+    int                     is_group, n_vals;
+    
+    if ( overlay_entry_get_ov(op, ndn, NULL, NULL, 0, &e, on) != LDAP_SUCCESS || ! e ) return;
+    is_group = is_entry_objectclass_or_sub(e, am->oc_member);
+    if ( is_group && (a = attr_find(e->e_attrs, am->attr_memberuid)) && a->a_numvals ) {
+        ber_bvarray_dup_x(&new_uids, a->a_nvals, op->o_tmpmemctx);
+        member_vals = automember_member_values(op, on, am, a->a_vals, a->a_numvals, op->o_tmpmemctx, &n_vals, NULL);
+    }
+    ber_dupbv_x(&dn, &e->e_name, op->o_tmpmemctx);
+    overlay_entry_release_ov(op, e, 0, on);
+    
+    if ( is_group ) automember_replace_values(op, on, &dn, ndn, am->attr_member, member_vals, NULL);
+    
+    left = automember_bvarray_minus(ctx->old_uids, new_uids, op->o_tmpmemctx);
+    joined = automember_bvarray_minus(new_uids, ctx->old_uids, op->o_tmpmemctx);
+    automember_people_memberof(op, on, am, left, &dn, ndn, NULL, NULL);
+    automember_people_memberof(op, on, am, joined, NULL, NULL, &dn, ndn);
+    
+    if ( left ) ber_memfree_x(left, op->o_tmpmemctx);
+    if ( joined ) ber_memfree_x(joined, op->o_tmpmemctx);
+    if ( member_vals ) ber_memfree_x(member_vals, op->o_tmpmemctx);
+    if ( new_uids ) ber_bvarray_free_x(new_uids, op->o_tmpmemctx);
+    ber_memfree_x(dn.bv_val, op->o_tmpmemctx);
+}
+
+/* Store afresh the member values of the group at ndn, if they differ */
+static void
+automember_group_member_refresh(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    struct berval           *ndn
+)
+{
+    Entry                   *e = NULL;
+    Attribute               *a;
+    BerVarray               member_vals = NULL;
+    struct berval           dn;
+    int                     n_vals, is_stale;
+    
+    if ( overlay_entry_get_ov(op, ndn, NULL, NULL, 0, &e, on) != LDAP_SUCCESS || ! e ) return;
+    if ( ! is_entry_objectclass_or_sub(e, am->oc_member) ) {
+        overlay_entry_release_ov(op, e, 0, on);
+        return;
+    }
+    if ( (a = attr_find(e->e_attrs, am->attr_memberuid)) && a->a_numvals ) {
+        member_vals = automember_member_values(op, on, am, a->a_vals, a->a_numvals, op->o_tmpmemctx, &n_vals, NULL);
+    }
+    is_stale = ! automember_values_match(attr_find(e->e_attrs, am->attr_member), member_vals);
+    ber_dupbv_x(&dn, &e->e_name, op->o_tmpmemctx);
+    overlay_entry_release_ov(op, e, 0, on);
+    
+    if ( is_stale ) automember_replace_values(op, on, &dn, ndn, am->attr_member, member_vals, NULL);
+    if ( member_vals ) ber_memfree_x(member_vals, op->o_tmpmemctx);
+    ber_memfree_x(dn.bv_val, op->o_tmpmemctx);
+}
+
+/* With automember-resolve set, a group's materialized member values name
+   people by their DNs, so adding, deleting or renaming a person, or
+   changing its uid, can leave them stale:  store afresh those of the
+   groups listing the person's uids from before or after the write */
+static void
+automember_resolve_groups_refresh(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    BerVarray               uid_lists[2], ndn_list = NULL;
+    int                     l, i, j, k;
+    
+    if ( ctx->resolve_flush ) {
+        /* Anyone beneath may have moved, which only a rebuild follows: */
+        Log(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO, "automember: automember_resolve_groups_refresh:  people renamed with '%s', scheduling a rebuild\n",
+                    op->o_req_dn.bv_val);
+        automember_rebuild_schedule(on);
+        return;
+    }
+    
+    uid_lists[0] = ctx->old_person_uids;
+    uid_lists[1] = ctx->new_person_uids;
+    for ( l = 0; l < 2; l++ ) {
+        for ( i = 0; uid_lists[l] && ! BER_BVISNULL(&uid_lists[l][i]); i++ ) {
+            BerVarray       dns = NULL, ndns = NULL;
+            
+            if ( automember_uid_memberof(op, on, am, &uid_lists[l][i], &dns, &ndns) == LDAP_SUCCESS && ndns ) {
+                for ( j = 0; ! BER_BVISNULL(&ndns[j]); j++ ) {
+                    for ( k = 0; ndn_list && ! BER_BVISNULL(&ndn_list[k]) && ! bvmatch(&ndn_list[k], &ndns[j]); k++ );
+                    if ( ! ndn_list || BER_BVISNULL(&ndn_list[k]) ) automember_dn_list_append(&ndn_list, &ndns[j], op->o_tmpmemctx);
+                }
+            }
+            if ( dns ) ber_bvarray_free_x(dns, op->o_tmpmemctx);
+            if ( ndns ) ber_bvarray_free_x(ndns, op->o_tmpmemctx);
+        }
+    }
+    for ( i = 0; ndn_list && ! BER_BVISNULL(&ndn_list[i]); i++ ) {
+        automember_group_member_refresh(op, on, am, &ndn_list[i]);
+    }
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_resolve_groups_refresh:  %d group(s) refreshed for '%s'\n", i, op->o_req_dn.bv_val);
+    if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+}
+
+/* Before the write:  compute what an added entry should store, and note
+   what a changed entry looked like beforehand */
+static void
+automember_materialize_prepare(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    Entry                   *e = NULL;
+    int                     wants_group = 0;
+    
+    switch ( op->o_tag ) {
+        case LDAP_REQ_ADD:
+            e = op->ora_e;
+            if ( is_entry_objectclass_or_sub(e, am->oc_member) && automember_group_in_bases(am, &e->e_nname) ) {
+                Attribute   *a = attr_find(e->e_attrs, am->attr_memberuid);
+                
+                ctx->is_group = 1;
+                attr_delete(&e->e_attrs, am->attr_member);
+                if ( a && a->a_numvals ) {
+                    int         n_vals;
+                    BerVarray   member_vals = automember_member_values(op, on, am, a->a_vals, a->a_numvals, op->o_tmpmemctx, &n_vals, NULL);
+                    
+                    if ( member_vals ) {
+                        attr_merge_normalize(e, am->attr_member, member_vals, op->o_tmpmemctx);
+                        ber_memfree_x(member_vals, op->o_tmpmemctx);
+                    }
+                }
+            }
+            else if ( am->oc_memberof && is_entry_objectclass_or_sub(e, am->oc_memberof) ) {
+                BerVarray   dn_list = NULL;
+                
+                attr_delete(&e->e_attrs, am->attr_memberof);
+                if ( automember_person_memberof(op, on, am, e, &dn_list, NULL) == LDAP_SUCCESS && dn_list ) {
+                    attr_merge_normalize(e, am->attr_memberof, dn_list, op->o_tmpmemctx);
+                    ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+                }
+            }
+            return;
+        
+        case LDAP_REQ_MODIFY: {
+            Modifications   *ml;
+            
+            /* Only changes to these can alter what we store: */
+            for ( ml = op->orm_modlist; ml; ml = ml->sml_next ) {
+                if ( ml->sml_desc == am->attr_memberuid || ml->sml_desc == am->attr_member ||
+                     ml->sml_desc == am->attr_oc ) ctx->is_group = wants_group = 1;
+                if ( ml->sml_desc == am->attr_uid || ml->sml_desc == am->attr_oc ) ctx->is_person = 1;
+            }
+            break;
+        }
+        
+        case LDAP_REQ_MODRDN:
+            ctx->is_person = 1;
+            /* FALLTHRU */
+        
+        case LDAP_REQ_DELETE:
+            wants_group = 1;
+            break;
+    }
+    
+    /* Note the memberUid values of a group as they stand now: */
+    if ( wants_group && overlay_entry_get_ov(op, &op->o_req_ndn, NULL, NULL, 0, &e, on) == LDAP_SUCCESS && e ) {
+        if ( is_entry_objectclass_or_sub(e, am->oc_member) && automember_group_in_bases(am, &e->e_nname) ) {
+            Attribute   *a = attr_find(e->e_attrs, am->attr_memberuid);
+            
+            ctx->is_group = 1;
+            if ( a ) ber_bvarray_dup_x(&ctx->old_uids, a->a_nvals, op->o_tmpmemctx);
+        } else if ( op->o_tag != LDAP_REQ_MODIFY ) {
+            ctx->is_group = 0;
+        }
+        overlay_entry_release_ov(op, e, 0, on);
+    }
+}
+
+/* After the write has committed:  carry it through to the stored values */
+static void
+automember_materialize_update(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    switch ( op->o_tag ) {
+        case LDAP_REQ_ADD:
+            if ( ctx->is_group ) {
+                Attribute   *a = attr_find(op->ora_e->e_attrs, am->attr_memberuid);
+                
+                if ( a ) automember_people_memberof(op, on, am, a->a_nvals, NULL, NULL, &op->ora_e->e_name, &op->ora_e->e_nname);
+            }
+            break;
+        
+        case LDAP_REQ_DELETE:
+            if ( ctx->is_group ) automember_people_memberof(op, on, am, ctx->old_uids, &op->o_req_dn, &op->o_req_ndn, NULL, NULL);
+            break;
+        
+        case LDAP_REQ_MODRDN:
+            if ( ctx->is_group ) {
+                automember_people_memberof(op, on, am, ctx->old_uids, &op->o_req_dn, &op->o_req_ndn, &op->orr_newDN, &op->orr_nnewDN);
+            } else if ( ctx->is_person ) {
+                automember_person_refresh(op, on, am, &op->orr_nnewDN);
+            }
+            break;
+        
+        case LDAP_REQ_MODIFY:
+            if ( ctx->is_group ) automember_group_refresh(op, on, am, ctx);
+            if ( ctx->is_person ) automember_person_refresh(op, on, am, &op->o_req_ndn);
+            break;
+    }
+    if ( am->resolve_base && (ctx->uids_changed || ctx->resolve_flush) ) automember_resolve_groups_refresh(op, on, am, ctx);
+}
+
+/* Resolver upkeep:  before the write, note the uids the resolver may
+   have answered for with the entry as it stands */
+static void
+automember_resolve_prepare(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    Entry                   *e = NULL;
+    Attribute               *a;
+    Modifications           *ml;
+    
+    switch ( op->o_tag ) {
+        case LDAP_REQ_ADD:
+            ctx->uids_changed = 1;
+            return;
+        
+        case LDAP_REQ_MODIFY:
+            for ( ml = op->orm_modlist; ml; ml = ml->sml_next ) {
+                if ( ml->sml_desc == am->attr_uid ) ctx->uids_changed = 1;
+            }
+            if ( ! ctx->uids_changed ) return;
+            break;
+        
+        case LDAP_REQ_MODRDN:
+        case LDAP_REQ_DELETE:
+            ctx->uids_changed = 1;
+            break;
+        
+        default:
+            return;
+    }
+    if ( overlay_entry_get_ov(op, &op->o_req_ndn, NULL, am->attr_uid, 0, &e, on) != LDAP_SUCCESS || ! e ) return;
+    if ( (a = attr_find(e->e_attrs, am->attr_uid)) != NULL ) {
+        ber_bvarray_dup_x(&ctx->old_person_uids, a->a_nvals, op->o_tmpmemctx);
+    }
+    else if ( op->o_tag == LDAP_REQ_MODRDN &&
+              (dnIsSuffix(&op->o_req_ndn, &am->resolve_base->b_ndn) || dnIsSuffix(&am->resolve_base->b_ndn, &op->o_req_ndn)) )
+    {
+        /* Not a person, but there may be people beneath it: */
+        ctx->resolve_flush = 1;
+    }
+    overlay_entry_release_ov(op, e, 0, on);
+}
+
+/* ...and after it has committed, drop the answers for those uids and for
+   the uids the entry has now (which may have been "no such person") */
+static void
+automember_resolve_update(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_write_ctx_t  *ctx
+)
+{
+    struct berval           *ndn = NULL;
+    Entry                   *e = NULL;
+    Attribute               *a = NULL;
+    int                     i;
+    
+    if ( ctx->resolve_flush ) {
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_resolve_update:  '%s' renamed, flushing resolver cache\n", op->o_req_ndn.bv_val);
+        automember_resolve_flush(am);
+        return;
+    }
+    if ( ! ctx->uids_changed ) return;
+    for ( i = 0; ctx->old_person_uids && ! BER_BVISNULL(&ctx->old_person_uids[i]); i++ ) {
+        automember_resolve_invalidate(am, &ctx->old_person_uids[i]);
+    }
+    
+    switch ( op->o_tag ) {
+        case LDAP_REQ_ADD:
+            a = attr_find(op->ora_e->e_attrs, am->attr_uid);
+            break;
+        case LDAP_REQ_MODRDN:
+            ndn = &op->orr_nnewDN;
+            break;
+        case LDAP_REQ_MODIFY:
+            ndn = &op->o_req_ndn;
+            break;
+    }
+    if ( ndn && overlay_entry_get_ov(op, ndn, NULL, am->attr_uid, 0, &e, on) == LDAP_SUCCESS && e ) {
+        a = attr_find(e->e_attrs, am->attr_uid);
+    }
+    for ( i = 0; a && i < a->a_numvals; i++ ) {
+        automember_resolve_invalidate(am, &a->a_nvals[i]);
+    }
+    /* Materialized groups listing these are brought up to date later: */
+    if ( a && am->materialize ) ber_bvarray_dup_x(&ctx->new_person_uids, a->a_nvals, op->o_tmpmemctx);
+    if ( e ) overlay_entry_release_ov(op, e, 0, on);
+}
+
+static int
+automember_write_cb(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    automember_write_ctx_t  *ctx = (automember_write_ctx_t*)op->o_callback->sc_private;
+    slap_overinst           *on = ctx->on;
+    automember_t            *am = ctx->am;
+
+    if ( (rs->sr_type == REP_RESULT) && (rs->sr_err == LDAP_SUCCESS) ) {
+        /* First, so the member values materialized below are resolved
+           afresh: */
+        if ( am->resolve_base ) automember_resolve_update(op, on, am, ctx);
+        /* A rebuild judges memberOf by the index, in use or not: */
+        if ( am->use_memberof_idx || __atomic_load_n(&am->st->rebuild_running, __ATOMIC_SEQ_CST) ) {
+            automember_idx_update(op, on, am);
+        }
+        if ( am->materialize ) automember_materialize_update(op, on, am, ctx);
+    }
+    return SLAP_CB_CONTINUE;
+}
+
+static int
+automember_write_cleanup(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    if ( (rs->sr_type == REP_RESULT) || op->o_abandon || (rs->sr_err == SLAPD_ABANDON) ) {
+        automember_write_ctx_t  *ctx = (automember_write_ctx_t*)op->o_callback->sc_private;
+
+        if ( ctx->old_uids ) ber_bvarray_free_x(ctx->old_uids, op->o_tmpmemctx);
+        if ( ctx->old_person_uids ) ber_bvarray_free_x(ctx->old_person_uids, op->o_tmpmemctx);
+        if ( ctx->new_person_uids ) ber_bvarray_free_x(ctx->new_person_uids, op->o_tmpmemctx);
+        op->o_callback = ctx->sc.sc_next;
+        automember_conf_put(ctx->on, ctx->conf_slot);
+        op->o_tmpfree(ctx, op->o_tmpmemctx);
+    }
+    return 0;
+}
+
+/* Write hook (add/modify/delete/modrdn):  track changes to groups (and,
+   when materializing or resolving, to people) */
+static int
+automember_write(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    slap_overinst           *on = (slap_overinst*)op->o_bd->bd_info;
+    automember_t            *am;
+    automember_write_ctx_t  *ctx;
+    int                     conf_slot;
+
+    /* Our own writes only store member and memberOf values, which neither
+       the index nor the resolver follows: */
+    if ( automember_op_is_internal(op, on) ) return SLAP_CB_CONTINUE;
+    
+    /* The callback goes in even while the index is unbuilt:  a build
+       racing this write must not miss it.  Validity is checked under the
+       lock once the write has committed. */
+    am = automember_conf_get(on, &conf_slot);
+    if ( ! am->oc_member || ! (am->use_memberof_idx || am->materialize || am->resolve_base) ) {
+        automember_conf_put(on, conf_slot);
+        return SLAP_CB_CONTINUE;
+    }
+    
+    ctx = (automember_write_ctx_t*)op->o_tmpcalloc(1, sizeof(automember_write_ctx_t), op->o_tmpmemctx);
+    ctx->on = on;
+    ctx->am = am;
+    ctx->conf_slot = conf_slot;
+    if ( am->resolve_base ) automember_resolve_prepare(op, on, am, ctx);
+    if ( am->materialize && am->synth_tmpl ) automember_materialize_prepare(op, on, am, ctx);
+    
+    ctx->sc.sc_response = automember_write_cb;
+    ctx->sc.sc_cleanup  = automember_write_cleanup;
+    ctx->sc.sc_private  = ctx;
+    ctx->sc.sc_next     = op->o_callback;
+    op->o_callback      = &ctx->sc;
+    return SLAP_CB_CONTINUE;
+}
+
+/* One entry whose stored values the rebuild found wrong: */
+typedef struct automember_rebuild_fix {
+    struct automember_rebuild_fix   *f_next;
+    struct berval                   f_dn;
+    struct berval                   f_ndn;
+} automember_rebuild_fix_t;
+
+struct automember_rebuild_context {
+    automember_t                *am;
+    slap_overinst               *on;
+    automember_rebuild_fix_t    *fixes;
+    int                         n_entries;
+    int                         n_fixes;
+    int                         n_skipped;
+};
+
+/* Helper: the attribute entry e should store (member for a group,
+           memberOf for anyone else) and its values as things stand,
+           allocated in the operation's temp memory.  Returns LDAP_OTHER
+           if a write invalidated the index under the rebuild (and
+           LDAP_INVALID_SYNTAX for an unusable uid), so e can't be judged. */
+static int
+automember_rebuild_values(
+    Operation                           *op,
+    struct automember_rebuild_context   *rb,
+    Entry                               *e,
+    AttributeDescription                **out_ad,
+    BerVarray                           *out_vals
+)
+{
+    automember_t                        *am = rb->am;
+    
+    *out_vals = NULL;
+    if ( is_entry_objectclass_or_sub(e, am->oc_member) ) {
+        Attribute   *a = attr_find(e->e_attrs, am->attr_memberuid);
+        int         n_vals;
+        
+        *out_ad = am->attr_member;
+        if ( a && a->a_numvals ) *out_vals = automember_member_values(op, rb->on, am, a->a_vals, a->a_numvals, op->o_tmpmemctx, &n_vals, NULL);
+    } else {
+        automember_index_t  *idx = &am->st->memberof_idx;
+        struct berval       *uid_value = automember_entry_uid(am, e);
+        struct berval       nuid = BER_BVNULL;
+        int                 is_valid;
+        
+        *out_ad = am->attr_memberof;
+        if ( uid_value ) {
+            if ( attr_normalize_one(am->attr_memberuid, uid_value, &nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) return LDAP_INVALID_SYNTAX;
+            ldap_pvt_thread_rdwr_rlock(&idx->rwlock);
+            is_valid = idx->is_valid;
+            if ( is_valid ) automember_idx_copy_dns(op, idx, BER_BVISNULL(&nuid) ? uid_value : &nuid, out_vals, NULL);
+            ldap_pvt_thread_rdwr_runlock(&idx->rwlock);
+            if ( ! BER_BVISNULL(&nuid) ) ber_memfree_x(nuid.bv_val, op->o_tmpmemctx);
+            if ( ! is_valid ) return LDAP_OTHER;
+        }
+    }
+    return LDAP_SUCCESS;
+}
+
+static void
+automember_rebuild_values_free(
+    Operation               *op,
+    automember_t            *am,
+    AttributeDescription    *ad,
+    BerVarray               vals
+)
+{
+    if ( ! vals ) return;
+    if ( ad == am->attr_member ) {
+        ber_memfree_x(vals, op->o_tmpmemctx);
+    } else {
+        ber_bvarray_free_x(vals, op->o_tmpmemctx);
+    }
+}
+
+static int
+automember_rebuild_per_entry(
+    Operation       *op,
+    SlapReply       *rs
+)
+{
+    struct automember_rebuild_context   *rb = (struct automember_rebuild_context*)op->o_callback->sc_private;
+    Entry                               *e = rs->sr_entry;
+    AttributeDescription                *ad;
+    BerVarray                           vals = NULL;
+    int                                 rc;
+    
+    if ( (rs->sr_type != REP_SEARCH) || ! e ) return LDAP_SUCCESS;
+    rb->n_entries++;
+    
+    if ( (rc = automember_rebuild_values(op, rb, e, &ad, &vals)) != LDAP_SUCCESS ) {
+        if ( rc == LDAP_OTHER ) rb->n_skipped++;
+        return LDAP_SUCCESS;
+    }
+    /* Only noted here:  the values are worked out again when applied */
+    if ( ! automember_values_match(attr_find(e->e_attrs, ad), vals) ) {
+        automember_rebuild_fix_t    *f = (automember_rebuild_fix_t*)ch_calloc(1, sizeof(automember_rebuild_fix_t));
+        
+        ber_dupbv(&f->f_dn, &e->e_name);
+        ber_dupbv(&f->f_ndn, &e->e_nname);
+        f->f_next = rb->fixes;
+        rb->fixes = f;
+    }
+    automember_rebuild_values_free(op, rb->am, ad, vals);
+    return LDAP_SUCCESS;
+}
+
+/* Store the values the entry noted in f should carry, worked out from it
+   as it stands now.  The replace asserts the entryCSN just read, so a
+   write landing in between, which materializes the entry itself, is
+   never overwritten with what it replaced. */
+static void
+automember_rebuild_apply(
+    Operation                           *op,
+    struct automember_rebuild_context   *rb,
+    automember_rebuild_fix_t            *f
+)
+{
+    Entry                               *e = NULL;
+    Attribute                           *a;
+    AttributeDescription                *ad;
+    BerVarray                           vals = NULL;
+    Filter                              assertion = { 0 };
+    AttributeAssertion                  ava = { 0 };
+    struct berval                       csn = BER_BVNULL;
+    int                                 is_wrong = 0, rc;
+    
+    /* Deleted meanwhile: */
+    if ( overlay_entry_get_ov(op, &f->f_ndn, NULL, NULL, 0, &e, rb->on) != LDAP_SUCCESS || ! e ) return;
+    if ( (rc = automember_rebuild_values(op, rb, e, &ad, &vals)) != LDAP_SUCCESS ) {
+        if ( rc == LDAP_OTHER ) rb->n_skipped++;
+    } else if ( ! automember_values_match(attr_find(e->e_attrs, ad), vals) ) {
+        is_wrong = 1;
+        if ( (a = attr_find(e->e_attrs, slap_schema.si_ad_entryCSN)) != NULL && a->a_numvals ) {
+            ber_dupbv_x(&csn, &a->a_nvals[0], op->o_tmpmemctx);
+        }
+    }
+    overlay_entry_release_ov(op, e, 0, rb->on);
+    
+    if ( is_wrong ) {
+        /* (entryCSN=<csn>), unless lastmod is off: */
+        assertion.f_choice = LDAP_FILTER_EQUALITY;
+        assertion.f_ava = &ava;
+        ava.aa_desc = slap_schema.si_ad_entryCSN;
+        ava.aa_value = csn;
+        if ( automember_replace_values(op, rb->on, &f->f_dn, &f->f_ndn, ad, vals,
+                        BER_BVISNULL(&csn) ? NULL : &assertion) == LDAP_SUCCESS ) rb->n_fixes++;
+    }
+    automember_rebuild_values_free(op, rb->am, ad, vals);
+    if ( ! BER_BVISNULL(&csn) ) ber_memfree_x(csn.bv_val, op->o_tmpmemctx);
+}
+
+/* Helper: search for entries of class oc (groups within the group bases,
+           people anywhere) and note those whose stored values are wrong */
+static int
+automember_rebuild_collect(
+    Operation                           *op,
+    slap_overinst                       *on,
+    automember_t                        *am,
+    ObjectClass                         *oc,
+    struct automember_rebuild_context   *rb
+)
+{
+    static const char   *filter_fmt = "(objectClass=%s)";
+    BackendDB           be = *op->o_bd;
+    Operation           op2 = *op;
+    SlapReply           rs2 = { REP_RESULT };
+    slap_callback       sc = {0};
+    AttributeName       an[6];
+    struct berval       filter_str;
+    int                 i, rc;
+    
+    filter_str.bv_len = strlen(filter_fmt) - 2 + oc->soc_cname.bv_len;
+    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
+    snprintf(filter_str.bv_val, filter_str.bv_len + 1, filter_fmt, oc->soc_cname.bv_val);
+    op2.ors_filter = str2filter_x(op, filter_str.bv_val);
+    if ( ! op2.ors_filter ) {
+        ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+        return LDAP_OTHER;
+    }
+    
+    /* Everything automember_rebuild_per_entry() looks at: */
+    memset(an, 0, sizeof(an));
+    an[0].an_desc = am->attr_oc;
+    an[1].an_desc = am->attr_memberuid;
+    an[2].an_desc = am->attr_member;
+    an[3].an_desc = am->attr_uid;
+    an[4].an_desc = am->attr_memberof;
+    for ( i = 0; i < 5; i++ ) an[i].an_name = an[i].an_desc->ad_cname;
+    op2.ors_filterstr   = filter_str;
+    
+    op2.o_bd            = &be;
+    op2.o_bd->bd_info   = (BackendInfo*)on->on_info;
+    op2.o_tag           = LDAP_REQ_SEARCH;
+    op2.o_dn            = op->o_bd->be_rootdn;
+    op2.o_ndn           = op->o_bd->be_rootndn;
+    op2.ors_deref       = LDAP_DEREF_NEVER;
+    op2.ors_slimit      = SLAP_NO_LIMIT;
+    op2.ors_tlimit      = SLAP_NO_LIMIT;
+    op2.ors_attrs       = an;
+    op2.ors_attrsonly   = 0;
+    op2.o_do_not_cache  = 1;
+    
+    sc.sc_private       = rb;
+    sc.sc_response      = automember_rebuild_per_entry;
+    op2.o_callback      = &sc;
+    
+    if ( oc == am->oc_member ) {
+        rc = automember_group_search(am, &op2, "rebuild");
+    } else {
+        op2.o_req_dn    = op->o_bd->be_suffix[0];
+        op2.o_req_ndn   = op->o_bd->be_nsuffix[0];
+        op2.ors_scope   = LDAP_SCOPE_SUBTREE;
+        AUTOMEMBER_BE_SEARCH(rc, "rebuild", &op2, &rs2);
+    }
+    filter_free_x(op, op2.ors_filter, 1);
+    ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+    return rc;
+}
+
+/* Rebuild:  store the member and memberOf values every group and person
+   should carry.  Runs once, on a pool thread, when requested by
+   automember-rebuild. */
+static void*
+automember_rebuild_task(
+    void                    *thrctx,
+    void                    *arg
+)
+{
+    slap_overinst           *on = (slap_overinst*)arg;
+    int                     conf_slot;
+    automember_t            *am = automember_conf_get(on, &conf_slot);
+    Connection              conn = { 0 };
+    OperationBuffer         opbuf;
+    Operation               *op;
+    BackendDB               be;
+    struct automember_rebuild_context   rb;
+    automember_rebuild_fix_t            *f;
+    int                     from_db, rc;
+    
+    if ( ! am->materialize || ! am->oc_member || ! am->synth_tmpl || ! am->st->be ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_rebuild_task:  materialize mode is not configured, nothing to rebuild\n");
+        automember_conf_put(on, conf_slot);
+        return NULL;
+    }
+    
+    connection_fake_init(&conn, &opbuf, thrctx);
+    op = &opbuf.ob_op;
+    be = *am->st->be;
+    be.bd_info = (BackendInfo*)on;
+    op->o_bd = &be;
+    op->o_dn = be.be_rootdn;
+    op->o_ndn = be.be_rootndn;
+    
+    Log(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO, "automember: automember_rebuild_task:  rebuild of '%s' started\n", be.be_suffix[0].bv_val);
+    
+    /* The index says which groups list each uid, and the write hooks keep
+       it current until the rebuild is done (see automember_write_cb()): */
+    __atomic_add_fetch(&am->st->rebuild_running, 1, __ATOMIC_SEQ_CST);
+    rc = LDAP_SUCCESS;
+    if ( ! __atomic_load_n(&am->st->memberof_idx.is_valid, __ATOMIC_ACQUIRE) ) {
+        rc = automember_idx_refresh(op, on, am, NULL, NULL, &from_db);
+    }
+    if ( rc != LDAP_SUCCESS ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_rebuild_task:  unable to index groups (rc=%d), rebuild abandoned\n", rc);
+        goto done;
+    }
+    
+    memset(&rb, 0, sizeof(rb));
+    rb.am = am;
+    rb.on = on;
+    rc = automember_rebuild_collect(op, on, am, am->oc_member, &rb);
+    if ( rc == LDAP_SUCCESS && am->oc_memberof ) rc = automember_rebuild_collect(op, on, am, am->oc_memberof, &rb);
+    if ( rc != LDAP_SUCCESS ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_rebuild_task:  search failed (rc=%d), applying what was found\n", rc);
+    }
+    
+    while ( (f = rb.fixes) != NULL ) {
+        rb.fixes = f->f_next;
+        automember_rebuild_apply(op, &rb, f);
+        ch_free(f->f_dn.bv_val);
+        ch_free(f->f_ndn.bv_val);
+        ch_free(f);
+    }
+    
+    Log(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO, "automember: automember_rebuild_task:  rebuild of '%s' complete, %d of %d entries updated%s\n",
+                be.be_suffix[0].bv_val, rb.n_fixes, rb.n_entries,
+                rb.n_skipped ? " (groups changed meanwhile, run again)" : "");
+
+done:
+    /* Nothing keeps the index current once no rebuild needs it, if it
+       isn't in use: */
+    if ( __atomic_sub_fetch(&am->st->rebuild_running, 1, __ATOMIC_SEQ_CST) == 0 && ! am->use_memberof_idx ) {
+        automember_idx_invalidate(&am->st->memberof_idx);
+    }
+    automember_conf_put(on, conf_slot);
+    return NULL;
+}
+
+/* Queue a rebuild on the connection pool once the database is open */
+static void
+automember_rebuild_schedule(
+    slap_overinst           *on
+)
+{
+    automember_t            *am = AUTOMEMBER_CONF(on);
+    
+    am->st->rebuild_pending = 1;
+    if ( am->st->be && (slapMode & SLAP_SERVER_MODE) ) {
+        am->st->rebuild_pending = 0;
+        ldap_pvt_thread_pool_submit(&connection_pool, automember_rebuild_task, on);
+    }
+}
+
+/**************************/
+
+/* Filter rewriting:  member and memberOf exist only in replies, so a filter
+   asserting them would never match anything stored.  The search hook maps
+   such assertions onto the stored attributes they are synthesized from:
+
+     (member=<tmpl(x)>)   =>  (&(objectClass=<member-oc>)(memberUid=x))
+     (member=*)           =>  (&(objectClass=<member-oc>)(memberUid=*))
+     (memberOf=<group>)   =>  (&(objectClass=<memberof-oc>)(|(uid=m1)(uid=m2)...))
+
+   With automember-resolve set, <tmpl(x)> is instead any person's DN, x
+   being that person's uid.  The rewritten filter replaces the original
+   for the duration of the search only. */
+
+/* Helper: recover the source value from a normalized synthesized DN by
+           matching it against the normalized template literals */
+static int
+automember_member_dn_to_uid(
+    automember_t    *am,
+    struct berval   *ndn,
+    struct berval   *uid
+)
+{
+    BerVarray       segs = am->synth_ntmpl;
+    struct berval   rest = *ndn;
+    int             i;
+    
+    BER_BVZERO(uid);
+    if ( ! segs ) return 0;
+    
+    if ( rest.bv_len < segs[0].bv_len || strncmp(rest.bv_val, segs[0].bv_val, segs[0].bv_len) != 0 ) return 0;
+    rest.bv_val += segs[0].bv_len;
+    rest.bv_len -= segs[0].bv_len;
+    
+    for ( i = 1; ! BER_BVISNULL(&segs[i]); i++ ) {
+        struct berval   val;
+        
+        val.bv_val = rest.bv_val;
+        if ( BER_BVISNULL(&segs[i + 1]) ) {
+            /* The final literal anchors at the end of the DN: */
+            if ( rest.bv_len < segs[i].bv_len ||
+                 strcmp(rest.bv_val + rest.bv_len - segs[i].bv_len, segs[i].bv_val) != 0 ) return 0;
+            val.bv_len = rest.bv_len - segs[i].bv_len;
+        } else {
+            char        *p = strstr(rest.bv_val, segs[i].bv_val);
+            
+            if ( ! p ) return 0;
+            val.bv_len = p - rest.bv_val;
+            rest.bv_len -= val.bv_len + segs[i].bv_len;
+            rest.bv_val = p + segs[i].bv_len;
+        }
+        if ( val.bv_len == 0 ) return 0;
+        if ( BER_BVISNULL(uid) ) {
+            *uid = val;
+        } else if ( ! bvmatch(uid, &val) ) {
+            return 0;
+        }
+    }
+    /* A value spanning RDNs or carrying DN escapes doesn't map back to a
+       memberUid we could have synthesized it from: */
+    for ( i = 0; i < uid->bv_len; i++ ) {
+        if ( uid->bv_val[i] == ',' || uid->bv_val[i] == '+' || uid->bv_val[i] == '\\' ) return 0;
+    }
+    return 1;
+}
+
+/* Helper: build "(&(objectClass=<oc>)<inner>)" and splice the parsed result
+           over filter node f (keeping its place in any enclosing list) */
+static int
+automember_filter_splice(
+    Operation       *op,
+    Filter          *f,
+    ObjectClass     *oc,
+    struct berval   *inner
+)
+{
+    static const char   *filter_fmt = "(&(objectClass=%s)%s)";
+    struct berval       filter_str;
+    Filter              *nf;
+    
+    filter_str.bv_len = strlen(filter_fmt) - 4 + oc->soc_cname.bv_len + inner->bv_len;
+    filter_str.bv_val = (char*)ber_memalloc_x(filter_str.bv_len + 1, op->o_tmpmemctx);
+    snprintf(filter_str.bv_val, filter_str.bv_len + 1, filter_fmt, oc->soc_cname.bv_val, inner->bv_val);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_filter_splice:  rewritten to '%s'\n", filter_str.bv_val);
+    
+    nf = str2filter_x(op, filter_str.bv_val);
+    ber_memfree_x(filter_str.bv_val, op->o_tmpmemctx);
+    if ( ! nf ) return LDAP_OTHER;
+    
+    if ( f->f_choice == LDAP_FILTER_EQUALITY ) ava_free(op, f->f_ava, 1);
+    f->f_choice = nf->f_choice;
+    f->f_un = nf->f_un;
+    op->o_tmpfree(nf, op->o_tmpmemctx);
+    return LDAP_SUCCESS;
+}
+
+/* Helper: the group's members as "(|(uid=m1)(uid=m2)...)", or NULL if the
+           asserted DN isn't a group with members in this database */
+static char*
+automember_memberof_inner_filter(
+    Operation       *op,
+    slap_overinst   *on,
+    automember_t    *am,
+    struct berval   *group_ndn
+)
+{
+    Entry           *e = NULL;
+    Attribute       *a;
+    char            *inner = NULL, *p;
+    
+    if ( ! automember_group_in_bases(am, group_ndn) ) return NULL;
+    if ( overlay_entry_get_ov(op, group_ndn, am->oc_member, am->attr_memberuid, 0, &e, on) != LDAP_SUCCESS || ! e ) return NULL;
+    
+    a = attr_find(e->e_attrs, am->attr_memberuid);
+    if ( a && a->a_numvals ) {
+        struct berval   *esc_vals = (struct berval*)ber_memcalloc_x(a->a_numvals, sizeof(struct berval), op->o_tmpmemctx);
+        struct berval   *at_name = &am->attr_uid->ad_cname;
+        ber_len_t       len = STRLENOF("(|)");
+        int             i;
+        
+        for ( i = 0; i < a->a_numvals; i++ ) {
+            filter_escape_value_x(&a->a_vals[i], &esc_vals[i], op->o_tmpmemctx);
+            len += STRLENOF("(=)") + at_name->bv_len + esc_vals[i].bv_len;
+        }
+        inner = p = (char*)ber_memalloc_x(len + 1, op->o_tmpmemctx);
+        p = lutil_strcopy(p, "(|");
+        for ( i = 0; i < a->a_numvals; i++ ) {
+            *p++ = '(';
+            p = lutil_strncopy(p, at_name->bv_val, at_name->bv_len);
+            *p++ = '=';
+            p = lutil_strncopy(p, esc_vals[i].bv_val, esc_vals[i].bv_len);
+            *p++ = ')';
+            ber_memfree_x(esc_vals[i].bv_val, op->o_tmpmemctx);
+        }
+        lutil_strcopy(p, ")");
+        ber_memfree_x(esc_vals, op->o_tmpmemctx);
+    }
+    overlay_entry_release_ov(op, e, 0, on);
+    return inner;
+}
+
+/* Can an asserted member DN be mapped back to a memberUid value? */
+#define AUTOMEMBER_MEMBER_INVERTIBLE(am)    ((am)->synth_ntmpl || (am)->resolve_base)
+
+/* Does the filter assert anything we synthesize? */
+static int
+automember_filter_needs_rewrite(
+    automember_t    *am,
+    Filter          *f
+)
+{
+    switch ( f->f_choice ) {
+        case LDAP_FILTER_AND:
+        case LDAP_FILTER_OR:
+        case LDAP_FILTER_NOT:
+            for ( f = f->f_list; f; f = f->f_next ) {
+                if ( automember_filter_needs_rewrite(am, f) ) return 1;
+            }
+            return 0;
+        case LDAP_FILTER_EQUALITY:
+            return (f->f_av_desc == am->attr_member && AUTOMEMBER_MEMBER_INVERTIBLE(am)) ||
+                   (f->f_av_desc == am->attr_memberof && am->oc_memberof);
+        case LDAP_FILTER_PRESENT:
+            return (f->f_desc == am->attr_member && AUTOMEMBER_MEMBER_INVERTIBLE(am));
+    }
+    return 0;
+}
+
+static void
+automember_filter_rewrite(
+    Operation       *op,
+    slap_overinst   *on,
+    automember_t    *am,
+    Filter          *f
+)
+{
+    switch ( f->f_choice ) {
+        case LDAP_FILTER_AND:
+        case LDAP_FILTER_OR:
+        case LDAP_FILTER_NOT:
+            for ( f = f->f_list; f; f = f->f_next ) automember_filter_rewrite(op, on, am, f);
+            break;
+        
+        case LDAP_FILTER_PRESENT:
+            if ( f->f_desc == am->attr_member && AUTOMEMBER_MEMBER_INVERTIBLE(am) ) {
+                static const char   *inner_fmt = "(%s=*)";
+                struct berval       inner;
+                
+                inner.bv_len = strlen(inner_fmt) - 2 + am->attr_memberuid->ad_cname.bv_len;
+                inner.bv_val = (char*)ber_memalloc_x(inner.bv_len + 1, op->o_tmpmemctx);
+                snprintf(inner.bv_val, inner.bv_len + 1, inner_fmt, am->attr_memberuid->ad_cname.bv_val);
+                automember_filter_splice(op, f, am->oc_member, &inner);
+                ber_memfree_x(inner.bv_val, op->o_tmpmemctx);
+            }
+            break;
+        
+        case LDAP_FILTER_EQUALITY:
+            if ( f->f_av_desc == am->attr_member && AUTOMEMBER_MEMBER_INVERTIBLE(am) ) {
+                static const char   *inner_fmt = "(%s=%s)";
+                struct berval       uid, esc_uid, inner;
+                
+                /* A DN the template couldn't have produced (or, resolving,
+                   that names no person) is left alone, and so matches
+                   nothing, as before: */
+                if ( am->resolve_base ? ! automember_resolve_dn_to_uid(op, on, am, &f->f_av_value, &uid)
+                                      : ! automember_member_dn_to_uid(am, &f->f_av_value, &uid) )
+                {
+                    Debug(LDAP_DEBUG_TRACE, "automember: automember_filter_rewrite:  '%s' maps to no memberUid\n", f->f_av_value.bv_val);
+                    break;
+                }
+                filter_escape_value_x(&uid, &esc_uid, op->o_tmpmemctx);
+                if ( am->resolve_base ) op->o_tmpfree(uid.bv_val, op->o_tmpmemctx);
+                inner.bv_len = strlen(inner_fmt) - 4 + am->attr_memberuid->ad_cname.bv_len + esc_uid.bv_len;
+                inner.bv_val = (char*)ber_memalloc_x(inner.bv_len + 1, op->o_tmpmemctx);
+                snprintf(inner.bv_val, inner.bv_len + 1, inner_fmt, am->attr_memberuid->ad_cname.bv_val, esc_uid.bv_val);
+                automember_filter_splice(op, f, am->oc_member, &inner);
+                ber_memfree_x(inner.bv_val, op->o_tmpmemctx);
+                ber_memfree_x(esc_uid.bv_val, op->o_tmpmemctx);
+            }
+            else if ( f->f_av_desc == am->attr_memberof && am->oc_memberof ) {
+                struct berval       inner;
+                
+                inner.bv_val = automember_memberof_inner_filter(op, on, am, &f->f_av_value);
+                if ( inner.bv_val ) {
+                    inner.bv_len = strlen(inner.bv_val);
+                    automember_filter_splice(op, f, am->oc_memberof, &inner);
+                    ber_memfree_x(inner.bv_val, op->o_tmpmemctx);
+                } else {
+                    /* Not a group (or an empty one):  nothing can match */
+                    ava_free(op, f->f_ava, 1);
+                    f->f_choice = SLAPD_FILTER_COMPUTED;
+                    f->f_result = LDAP_COMPARE_FALSE;
+                }
+            }
+            break;
+    }
+}
+
+/* Substitute a rewritten copy of the search filter if it asserts member
+   or memberOf: */
+static void
+automember_search_rewrite_filter(
+    Operation               *op,
+    slap_overinst           *on,
+    automember_t            *am,
+    automember_search_ctx_t *ctx
+)
+{
+    if ( ! op->ors_filter || ! automember_filter_needs_rewrite(am, op->ors_filter) ) return;
+    
+    ctx->orig_filter = op->ors_filter;
+    ctx->orig_filterstr = op->ors_filterstr;
+    
+    op->ors_filter = filter_dup(op->ors_filter, op->o_tmpmemctx);
+    automember_filter_rewrite(op, on, am, op->ors_filter);
+    filter2bv_x(op, op->ors_filter, &op->ors_filterstr);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_search_rewrite_filter:  '%s' => '%s'\n",
+                ctx->orig_filterstr.bv_val, op->ors_filterstr.bv_val);
+}
+
+/**************************/
+
+/* Synthesis policy:  bulk consumers (syncrepl, backups pulling "*" and
+   "+", enumerations) rarely read member or memberOf but pay for them on
+   every entry.  The automember-policy directives choose, by bind DN, peer
+   address and kind of search, between synthesis whenever the attribute is
+   requested, only when it is requested by name, or never.  A client can
+   also ask for less (never more) with the synthesis control, whose value
+   is one of the policy names ("none" if absent). */
+
+#define AUTOMEMBER_SYNTH_CONTROL    "1.3.6.1.4.1.4203.666.11.100.3.1"
+
+static int automember_synth_cid;
+
+/* The control's value, decoded once and pointed to by o_controls: */
+static const int automember_synth_ctrl_modes[] = { AUTOMEMBER_SYNTH_FULL, AUTOMEMBER_SYNTH_EXPLICIT, AUTOMEMBER_SYNTH_NONE };
+
+static int
+automember_synth_ctrl_parse(
+    Operation       *op,
+    SlapReply       *rs,
+    LDAPControl     *ctrl
+)
+{
+    int             synth = AUTOMEMBER_SYNTH_NONE;
+    
+    if ( op->o_ctrlflag[automember_synth_cid] != SLAP_CONTROL_NONE ) {
+        rs->sr_text = "automember synthesis control specified multiple times";
+        return LDAP_PROTOCOL_ERROR;
+    }
+    if ( ! BER_BVISNULL(&ctrl->ldctl_value) && (synth = automember_synth_mode(&ctrl->ldctl_value)) < 0 ) {
+        rs->sr_text = "automember synthesis control value must be full, explicit or none";
+        return LDAP_PROTOCOL_ERROR;
+    }
+    op->o_controls[automember_synth_cid] = (void *)&automember_synth_ctrl_modes[synth];
+    op->o_ctrlflag[automember_synth_cid] = ctrl->ldctl_iscritical ? SLAP_CONTROL_CRITICAL : SLAP_CONTROL_NONCRITICAL;
+    return LDAP_SUCCESS;
+}
+
+/* Helper: does policy p apply to search op? */
+static int
+automember_policy_matches(
+    Operation           *op,
+    automember_policy_t *p
+)
+{
+    if ( p->p_ndn.bv_val ) {
+        if ( p->p_subtree ? ! dnIsSuffix(&op->o_ndn, &p->p_ndn) : ! dn_match(&op->o_ndn, &p->p_ndn) ) return 0;
+    }
+    if ( p->p_peer.bv_val ) {
+        struct berval   *peer = op->o_conn ? &op->o_conn->c_peer_name : NULL;
+        
+        if ( ! peer || peer->bv_len < p->p_peer.bv_len || strncasecmp(peer->bv_val, p->p_peer.bv_val, p->p_peer.bv_len) ) return 0;
+    }
+    if ( p->p_ops ) {
+        int             kind = AUTOMEMBER_POLICY_OP_SEARCH;
+        
+        if ( op->o_sync != SLAP_CONTROL_NONE ) kind = AUTOMEMBER_POLICY_OP_SYNC;
+        else if ( op->o_pagedresults != SLAP_CONTROL_NONE ) kind = AUTOMEMBER_POLICY_OP_PAGED;
+        if ( ! (p->p_ops & kind) ) return 0;
+    }
+    return 1;
+}
+
+/* Helper: the AUTOMEMBER_SYNTH_* search op gets */
+static int
+automember_policy_synth(
+    Operation           *op,
+    automember_t        *am
+)
+{
+    automember_policy_t *p;
+    int                 synth = AUTOMEMBER_SYNTH_FULL;
+    
+    for ( p = am->policies; p; p = p->p_next ) {
+        if ( automember_policy_matches(op, p) ) {
+            synth = p->p_synth;
+            break;
+        }
+    }
+    if ( op->o_ctrlflag[automember_synth_cid] != SLAP_CONTROL_NONE ) {
+        int             asked = *(const int *)op->o_controls[automember_synth_cid];
+        
+        if ( asked > synth ) synth = asked;
+    }
+    return synth;
+}
+
+/* Helper: cut what the search asks of us down to what policy allows */
+static void
+automember_policy_apply(
+    Operation               *op,
+    automember_t            *am,
+    automember_attr_req_t   *req
+)
+{
+    int                     synth = automember_policy_synth(op, am);
+    
+    if ( synth == AUTOMEMBER_SYNTH_FULL ) return;
+    if ( synth == AUTOMEMBER_SYNTH_NONE || req->member != AUTOMEMBER_REQ_NAMED ) req->member = req->member_range = 0;
+    if ( synth == AUTOMEMBER_SYNTH_NONE || req->memberof != AUTOMEMBER_REQ_NAMED ) req->memberof = 0;
+    req->rules = ( synth == AUTOMEMBER_SYNTH_NONE ) ? 0 : (req->rules & req->rules_named);
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_policy_apply:  policy %s leaves member = %d, memberOf = %d, rules = %#x\n",
+                automember_synth_names[synth].bv_val, req->member, req->memberof, req->rules);
+}
+
+/**************************/
+
+/* Attribute widening:  a client asking for member but not memberUid would
+   get group entries without the values member is synthesized from, and
+   automember_fetch_src_attr() would have to read every group a second
+   time.  Instead the search hook appends memberUid (and likewise the
+   source of any additional rule whose target is wanted) to the search's
+   attribute list so the backend returns it with the entry, and replies
+   are sent against the client's original list so it is not disclosed. */
+static void
+automember_search_widen_attrs(
+    Operation               *op,
+    automember_t            *am,
+    automember_search_ctx_t *ctx
+)
+{
+    AttributeName           *an = op->ors_attrs, *wide_an;
+    AttributeDescription    *add[1 + AUTOMEMBER_MAX_RULES];
+    automember_rule_t       *r;
+    int                     n_an, n_add = 0, i;
+    
+    /* NULL ors_attrs is "all user attributes" and cannot be added to: */
+    if ( an == NULL ) return;
+    
+    /* Sources of whatever is wanted without them (the rules' once each): */
+    if ( ctx->req.member && ! ctx->req.memberuid ) add[n_add++] = am->attr_memberuid;
+    for ( r = am->rules; r; r = r->r_next ) {
+        if ( ! (ctx->req.rules & r->r_bit) || (ctx->req.rules_src & r->r_bit) ) continue;
+        for ( i = 0; i < n_add && add[i] != r->r_src; i++ );
+        if ( i == n_add ) add[n_add++] = r->r_src;
+    }
+    if ( n_add == 0 ) return;
+    
+    for ( n_an = 0; an[n_an].an_name.bv_val; n_an++ );
+    wide_an = (AttributeName*)op->o_tmpalloc((n_an + n_add + 1) * sizeof(AttributeName), op->o_tmpmemctx);
+    memcpy(wide_an, an, n_an * sizeof(AttributeName));
+    memset(&wide_an[n_an], 0, (n_add + 1) * sizeof(AttributeName));
+    for ( i = 0; i < n_add; i++ ) {
+        wide_an[n_an + i].an_name = add[i]->ad_cname;
+        wide_an[n_an + i].an_desc = add[i];
+    }
+    
+    ctx->orig_attrs = op->ors_attrs;
+    op->ors_attrs = wide_an;
+    if ( ctx->req.member ) ctx->req.memberuid = 1;
+    ctx->req.rules_src |= ctx->req.rules;
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_search_widen_attrs:  added %d source attribute(s) ('%s'...) to %d requested attribute(s)\n",
+                n_add, add[0]->ad_cname.bv_val, n_an);
+}
+
+/* Ranged retrieval:  slapd cannot parse "member;range=<lo>-<hi>", so the
+   frontend leaves it in the attribute list without a description and
+   would drop whatever is returned for it.  Replies are instead checked
+   against a copy of the client's list in which such names stand for
+   member itself, which takes in the "member;range=..." description the
+   slice goes out under (see automember_member_slice()). */
+static void
+automember_search_range_attrs(
+    Operation               *op,
+    automember_t            *am,
+    automember_search_ctx_t *ctx
+)
+{
+    AttributeName           *an = ctx->orig_attrs ? ctx->orig_attrs : op->ors_attrs;
+    int                     n_an, i, lo, hi;
+    
+    if ( ! ctx->req.member_range ) return;
+    
+    for ( n_an = 0; an[n_an].an_name.bv_val; n_an++ );
+    ctx->reply_attrs = (AttributeName*)op->o_tmpalloc((n_an + 1) * sizeof(AttributeName), op->o_tmpmemctx);
+    memcpy(ctx->reply_attrs, an, (n_an + 1) * sizeof(AttributeName));
+    for ( i = 0; i < n_an; i++ ) {
+        if ( an[i].an_desc == NULL && automember_attr_range_parse(am->attr_member, &an[i].an_name, &lo, &hi) ) {
+            ctx->reply_attrs[i].an_desc = am->attr_member;
+        }
+    }
+}
+
+/* Helper: the attribute list replies are checked against (NULL:  the
+           search's own) */
+static AttributeName*
+automember_search_reply_attrs(
+    automember_search_ctx_t *ctx
+)
+{
+    return ctx->reply_attrs ? ctx->reply_attrs : ctx->orig_attrs;
+}
+
+/* Helper: send the reply against the client's attribute list rather than
+           the widened one */
+static void
+automember_search_client_attrs(
+    Operation               *op,
+    SlapReply               *rs,
+    automember_search_ctx_t *ctx
+)
+{
+    AttributeName           *an = automember_search_reply_attrs(ctx);
+    
+    if ( an && rs->sr_attrs == op->ors_attrs ) rs->sr_attrs = an;
+}
+
+#ifdef AUTOMEMBER_CALLBACK_RESPONSE
+
+    /* Response handler */
+    static int
+    automember_response(
+        Operation       *op,
+        SlapReply       *rs
+    )
+    {
+        slap_overinst   *on = (slap_overinst*)op->o_bd->bd_info;
+        automember_t    *am;
+        automember_search_ctx_t *ctx;
+        int             rc = SLAP_CB_CONTINUE;
+        
+        /* Only entries of searches that asked something of us (the search
+           hook leaves no state otherwise) are of interest: */
+        if ( (rs->sr_type != REP_SEARCH) || (rs->sr_entry == NULL) || ! (ctx = automember_search_ctx_find(op, on)) ) return SLAP_CB_CONTINUE;
+        am = ctx->am;
+        AUTOMEMBER_PROBE(response__entry, rs->sr_entry->e_nname.bv_val);
+        
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_response:  %p %p %p %p\n", am->attr_oc, am->attr_memberuid, am->attr_member, am->oc_member);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_response:  type = %d, entry = %p\n", rs->sr_type, rs->sr_entry);
+        
+        /* React to searches that produced non-empty results of the correct objectClass : */
+        {
+            unsigned int    mask = automember_dispatch(am, rs->sr_entry);
+            
+            if ( mask & ctx->req.rules ) automember_populate_rules_attr(op, rs, on, am, &ctx->req, mask);
+            if ( mask & AUTOMEMBER_DISPATCH_MEMBER ) {
+                if ( am->attr_memberuid && am->attr_member && am->synth_tmpl ) {
+                    rc = automember_populate_member_attr(
+                                op,
+                                rs,
+                                on,
+                                am,
+                                &ctx->req);
+                }
+            }
+            else if ( mask & AUTOMEMBER_DISPATCH_MEMBEROF ) {
+                if ( am->attr_uid && am->attr_memberof ) {
+                    rc = automember_populate_memberof_attr(
+                                op,
+                                rs,
+                                on,
+                                am,
+                                &ctx->req);
+                }
+            }
+        }
+        AUTOMEMBER_PROBE(response__return, rs->sr_entry->e_nname.bv_val, rc);
+        return rc;
+    }
+    
+    /* Per-search callback:  sits above the response handler, so replies
+       are pointed back at the client's attribute list before it runs */
+    static int
+    automember_search_cb(
+        Operation           *op,
+        SlapReply           *rs
+    )
+    {
+        automember_search_ctx_t *ctx = (automember_search_ctx_t *)op->o_callback->sc_private;
+        
+        if ( rs->sr_type == REP_SEARCH ) automember_search_client_attrs(op, rs, ctx);
+        return SLAP_CB_CONTINUE;
+    }
+
+#endif
+
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+    
+    /* Resolve memberOf for every held person entry:  the index answers what
+       it can, everything else shares one internal search. */
+    static void
+    automember_search_resolve_held(
+        Operation               *op,
+        automember_search_ctx_t *ctx
+    )
+    {
+        slap_overinst           *on = ctx->on;
+        automember_t            *am = ctx->am;
+        automember_memberof_key_t   *keys;
+        int                     i, n_keys = 0;
+        automember_timer_t      timer;
+        
+        AUTOMEMBER_TIMER_START(am, timer);
+        keys = (automember_memberof_key_t*)op->o_tmpcalloc(ctx->n_held, sizeof(automember_memberof_key_t), op->o_tmpmemctx);
+        for ( i = 0; i < ctx->n_held; i++ ) {
+            automember_held_entry_t *h = &ctx->held[i];
+            struct berval           *uid_value;
+            BerVarray               dn_list = NULL, ndn_list = NULL;
+            
+            if ( ! h->wants_memberof ) continue;
+            h->wants_memberof = 0;
+            if ( (uid_value = automember_entry_uid(am, h->e)) == NULL ) continue;
+            
+            if ( am->use_memberof_idx && automember_idx_lookup(op, on, am, uid_value, &dn_list, &ndn_list) == LDAP_SUCCESS ) {
+                if ( dn_list ) {
+                    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED, 1);
+                    if ( automember_memberof_merge(op, on, am, h->e, dn_list, ndn_list) != 0 ) {
+                        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_search_resolve_held:  failed to append memberOf attribute to entry\n");
+                    }
+                    ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+                    ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+                }
+                continue;
+            }
+            if ( attr_normalize_one(am->attr_memberuid, uid_value, &h->nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) continue;
+            if ( BER_BVISNULL(&h->nuid) ) ber_dupbv_x(&h->nuid, uid_value, op->o_tmpmemctx);
+            h->wants_memberof = 1;
+            keys[n_keys++].nuid = h->nuid;
+        }
+        
+        if ( n_keys ) {
+            int     n_unique = 1;
+            
+            /* Sort and drop duplicate uids (the keys share the held entries'
+               nuid storage): */
+            qsort(keys, n_keys, sizeof(automember_memberof_key_t), automember_memberof_key_cmp);
+            for ( i = 1; i < n_keys; i++ ) {
+                if ( automember_memberof_key_cmp(&keys[i], &keys[n_unique - 1]) ) keys[n_unique++] = keys[i];
+            }
+            n_keys = n_unique;
+            
+            if ( automember_collect_memberof_dn_batch(op, on, am, keys, n_keys) == LDAP_SUCCESS ) {
+                for ( i = 0; i < ctx->n_held; i++ ) {
+                    automember_held_entry_t     *h = &ctx->held[i];
+                    automember_memberof_key_t   key, *match;
+                    
+                    if ( ! h->wants_memberof ) continue;
+                    key.nuid = h->nuid;
+                    match = (automember_memberof_key_t*)bsearch(&key, keys, n_keys,
+                                        sizeof(automember_memberof_key_t), automember_memberof_key_cmp);
+                    if ( match && match->dn_list ) {
+                        AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED, 1);
+                        if ( automember_memberof_merge(op, on, am, h->e, match->dn_list, match->ndn_list) != 0 ) {
+                            Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_search_resolve_held:  failed to append memberOf attribute to entry\n");
+                        }
+                    }
+                }
+                for ( i = 0; i < n_keys; i++ ) {
+                    if ( keys[i].dn_list ) ber_bvarray_free_x(keys[i].dn_list, op->o_tmpmemctx);
+                    if ( keys[i].ndn_list ) ber_bvarray_free_x(keys[i].ndn_list, op->o_tmpmemctx);
+                }
+            }
+            for ( i = 0; i < ctx->n_held; i++ ) {
+                if ( ! BER_BVISNULL(&ctx->held[i].nuid) ) {
+                    ber_memfree_x(ctx->held[i].nuid.bv_val, op->o_tmpmemctx);
+                    BER_BVZERO(&ctx->held[i].nuid);
+                }
+            }
+        }
+        op->o_tmpfree(keys, op->o_tmpmemctx);
+        AUTOMEMBER_TIMER_STOP(am, AUTOMEMBER_PATH_MEMBEROF, timer);
+    }
+    
+    /* Prefetch:  rather than resolve a window of person entries with one
+       search once it fills, each entry's memberOf lookup is handed to the
+       thread pool as the entry arrives, and the window releases entries
+       in order as their lookups finish.  The lookups for the entries
+       behind the one being sent thus overlap its encoding and sending. */
+    
+    /* Helper: run pf's lookup on op, keeping the answer on the heap */
+    static void
+    automember_prefetch_lookup(
+        Operation               *op,
+        automember_prefetch_t   *pf
+    )
+    {
+        BerVarray               dn_list = NULL, ndn_list = NULL;
+        
+        if ( automember_uid_memberof(op, pf->on, pf->am, &pf->uid, &dn_list, &ndn_list) == LDAP_SUCCESS && dn_list ) {
+            ber_bvarray_dup_x(&pf->dn_list, dn_list, NULL);
+            if ( ndn_list ) ber_bvarray_dup_x(&pf->ndn_list, ndn_list, NULL);
+        }
+        if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+        if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+    }
+    
+    /* Helper: drop a reference to pf (cancelling its lookup if the pool has
+       yet to start it), freeing it with the last */
+    static void
+    automember_prefetch_put(
+        automember_prefetch_t   *pf
+    )
+    {
+        int                     refs;
+        
+        ldap_pvt_thread_mutex_lock(&pf->mutex);
+        if ( pf->state == AUTOMEMBER_PREFETCH_QUEUED ) __atomic_store_n(&pf->state, AUTOMEMBER_PREFETCH_DONE, __ATOMIC_RELEASE);
+        refs = --pf->refs;
+        ldap_pvt_thread_mutex_unlock(&pf->mutex);
+        if ( refs > 0 ) return;
+        
+        ldap_pvt_thread_cond_destroy(&pf->cond);
+        ldap_pvt_thread_mutex_destroy(&pf->mutex);
+        ch_free(pf->uid.bv_val);
+        if ( pf->dn_list ) ber_bvarray_free(pf->dn_list);
+        if ( pf->ndn_list ) ber_bvarray_free(pf->ndn_list);
+        automember_conf_put(pf->on, pf->conf_slot);
+        ch_free(pf);
+    }
+    
+    static void*
+    automember_prefetch_task(
+        void                    *thrctx,
+        void                    *arg
+    )
+    {
+        automember_prefetch_t   *pf = (automember_prefetch_t*)arg;
+        int                     is_mine;
+        
+        ldap_pvt_thread_mutex_lock(&pf->mutex);
+        if ( (is_mine = (pf->state == AUTOMEMBER_PREFETCH_QUEUED)) ) pf->state = AUTOMEMBER_PREFETCH_RUNNING;
+        ldap_pvt_thread_mutex_unlock(&pf->mutex);
+        
+        if ( is_mine ) {
+            Connection          conn = { 0 };
+            OperationBuffer     opbuf;
+            Operation           *op;
+            BackendDB           be;
+            
+            connection_fake_init(&conn, &opbuf, thrctx);
+            op = &opbuf.ob_op;
+            automember_snapshot_op(op, &be, pf->on, pf->am);
+            automember_prefetch_lookup(op, pf);
+            
+            ldap_pvt_thread_mutex_lock(&pf->mutex);
+            __atomic_store_n(&pf->state, AUTOMEMBER_PREFETCH_DONE, __ATOMIC_RELEASE);
+            ldap_pvt_thread_cond_signal(&pf->cond);
+            ldap_pvt_thread_mutex_unlock(&pf->mutex);
+        }
+        automember_prefetch_put(pf);
+        return NULL;
+    }
+    
+    /* Helper: start the memberOf lookup for held entry h */
+    static void
+    automember_prefetch_start(
+        automember_search_ctx_t *ctx,
+        automember_held_entry_t *h
+    )
+    {
+        struct berval           *uid_value = automember_entry_uid(ctx->am, h->e);
+        automember_prefetch_t   *pf;
+        
+        if ( uid_value == NULL ) return;
+        pf = (automember_prefetch_t*)ch_calloc(1, sizeof(automember_prefetch_t));
+        ldap_pvt_thread_mutex_init(&pf->mutex);
+        ldap_pvt_thread_cond_init(&pf->cond);
+        pf->state = AUTOMEMBER_PREFETCH_QUEUED;
+        pf->refs = 2;
+        pf->on = ctx->on;
+        pf->am = ctx->am;
+        pf->conf_slot = ctx->conf_slot;
+        automember_conf_hold(pf->on, pf->conf_slot);
+        ber_dupbv(&pf->uid, uid_value);
+        h->pf = pf;
+        
+        /* Left queued, it is run by the search when its turn comes: */
+        if ( ldap_pvt_thread_pool_submit(&connection_pool, automember_prefetch_task, pf) != 0 ) {
+            Debug(LDAP_DEBUG_TRACE, "automember: automember_prefetch_start:  pool refused uid '%s', looked up in turn\n", uid_value->bv_val);
+            pf->refs = 1;
+        }
+    }
+    
+    /* Helper: wait for the lookup for held entry h (running it here if the
+       pool has yet to start it) and add its answer to the entry */
+    static void
+    automember_prefetch_finish(
+        Operation               *op,
+        automember_search_ctx_t *ctx,
+        automember_held_entry_t *h
+    )
+    {
+        automember_prefetch_t   *pf = h->pf;
+        int                     is_mine;
+        
+        h->pf = NULL;
+        if ( op->o_abandon ) {
+            automember_prefetch_put(pf);
+            return;
+        }
+        
+        ldap_pvt_thread_mutex_lock(&pf->mutex);
+        if ( (is_mine = (pf->state == AUTOMEMBER_PREFETCH_QUEUED)) ) pf->state = AUTOMEMBER_PREFETCH_RUNNING;
+        while ( ! is_mine && pf->state != AUTOMEMBER_PREFETCH_DONE ) ldap_pvt_thread_cond_wait(&pf->cond, &pf->mutex);
+        ldap_pvt_thread_mutex_unlock(&pf->mutex);
+        
+        if ( is_mine ) {
+            automember_prefetch_lookup(op, pf);
+            __atomic_store_n(&pf->state, AUTOMEMBER_PREFETCH_DONE, __ATOMIC_RELEASE);
+        }
+        if ( pf->dn_list ) {
+            AUTOMEMBER_STAT_ADD(ctx->am, AUTOMEMBER_STAT_ENTRIES_SYNTHESIZED, 1);
+            if ( automember_memberof_merge(op, ctx->on, ctx->am, h->e, pf->dn_list, pf->ndn_list) != 0 ) {
+                Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_prefetch_finish:  failed to append memberOf attribute to entry\n");
+            }
+        }
+        automember_prefetch_put(pf);
+    }
+    
+    /* Release the first n held entries downstream, in the order they
+       arrived, and move the rest up: */
+    static void
+    automember_search_release(
+        Operation               *op,
+        automember_search_ctx_t *ctx,
+        int                     n
+    )
+    {
+        int                     i;
+        
+        for ( i = 0; i < n; i++ ) {
+            automember_held_entry_t *h = &ctx->held[i];
+            SlapReply           rs2 = { REP_SEARCH };
+            
+            if ( h->pf ) automember_prefetch_finish(op, ctx, h);
+            if ( ctx->is_gone || op->o_abandon ) {
+                entry_free(h->e);
+                continue;
             }
-            rc = SLAP_CB_CONTINUE;
+            rs2.sr_entry = h->e;
+            rs2.sr_attrs = automember_search_reply_attrs(ctx) ? automember_search_reply_attrs(ctx) : op->ors_attrs;
+            rs2.sr_flags = REP_ENTRY_MODIFIABLE | REP_ENTRY_MUSTBEFREED;
+            
+            /* Skip ourselves on the way down: */
+            op->o_callback = ctx->sc.sc_next;
+            if ( send_search_entry(op, &rs2) == LDAP_UNAVAILABLE ) ctx->is_gone = 1;
+            op->o_callback = &ctx->sc;
+            rs_flush_entry(op, &rs2, NULL);
         }
+        ctx->n_held -= n;
+        if ( ctx->n_held ) memmove(ctx->held, ctx->held + n, ctx->n_held * sizeof(automember_held_entry_t));
     }
-    return rc;
-}
-
-#ifdef AUTOMEMBER_CALLBACK_RESPONSE
-
-    /* Response handler */
-    static int
-    automember_response(
-        Operation       *op,
-        SlapReply       *rs
+    
+    /* Release all the held entries downstream, in the order they arrived: */
+    static void
+    automember_search_flush(
+        Operation               *op,
+        automember_search_ctx_t *ctx
     )
     {
-        slap_overinst   *on = (slap_overinst*)op->o_bd->bd_info;
-        automember_t    *am = (automember_t *)on->on_bi.bi_private;
-        int             rc = SLAP_CB_CONTINUE;
+        if ( ctx->n_held == 0 ) return;
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_search_flush:  releasing %d held entries\n", ctx->n_held);
         
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_response:  %p %p %p %p\n", am->attr_oc, am->attr_memberuid, am->attr_member, am->oc_member);
-        
-        /* If we aren't configured, don't do anything: */
-        if ( ! (am->attr_oc && am->attr_memberuid && am->attr_member && am->synth_tmpl && am->oc_member) ) return SLAP_CB_CONTINUE;
+        if ( ! op->o_abandon ) automember_search_resolve_held(op, ctx);
+        automember_search_release(op, ctx, ctx->n_held);
+    }
+    
+    /* Hold a copy of the reply entry back from the client; it is counted as
+       sent now so the backend's size limit and paging stay exact. */
+    static int
+    automember_search_hold(
+        Operation               *op,
+        SlapReply               *rs,
+        automember_search_ctx_t *ctx,
+        int                     wants_memberof
+    )
+    {
+        automember_held_entry_t *h = &ctx->held[ctx->n_held++];
+        int                     n;
         
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_response:  type = %d, entry = %p\n", rs->sr_type, rs->sr_entry);
+        h->e = entry_dup(rs->sr_entry);
+        AUTOMEMBER_STAT_ADD(ctx->am, AUTOMEMBER_STAT_ENTRY_COPIES, 1);
+        h->wants_memberof = wants_memberof;
+        BER_BVZERO(&h->nuid);
+        h->pf = NULL;
+        rs->sr_nentries++;
         
-        /* React to searches that produced non-empty results of the correct objectClass : */
-        if ( (rs->sr_type == REP_SEARCH) && (rs->sr_entry != NULL) ) {
-            if ( am->oc_member && is_entry_objectclass_or_sub(rs->sr_entry, am->oc_member) ) {
-                if ( am->attr_memberuid && am->attr_member && am->synth_tmpl ) {
-                    rc = automember_populate_member_attr(
-                                op,
-                                rs,
-                                on,
-                                am,
-                                0 /* force addition */);
-                }
-            }
-            else if ( am->oc_memberof && is_entry_objectclass_or_sub(rs->sr_entry, am->oc_memberof) ) {
-                if ( am->attr_uid && am->attr_memberof ) {
-                    rc = automember_populate_memberof_attr(
-                                op,
-                                rs,
-                                on,
-                                am,
-                                0 /* force addition */);
-                }
-            }
+        if ( ! ctx->prefetch ) {
+            if ( ctx->n_held == ctx->batch_size ) automember_search_flush(op, ctx);
+            return LDAP_SUCCESS;
         }
-        return rc;
+        if ( h->wants_memberof ) automember_prefetch_start(ctx, h);
+        h->wants_memberof = 0;
+        
+        /* Send what is ready at the front of the window, and the oldest
+           entry come what may once the window is full: */
+        for ( n = 0; n < ctx->n_held && AUTOMEMBER_PREFETCH_IS_DONE(&ctx->held[n]); n++ );
+        if ( n == 0 && ctx->n_held == ctx->batch_size ) n = 1;
+        if ( n ) automember_search_release(op, ctx, n);
+        return LDAP_SUCCESS;
     }
-
-#endif
-
-#ifdef AUTOMEMBER_CALLBACK_SEARCH
     
     static int
     automember_search_cb(
@@ -742,74 +6767,597 @@ automember_populate_memberof_attr(
         SlapReply           *rs
     )
     {
-        slap_overinst       *on = (slap_overinst *)((slap_callback *)op->o_callback)->sc_private;
-        automember_t        *am = (automember_t *)on->on_bi.bi_private;
+        automember_search_ctx_t *ctx = (automember_search_ctx_t *)op->o_callback->sc_private;
+        slap_overinst       *on = ctx->on;
+        automember_t        *am = ctx->am;
         int                 rc = SLAP_CB_CONTINUE;
         
         Debug(LDAP_DEBUG_TRACE, "automember: automember_search_cb:  %p %p %p %p\n", op, rs, on, am);
         
-        /* If we aren't configured, don't do anything: */
-        if ( ! (am->attr_oc && am->attr_memberuid && am->attr_member && am->synth_tmpl && am->oc_member) ) return SLAP_CB_CONTINUE;
-        
         Debug(LDAP_DEBUG_TRACE, "automember: automember_search_cb:  type = %d, entry = %p\n", rs->sr_type, rs->sr_entry);
         
         /* React to searches that produced non-empty results of the correct objectClass : */
         if ( rs->sr_entry != NULL ) {
-            if ( am->oc_member && is_entry_objectclass_or_sub(rs->sr_entry, am->oc_member) ) {
+            AUTOMEMBER_PROBE(response__entry, rs->sr_entry->e_nname.bv_val);
+            automember_search_client_attrs(op, rs, ctx);
+            
+            /* Entries carrying controls are never held back: */
+            int             can_hold = (ctx->batch_size > 1 || ctx->prefetch) && (rs->sr_type == REP_SEARCH) && (rs->sr_ctrls == NULL);
+            unsigned int    mask = automember_dispatch(am, rs->sr_entry);
+            
+            if ( mask & ctx->req.rules ) automember_populate_rules_attr(op, rs, on, am, &ctx->req, mask);
+            if ( mask & AUTOMEMBER_DISPATCH_MEMBER ) {
                 if ( am->attr_memberuid && am->attr_member && am->synth_tmpl ) {
                     rc = automember_populate_member_attr(
                                 op,
                                 rs,
                                 on,
                                 am,
-                                1 /* force addition */);
+                                &ctx->req);
                 }
             }
-            else if ( am->oc_memberof && is_entry_objectclass_or_sub(rs->sr_entry, am->oc_memberof) ) {
+            else if ( mask & AUTOMEMBER_DISPATCH_MEMBEROF ) {
                 if ( am->attr_uid && am->attr_memberof ) {
+                    if ( can_hold ) {
+                        rc = automember_search_hold(op, rs, ctx,
+                                    ctx->req.memberof && attr_find(rs->sr_entry->e_attrs, am->attr_memberof) == NULL);
+                        AUTOMEMBER_PROBE(response__return, rs->sr_entry->e_nname.bv_val, rc);
+                        return rc;
+                    }
+                    automember_search_flush(op, ctx);
                     rc = automember_populate_memberof_attr(
                                 op,
                                 rs,
                                 on,
                                 am,
-                                1 /* force addition */);
+                                &ctx->req);
+                }
+            }
+            /* Anything following a held entry must wait its turn: */
+            if ( ctx->n_held ) {
+                if ( can_hold ) {
+                    rc = automember_search_hold(op, rs, ctx, 0);
+                } else {
+                    automember_search_flush(op, ctx);
                 }
             }
+            AUTOMEMBER_PROBE(response__return, rs->sr_entry->e_nname.bv_val, rc);
+        } else if ( ctx->n_held ) {
+            /* References and the final result go out after the held entries: */
+            automember_search_flush(op, ctx);
         }
         return rc;
     }
     
-    static int
-    automember_search(
-        Operation           *op,
-        SlapReply           *rs
-    )
+#endif
+
+static int
+automember_search_cleanup(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    automember_search_ctx_t *ctx = (automember_search_ctx_t*)op->o_callback->sc_private;
+    
+    /* Done sending an entry we wrapped: */
+    if ( ctx->wrap ) automember_entry_unwrap(op, rs, ctx);
+    
+    if ( (rs->sr_type == REP_RESULT) || op->o_abandon || (rs->sr_err == SLAPD_ABANDON) ) {
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+        /* Anything still held at the end (abandoned search) is discarded: */
+        while ( ctx->n_held > 0 ) {
+            automember_held_entry_t *h = &ctx->held[--ctx->n_held];
+            
+            if ( h->pf ) automember_prefetch_put(h->pf);
+            entry_free(h->e);
+        }
+        if ( ctx->held ) op->o_tmpfree(ctx->held, op->o_tmpmemctx);
+#endif
+        LDAP_SLIST_REMOVE(&op->o_extra, &ctx->oe, OpExtra, oe_next);
+        automember_nested_memo_clear(op, &ctx->nested_parents);
+        while ( ctx->req.range_ads ) {
+            AttributeDescription    *ad = ctx->req.range_ads;
+            
+            ctx->req.range_ads = ad->ad_next;
+            op->o_tmpfree(ad, op->o_tmpmemctx);
+        }
+        if ( ctx->reply_attrs ) op->o_tmpfree(ctx->reply_attrs, op->o_tmpmemctx);
+        /* Put the client's filter and attribute list back: */
+        if ( ctx->orig_filter ) {
+            filter_free_x(op, op->ors_filter, 1);
+            op->o_tmpfree(op->ors_filterstr.bv_val, op->o_tmpmemctx);
+            op->ors_filter = ctx->orig_filter;
+            op->ors_filterstr = ctx->orig_filterstr;
+        }
+        if ( ctx->orig_attrs ) {
+            op->o_tmpfree(op->ors_attrs, op->o_tmpmemctx);
+            op->ors_attrs = ctx->orig_attrs;
+        }
+        
+        op->o_callback = ctx->sc.sc_next;
+        automember_conf_put(ctx->on, ctx->conf_slot);
+        op->o_tmpfree(ctx, op->o_tmpmemctx);
+    }
+    return 0;
+}
+
+/* Search hook */
+static int
+automember_search(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    slap_overinst           *on = (slap_overinst*)op->o_bd->bd_info;
+    int                     conf_slot;
+    automember_t            *am = automember_conf_get(on, &conf_slot);
+    automember_search_ctx_t *ctx;
+    
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  %p %p %p %p %p\n", op, rs, on, am, rs->sr_entry);
+    
+    /* Stored values need neither synthesis nor filter rewriting (the
+       additional rules are synthesized regardless): */
+    if ( (am->materialize || ! (am->oc_member || am->oc_memberof)) && ! am->rules ) {
+        automember_conf_put(on, conf_slot);
+        return SLAP_CB_CONTINUE;
+    }
+    
+    ctx = (automember_search_ctx_t*)op->o_tmpcalloc(1, sizeof(automember_search_ctx_t), op->o_tmpmemctx);
+    ctx->op = op;
+    ctx->on = on;
+    ctx->am = am;
+    ctx->conf_slot = conf_slot;
+    
+    /* What the client wants cannot change during the search: */
+    automember_attr_req_analyze(am, op->ors_attrs, &ctx->req);
+    if ( am->materialize || ! am->oc_member ) ctx->req.member = ctx->req.member_range = 0;
+    if ( am->materialize || ! am->oc_memberof ) ctx->req.memberof = 0;
+    if ( ctx->req.member || ctx->req.memberof || ctx->req.rules ) automember_policy_apply(op, am, &ctx->req);
+    if ( am->oc_member && ! am->materialize ) automember_search_rewrite_filter(op, on, am, ctx);
+    automember_search_widen_attrs(op, am, ctx);
+    automember_search_range_attrs(op, am, ctx);
+    
+    /* With nothing to synthesize and no filter to put back, keep out of
+       the search's way entirely: */
+    if ( ! ctx->req.member && ! ctx->req.memberof && ! ctx->req.rules && ! ctx->orig_filter ) {
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  nothing to synthesize\n");
+        op->o_tmpfree(ctx, op->o_tmpmemctx);
+        automember_conf_put(on, conf_slot);
+        return SLAP_CB_CONTINUE;
+    }
+#ifdef AUTOMEMBER_CALLBACK_SEARCH
+    ctx->batch_size = ctx->req.memberof ? am->memberof_batch : 1;
+    if ( ctx->req.memberof && am->memberof_prefetch > 0 ) {
+        ctx->batch_size = am->memberof_prefetch;
+        ctx->prefetch = 1;
+    }
+    if ( ctx->batch_size > 1 || ctx->prefetch ) {
+        ctx->held = op->o_tmpcalloc(ctx->batch_size, sizeof(automember_held_entry_t), op->o_tmpmemctx);
+    }
+#endif
+    
+    /* The response handler and the nested group memo find us through the
+       operation: */
+    ctx->oe.oe_key = on;
+    LDAP_SLIST_INSERT_HEAD(&op->o_extra, &ctx->oe, oe_next);
+    
+    /* Chain to the next backend with our callback in place */
+    ctx->sc.sc_response = automember_search_cb;
+    ctx->sc.sc_cleanup  = automember_search_cleanup;
+    ctx->sc.sc_private  = ctx;
+    ctx->sc.sc_next     = op->o_callback;
+    op->o_callback      = &ctx->sc;
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  callback linked into op chain (%p)\n", &ctx->sc);
+    
+    return SLAP_CB_CONTINUE;
+}
+
+/**************************/
+
+/* Compare:  authorization checks (mod_authnz_ldap's "Require ldap-group"
+   and the like) compare member on a group, or memberOf on a person,
+   rather than read the whole list.  Neither is stored, so the backend
+   could only answer compareFalse; the hook answers them here instead,
+   each from the one stored value that decides it:
+
+     member=<dn> on a group      memberUid lists the uid the DN maps
+                                 back to (as the filter rewriting does)
+     memberOf=<dn> on a person   the group at <dn> lists the person's uid
+                                 in memberUid
+
+   Anything else (other attributes, entries the attribute is not
+   synthesized on, stored values when materializing) goes on to the
+   backend. */
+
+/* Helper: does group entry g list uid_value in memberUid? */
+static int
+automember_group_lists_uid(
+    Operation           *op,
+    automember_t        *am,
+    Entry               *g,
+    struct berval       *uid_value
+)
+{
+    Attribute           *a = attr_find(g->e_attrs, am->attr_memberuid);
+    struct berval       nuid = BER_BVNULL;
+    int                 found;
+    
+    if ( ! a ) return 0;
+    if ( attr_normalize_one(am->attr_memberuid, uid_value, &nuid, op->o_tmpmemctx) != LDAP_SUCCESS ) return 0;
+    found = ( attr_valfind(a, SLAP_MR_ATTRIBUTE_VALUE_NORMALIZED_MATCH | SLAP_MR_ASSERTED_VALUE_NORMALIZED_MATCH,
+                    BER_BVISNULL(&nuid) ? uid_value : &nuid, NULL, op->o_tmpmemctx) == LDAP_SUCCESS );
+    if ( ! BER_BVISNULL(&nuid) ) ber_memfree_x(nuid.bv_val, op->o_tmpmemctx);
+    return found;
+}
+
+/* Helper: is person entry e a member of the group with normalized DN
+           group_ndn, as its synthesized memberOf would say? */
+static int
+automember_compare_memberof(
+    Operation           *op,
+    slap_overinst       *on,
+    automember_t        *am,
+    Entry               *e,
+    struct berval       *group_ndn
+)
+{
+    struct berval       *uid_value = automember_entry_uid(am, e);
+    Entry               *g = NULL;
+    BerVarray           dn_list = NULL, ndn_list = NULL;
+    int                 found = 0, i;
+    
+    if ( ! uid_value ) return 0;
+    if ( automember_group_in_bases(am, group_ndn) &&
+         overlay_entry_get_ov(op, group_ndn, am->oc_member, am->attr_memberuid, 0, &g, on) == LDAP_SUCCESS && g )
+    {
+        found = automember_group_lists_uid(op, am, g, uid_value);
+        overlay_entry_release_ov(op, g, 0, on);
+    }
+    if ( found || ! am->nested_filter ) return found;
+    
+    /* Not a direct member, but it may be one through nesting: */
+    if ( automember_person_memberof(op, on, am, e, &dn_list, &ndn_list) != LDAP_SUCCESS || ! dn_list ) return 0;
+    automember_nested_expand(op, on, am, &dn_list, &ndn_list);
+    for ( i = 0; ! found && ndn_list && ! BER_BVISNULL(&ndn_list[i]); i++ ) {
+        found = bvmatch(&ndn_list[i], group_ndn);
+    }
+    if ( dn_list ) ber_bvarray_free_x(dn_list, op->o_tmpmemctx);
+    if ( ndn_list ) ber_bvarray_free_x(ndn_list, op->o_tmpmemctx);
+    return found;
+}
+
+/* Helper: the compare hook, under configuration am */
+static int
+automember_compare_conf(
+    Operation               *op,
+    SlapReply               *rs,
+    slap_overinst           *on,
+    automember_t            *am
+)
+{
+    AttributeAssertion      *ava = op->orc_ava;
+    Entry                   *e = NULL;
+    unsigned int            mask;
+    struct berval           uid;
+    int                     found = 0;
+    
+    if ( am->materialize || ! am->oc_member ) return SLAP_CB_CONTINUE;
+    if ( ava->aa_desc != am->attr_member && (ava->aa_desc != am->attr_memberof || ! am->oc_memberof) ) return SLAP_CB_CONTINUE;
+    if ( overlay_entry_get_ov(op, &op->o_req_ndn, NULL, NULL, 0, &e, on) != LDAP_SUCCESS || ! e ) return SLAP_CB_CONTINUE;
+    
+    /* Only where the attribute would be synthesized (and is not stored): */
+    mask = automember_dispatch(am, e);
+    if ( ! (mask & (( ava->aa_desc == am->attr_member ) ? AUTOMEMBER_DISPATCH_MEMBER : AUTOMEMBER_DISPATCH_MEMBEROF)) ||
+         attr_find(e->e_attrs, ava->aa_desc) )
     {
-        slap_overinst       *on = (slap_overinst*)op->o_bd->bd_info;
-        automember_t        *am = (automember_t *)on->on_bi.bi_private;
+        overlay_entry_release_ov(op, e, 0, on);
+        return SLAP_CB_CONTINUE;
+    }
+    
+    /* As the backend would have it: */
+    if ( ! access_allowed(op, e, ava->aa_desc, &ava->aa_value, ACL_COMPARE, NULL) ) {
+        rs->sr_err = access_allowed(op, e, slap_schema.si_ad_entry, NULL, ACL_DISCLOSE, NULL) ? LDAP_INSUFFICIENT_ACCESS : LDAP_NO_SUCH_OBJECT;
+        goto done;
+    }
+    
+    if ( ava->aa_desc == am->attr_member ) {
+        /* A DN that maps back to no uid is not a member: */
+        if ( am->resolve_base ) {
+            if ( automember_resolve_dn_to_uid(op, on, am, &ava->aa_value, &uid) ) {
+                found = automember_group_lists_uid(op, am, e, &uid);
+                op->o_tmpfree(uid.bv_val, op->o_tmpmemctx);
+            }
+        } else if ( automember_member_dn_to_uid(am, &ava->aa_value, &uid) ) {
+            found = automember_group_lists_uid(op, am, e, &uid);
+        }
+    } else {
+        found = automember_compare_memberof(op, on, am, e, &ava->aa_value);
+    }
+    AUTOMEMBER_STAT_ADD(am, AUTOMEMBER_STAT_COMPARES, 1);
+    rs->sr_err = found ? LDAP_COMPARE_TRUE : LDAP_COMPARE_FALSE;
+    Debug(LDAP_DEBUG_TRACE, "automember: automember_compare:  %s=%s on '%s' is %s\n", ava->aa_desc->ad_cname.bv_val,
+                ava->aa_value.bv_val, op->o_req_ndn.bv_val, found ? "true" : "false");
+    
+done:
+    overlay_entry_release_ov(op, e, 0, on);
+    send_ldap_result(op, rs);
+    return rs->sr_err;
+}
+
+/* Compare hook */
+static int
+automember_compare(
+    Operation               *op,
+    SlapReply               *rs
+)
+{
+    slap_overinst           *on = (slap_overinst*)op->o_bd->bd_info;
+    int                     conf_slot, rc;
+    automember_t            *am = automember_conf_get(on, &conf_slot);
+    
+    rc = automember_compare_conf(op, rs, on, am);
+    automember_conf_put(on, conf_slot);
+    return rc;
+}
+
+/**************************/
+
+#ifdef AUTOMEMBER_MONITOR
+
+/* Monitoring:  the statistics are added to the database's own entry under
+   cn=Databases,cn=Monitor (as an olmAutomemberStatistics auxiliary class)
+   and refreshed whenever that entry is read. */
+
+static ObjectClass          *oc_olmAutomemberStatistics;
+
+/* The counters, in AUTOMEMBER_STAT_* order, then the latency histograms
+   in AUTOMEMBER_PATH_* order: */
+static AttributeDescription *automember_monitor_ad[AUTOMEMBER_STAT_COUNT + AUTOMEMBER_PATH_COUNT];
+
+static const char           *automember_monitor_at[AUTOMEMBER_STAT_COUNT + AUTOMEMBER_PATH_COUNT] = {
+        "( 1.3.6.1.4.1.4203.666.11.100.1.1 NAME 'olmAutomemberEntriesSynthesized' "
+            "DESC 'Reply entries given synthesized member or memberOf values' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.2 NAME 'olmAutomemberValuesExpanded' "
+            "DESC 'memberUid values expanded through the synth template' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.3 NAME 'olmAutomemberSourceFetches' "
+            "DESC 'Groups whose memberUid values were read back from the database' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.4 NAME 'olmAutomemberMemberOfSearches' "
+            "DESC 'Internal searches made to resolve memberOf' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.5 NAME 'olmAutomemberEntryCopies' "
+            "DESC 'Reply entries duplicated in order to be modified' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.12 NAME 'olmAutomemberEntryWraps' "
+            "DESC 'Reply entries wrapped to share their attributes read-only' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.9 NAME 'olmAutomemberResolveHits' "
+            "DESC 'memberUid values resolved to DNs from the resolver cache' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.10 NAME 'olmAutomemberResolveSearches' "
+            "DESC 'Internal searches made to resolve memberUid values to DNs' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.11 NAME 'olmAutomemberCompares' "
+            "DESC 'member and memberOf compares answered without synthesis' "
+            "EQUALITY integerMatch SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.6 NAME 'olmAutomemberMemberLatency' "
+            "DESC 'member synthesis times: <upper bound> <count> per non-empty bucket' "
+            "SYNTAX 1.3.6.1.4.1.1466.115.121.1.15 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )",
+        "( 1.3.6.1.4.1.4203.666.11.100.1.7 NAME 'olmAutomemberMemberOfLatency' "
+            "DESC 'memberOf synthesis times: <upper bound> <count> per non-empty bucket' "
+            "SYNTAX 1.3.6.1.4.1.1466.115.121.1.15 "
+            "NO-USER-MODIFICATION USAGE dSAOperation )"
+    };
+
+static const char           *automember_monitor_oc =
+        "( 1.3.6.1.4.1.4203.666.11.100.2.1 NAME 'olmAutomemberStatistics' "
+            "DESC 'automember overlay statistics' "
+            "SUP top AUXILIARY "
+            "MAY ( olmAutomemberEntriesSynthesized $ olmAutomemberValuesExpanded $ "
+                  "olmAutomemberSourceFetches $ olmAutomemberMemberOfSearches $ "
+                  "olmAutomemberEntryCopies $ olmAutomemberEntryWraps $ "
+                  "olmAutomemberResolveHits $ "
+                  "olmAutomemberResolveSearches $ olmAutomemberCompares $ "
+                  "olmAutomemberMemberLatency $ olmAutomemberMemberOfLatency ) )";
+
+/* Register the statistics schema (once, and only if back-monitor exists): */
+static int
+automember_monitor_initialize(void)
+{
+    static int      has_been_called = 0;
+    static int      rc = LDAP_OTHER;
+    int             i;
+    
+    if ( has_been_called ) return rc;
+    has_been_called = 1;
+    if ( backend_info("monitor") == NULL ) return rc;
+    
+    for ( i = 0; i < AUTOMEMBER_STAT_COUNT + AUTOMEMBER_PATH_COUNT; i++ ) {
+        int     at_rc = register_at(automember_monitor_at[i], &automember_monitor_ad[i], 0);
+        
+        if ( at_rc ) {
+            Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_monitor_initialize:  register_at #%d failed (rc=%d)\n", i, at_rc);
+            return rc;
+        }
+    }
+    if ( register_oc(automember_monitor_oc, &oc_olmAutomemberStatistics, 0) ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "automember: automember_monitor_initialize:  register_oc failed\n");
+        return rc;
+    }
+    rc = LDAP_SUCCESS;
+    return rc;
+}
+
+/* Monitor entry read:  copy the current statistics into it */
+static int
+automember_monitor_update(
+    Operation       *op,
+    SlapReply       *rs,
+    Entry           *e,
+    void            *priv
+)
+{
+    automember_state_t  *st = (automember_state_t*)priv;
+    char            buf[SLAP_TEXT_BUFLEN];
+    struct berval   bv;
+    int             i, path;
+    
+    bv.bv_val = buf;
+    for ( i = 0; i < AUTOMEMBER_STAT_COUNT; i++ ) {
+        Attribute   *a = attr_find(e->e_attrs, automember_monitor_ad[i]);
         
-        Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  %p %p %p %p %p\n", op, rs, on, am, rs->sr_entry);
+        if ( ! a ) continue;
+        bv.bv_len = snprintf(buf, sizeof(buf), "%lu", __atomic_load_n(&st->stats.counters[i], __ATOMIC_RELAXED));
+        if ( a->a_nvals != a->a_vals ) ber_bvreplace(&a->a_nvals[0], &bv);
+        ber_bvreplace(&a->a_vals[0], &bv);
+    }
+    for ( path = 0; path < AUTOMEMBER_PATH_COUNT; path++ ) {
+        AttributeDescription    *ad = automember_monitor_ad[AUTOMEMBER_STAT_COUNT + path];
         
-        if ( am->oc_member || am->oc_memberof ) {
-            /* Chain to the next backend with our callback in place */
-            slap_callback       *sc = op->o_tmpcalloc(1, sizeof(slap_callback), op->o_tmpmemctx);
-            
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  callback allocated %p (existing callback %p)\n", sc, op->o_callback);
+        attr_delete(&e->e_attrs, ad);
+        for ( i = 0; i < AUTOMEMBER_LATENCY_BUCKETS; i++ ) {
+            unsigned long       n = __atomic_load_n(&st->stats.latency[path][i], __ATOMIC_RELAXED);
+            struct berval       vals[2];
             
-            sc->sc_response = automember_search_cb;
-            sc->sc_private  = on;
-            sc->sc_next     = op->o_callback;
-            op->o_callback  = sc;
+            if ( n == 0 ) continue;
+            if ( i < AUTOMEMBER_LATENCY_BUCKETS - 1 ) {
+                bv.bv_len = snprintf(buf, sizeof(buf), "<%luus %lu", 1UL << i, n);
+            } else {
+                bv.bv_len = snprintf(buf, sizeof(buf), ">=%luus %lu", 1UL << (i - 1), n);
+            }
+            vals[0] = bv;
+            BER_BVZERO(&vals[1]);
+            attr_merge(e, ad, vals, NULL);
+        }
+    }
+    return SLAP_CB_CONTINUE;
+}
+
+/* Monitor entry teardown:  take our class and attributes back off it */
+static int
+automember_monitor_free(
+    Entry           *e,
+    void            **priv
+)
+{
+    struct berval   values[2];
+    Modification    mod = { 0 };
+    const char      *text;
+    char            textbuf[SLAP_TEXT_BUFLEN];
+    int             i;
+    
+    /* The instance may already be gone at shutdown: */
+    *priv = NULL;
+    
+    mod.sm_op = LDAP_MOD_DELETE;
+    mod.sm_desc = slap_schema.si_ad_objectClass;
+    mod.sm_values = values;
+    mod.sm_numvals = 1;
+    values[0] = oc_olmAutomemberStatistics->soc_cname;
+    BER_BVZERO(&values[1]);
+    modify_delete_values(e, &mod, 1, &text, textbuf, sizeof(textbuf));
+    
+    mod.sm_values = NULL;
+    mod.sm_numvals = 0;
+    for ( i = 0; i < AUTOMEMBER_STAT_COUNT + AUTOMEMBER_PATH_COUNT; i++ ) {
+        mod.sm_desc = automember_monitor_ad[i];
+        modify_delete_values(e, &mod, 1, &text, textbuf, sizeof(textbuf));
+    }
+    return SLAP_CB_CONTINUE;
+}
+
+/* Add the statistics to the database's monitor entry, if cn=Monitor is
+   configured: */
+static int
+automember_monitor_db_open(
+    BackendDB       *be,
+    slap_overinst   *on,
+    automember_t    *am
+)
+{
+    BackendInfo         *mi = backend_info("monitor");
+    monitor_extra_t     *mbe;
+    monitor_callback_t  *cb;
+    Attribute           *a, **ap;
+    struct berval       zero = BER_BVC("0");
+    int                 i, rc;
+    
+    if ( ! SLAP_DBMONITORING(be) ) return 0;
+    if ( ! mi || ! mi->bi_extra ) {
+        SLAP_DBFLAGS(be) ^= SLAP_DBFLAG_MONITORING;
+        return 0;
+    }
+    mbe = (monitor_extra_t*)mi->bi_extra;
+    if ( ! mbe->is_configured() ) {
+        Debug(LDAP_DEBUG_CONFIG, "automember: automember_monitor_db_open:  monitoring disabled; configure the monitor database to enable\n");
+        return 0;
+    }
+    
+    /* The objectClass, then every counter starting at zero: */
+    a = attr_alloc(slap_schema.si_ad_objectClass);
+    attr_valadd(a, &oc_olmAutomemberStatistics->soc_cname, NULL, 1);
+    ap = &a->a_next;
+    for ( i = 0; i < AUTOMEMBER_STAT_COUNT; i++ ) {
+        *ap = attr_alloc(automember_monitor_ad[i]);
+        attr_valadd(*ap, &zero, NULL, 1);
+        ap = &(*ap)->a_next;
+    }
+    
+    cb = (monitor_callback_t*)ch_calloc(1, sizeof(monitor_callback_t));
+    cb->mc_update = automember_monitor_update;
+    cb->mc_free = automember_monitor_free;
+    cb->mc_private = (void*)am->st;
+    
+    BER_BVZERO(&am->st->monitor_ndn);
+    rc = mbe->register_overlay(be, on, &am->st->monitor_ndn);
+    if ( rc == 0 ) rc = mbe->register_entry_attrs(&am->st->monitor_ndn, a, cb, NULL, -1, NULL);
+    attrs_free(a);
+    if ( rc != 0 ) {
+        Log(LDAP_DEBUG_ANY, LDAP_LEVEL_WARNING, "automember: automember_monitor_db_open:  unable to register statistics (rc=%d)\n", rc);
+        ch_free(cb);
+        if ( ! BER_BVISNULL(&am->st->monitor_ndn) ) ch_free(am->st->monitor_ndn.bv_val);
+        BER_BVZERO(&am->st->monitor_ndn);
+        return 0;
+    }
+    am->st->monitor_cb = cb;
+    return 0;
+}
+
+static void
+automember_monitor_db_close(
+    automember_t    *am
+)
+{
+    if ( am->st->monitor_cb ) {
+        BackendInfo     *mi = backend_info("monitor");
+        
+        if ( mi && mi->bi_extra ) {
+            monitor_extra_t *mbe = (monitor_extra_t*)mi->bi_extra;
             
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_search:  callback linked into op chain\n", sc);
-        }    
-        return SLAP_CB_CONTINUE;
+            mbe->unregister_entry_callback(&am->st->monitor_ndn, am->st->monitor_cb, NULL, 0, NULL);
+        }
+        am->st->monitor_cb = NULL;
+    }
+    if ( ! BER_BVISNULL(&am->st->monitor_ndn) ) {
+        ch_free(am->st->monitor_ndn.bv_val);
+        BER_BVZERO(&am->st->monitor_ndn);
     }
+}
 
 #endif
 
-/**************************/
-
 static int
 automember_db_init(
     BackendDB       *be,
@@ -819,7 +7367,7 @@ automember_db_init(
     slap_overinst   *on = (slap_overinst *)be->bd_info;
     automember_t    *am = (automember_t*)ch_calloc(1, sizeof(automember_t));
     const char      *text = NULL;
-    int             rc;
+    int             rc, i;
     
     if (slap_str2ad("objectClass", &am->attr_oc, &text) != LDAP_SUCCESS) {
         ch_free(am);
@@ -861,7 +7409,75 @@ automember_db_init(
     Debug(LDAP_DEBUG_TRACE, "automember: automember_db_init:  uid attribute found\n");
     
     am->synth_tmpl = automember_default_synth_tmpl;
-    on->on_bi.bi_private = am;
+    automember_tmpl_compile(am->synth_tmpl, &am->synth_ctmpl);
+    am->use_memberof_idx = 1;
+    am->memberof_batch = 1;
+    am->resolve_cache_size = AUTOMEMBER_RESOLVE_CACHE_SIZE;
+    am->st = (automember_state_t*)ch_calloc(1, sizeof(automember_state_t));
+    ldap_pvt_thread_rdwr_init(&am->st->memberof_idx.rwlock);
+    for ( i = 0; i < AUTOMEMBER_RESOLVE_SHARDS; i++ ) ldap_pvt_thread_mutex_init(&am->st->resolve_shards[i].mutex);
+    ldap_pvt_thread_mutex_init(&am->st->conf_mutex);
+    am->st->conf = am;
+    on->on_bi.bi_private = am->st;
+    overlay_register_control(be, AUTOMEMBER_SYNTH_CONTROL);
+#ifdef AUTOMEMBER_MONITOR
+    if ( automember_monitor_initialize() == LDAP_SUCCESS ) SLAP_DBFLAGS(be) |= SLAP_DBFLAG_MONITORING;
+#endif
+    return 0;
+}
+
+static int
+automember_db_open(
+    BackendDB       *be,
+    ConfigReply     *cr
+)
+{
+    slap_overinst   *on = (slap_overinst *)be->bd_info;
+    automember_t    *am = AUTOMEMBER_CONF(on);
+    
+    /* Keep hold of the database itself, not the copy we were handed: */
+    am->st->be = be->bd_self;
+    automember_dispatch_build(am);
+    if ( am->st->rebuild_pending ) automember_rebuild_schedule(on);
+    /* Warm the memberOf index before anyone asks for it: */
+    if ( AUTOMEMBER_SNAPSHOT_ENABLED(am) ) automember_idx_schedule(on, am);
+#ifdef AUTOMEMBER_MONITOR
+    automember_monitor_db_open(be, on, am);
+#endif
+    return 0;
+}
+
+static int
+automember_db_close(
+    BackendDB       *be,
+    ConfigReply     *cr
+)
+{
+    slap_overinst   *on = (slap_overinst *)be->bd_info;
+    automember_t    *am = AUTOMEMBER_CONF(on);
+    
+    /* Save the memberOf index for the next start, as the database
+       stands now that no more writes will reach it: */
+    if ( AUTOMEMBER_SNAPSHOT_ENABLED(am) && am->st->memberof_idx.is_valid ) {
+        Connection          conn = { 0 };
+        OperationBuffer     opbuf;
+        Operation           *op;
+        BackendDB           db;
+        struct berval       csn, conf;
+        
+        connection_fake_init(&conn, &opbuf, ldap_pvt_thread_pool_context());
+        op = &opbuf.ob_op;
+        automember_snapshot_op(op, &db, on, am);
+        automember_snapshot_csn(op, on, am, &csn);
+        automember_snapshot_conf(am, &conf);
+        automember_snapshot_save(am, &csn, &conf);
+        if ( csn.bv_val ) ch_free(csn.bv_val);
+        ch_free(conf.bv_val);
+    }
+#ifdef AUTOMEMBER_MONITOR
+    automember_monitor_db_close(am);
+#endif
+    automember_conf_reclaim(am->st);
     return 0;
 }
 
@@ -872,17 +7488,27 @@ automember_db_destroy(
 )
 {
     slap_overinst   *on = (slap_overinst *)be->bd_info;
-    automember_t    *am = (automember_t*)on->on_bi.bi_private;
+    automember_state_t  *st = AUTOMEMBER_STATE(on);
+    int             i;
     
-    if ( am ) {
+    if ( st ) {
+        automember_t        *am = st->conf;
+        
         on->on_bi.bi_private = NULL;
         
-        if ( am->synth_tmpl && am->synth_tmpl != automember_default_synth_tmpl ) {
-            Debug(LDAP_DEBUG_TRACE, "automember: automember_db_destroy: destroying synth_tmpl\n");
-            ch_free((void*)am->synth_tmpl);
-        }
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_db_destroy: destroying resolver cache\n");
+        automember_resolve_flush(am);
+        for ( i = 0; i < AUTOMEMBER_RESOLVE_SHARDS; i++ ) ldap_pvt_thread_mutex_destroy(&st->resolve_shards[i].mutex);
+        overlay_unregister_control(be, AUTOMEMBER_SYNTH_CONTROL);
+        Debug(LDAP_DEBUG_TRACE, "automember: automember_db_destroy: destroying memberOf index\n");
+        automember_idx_clear(&st->memberof_idx);
+        ldap_pvt_thread_rdwr_destroy(&st->memberof_idx.rwlock);
+        
         Debug(LDAP_DEBUG_TRACE, "automember: automember_db_destroy: destroying config\n");
-        ch_free(am);
+        automember_conf_reclaim(st);
+        ldap_pvt_thread_mutex_destroy(&st->conf_mutex);
+        automember_conf_free(am);
+        ch_free(st);
     }
     return 0;
 }
@@ -903,18 +7529,26 @@ automember_initialize(void)
         automember.on_bi.bi_type = "automember";
         
         automember.on_bi.bi_db_init = automember_db_init;
+        automember.on_bi.bi_db_open = automember_db_open;
+        automember.on_bi.bi_db_close = automember_db_close;
         automember.on_bi.bi_db_destroy = automember_db_destroy;
+        
+        automember.on_bi.bi_op_add = automember_write;
+        automember.on_bi.bi_op_modify = automember_write;
+        automember.on_bi.bi_op_delete = automember_write;
+        automember.on_bi.bi_op_modrdn = automember_write;
 
 #ifdef AUTOMEMBER_CALLBACK_RESPONSE
         automember.on_response = automember_response;
 #endif
 
-#ifdef AUTOMEMBER_CALLBACK_SEARCH
         automember.on_bi.bi_op_search = automember_search;
-#endif
+        automember.on_bi.bi_op_compare = automember_compare;
     
         automember.on_bi.bi_cf_ocs = automember_ocs;
-        rc = config_register_schema( automember_cfg, automember_ocs );
+        rc = register_supported_control(AUTOMEMBER_SYNTH_CONTROL, SLAP_CTRL_SEARCH, NULL,
+                        automember_synth_ctrl_parse, &automember_synth_cid);
+        if ( rc == LDAP_SUCCESS ) rc = config_register_schema( automember_cfg, automember_ocs );
         if ( rc == 0 ) {
             rc = overlay_register(&automember);
         }
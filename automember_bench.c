@@ -0,0 +1,564 @@
+/*
+ * automember_bench.c
+ *
+ * Standalone microbenchmarks for the overlay's synthesis kernels, built
+ * and run with "make bench".  automember.c is compiled in whole; the few
+ * slapd routines the kernels reach are replaced by the thin versions
+ * below (everything else is discarded at link time), so neither slapd
+ * nor a database is needed.
+ *
+ * Allocations are counted by wrapping the C library's malloc family
+ * (glibc only).
+ *
+ */
+
+#include "portable.h"
+#include "slap.h"
+
+#include <time.h>
+
+/* Logging is left out of the measurements: */
+#undef Debug
+#define Debug(...)                  ((void)0)
+#undef Log
+#define Log(...)                    ((void)0)
+#undef LogTest
+#define LogTest(level)              0
+
+#include "automember.c"
+
+/**************************/
+
+/* Allocation counting: */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nelem, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long        bench_allocs = 0;
+
+void*
+malloc(
+    size_t      size
+)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(
+    size_t      nelem,
+    size_t      size
+)
+{
+    bench_allocs++;
+    return __libc_calloc(nelem, size);
+}
+
+void*
+realloc(
+    void        *ptr,
+    size_t      size
+)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(
+    void        *ptr
+)
+{
+    __libc_free(ptr);
+}
+
+/**************************/
+
+/* Thin stand-ins for the slapd routines the kernels reach: */
+
+static AttributeName        bench_anlist_all_user_attributes[] = {
+                                { BER_BVC(LDAP_ALL_USER_ATTRIBUTES), NULL, 0, NULL },
+                                { BER_BVNULL, NULL, 0, NULL }
+                            };
+static AttributeName        bench_anlist_all_operational_attributes[] = {
+                                { BER_BVC(LDAP_ALL_OPERATIONAL_ATTRIBUTES), NULL, 0, NULL },
+                                { BER_BVNULL, NULL, 0, NULL }
+                            };
+
+AttributeName               *slap_anlist_all_user_attributes = bench_anlist_all_user_attributes;
+AttributeName               *slap_anlist_all_operational_attributes = bench_anlist_all_operational_attributes;
+
+void*
+ch_malloc(
+    ber_len_t   size
+)
+{
+    return ber_memalloc(size);
+}
+
+void*
+ch_calloc(
+    ber_len_t   nelem,
+    ber_len_t   size
+)
+{
+    return ber_memcalloc(nelem, size);
+}
+
+void
+ch_free(
+    void        *ptr
+)
+{
+    ber_memfree(ptr);
+}
+
+Attribute*
+attr_alloc(
+    AttributeDescription    *ad
+)
+{
+    Attribute               *a = (Attribute*)ber_memcalloc(1, sizeof(Attribute));
+
+    a->a_desc = ad;
+    return a;
+}
+
+void
+attr_free(
+    Attribute       *a
+)
+{
+    /* As slapd's:  values in one block go with a single free(): */
+    if ( a->a_flags & SLAP_ATTR_DONT_FREE_DATA ) {
+        if ( a->a_nvals != a->a_vals ) ber_memfree(a->a_nvals);
+        ber_memfree(a->a_vals);
+    } else {
+        if ( a->a_nvals != a->a_vals ) ber_bvarray_free(a->a_nvals);
+        ber_bvarray_free(a->a_vals);
+    }
+    ber_memfree(a);
+}
+
+Attribute*
+attr_find(
+    Attribute               *a,
+    AttributeDescription    *desc
+)
+{
+    for ( ; a; a = a->a_next ) {
+        if ( a->a_desc == desc ) return a;
+    }
+    return NULL;
+}
+
+/* The benchmarks always hand over modifiable entries with the source
+   values present, and never configure the uid => DN resolver, so nothing
+   below should ever be called: */
+static void
+bench_unexpected(
+    const char      *what
+)
+{
+    fprintf(stderr, "automember_bench: unexpected call to %s()\n", what);
+    exit(EXIT_FAILURE);
+}
+
+Attribute*
+attr_dup(
+    Attribute       *a
+)
+{
+    bench_unexpected("attr_dup");
+    return NULL;
+}
+
+Entry*
+entry_alloc(void)
+{
+    bench_unexpected("entry_alloc");
+    return NULL;
+}
+
+Entry*
+entry_dup(
+    Entry           *e
+)
+{
+    bench_unexpected("entry_dup");
+    return NULL;
+}
+
+void
+entry_free(
+    Entry           *e
+)
+{
+    bench_unexpected("entry_free");
+}
+
+void
+rs_replace_entry(
+    Operation       *op,
+    SlapReply       *rs,
+    slap_overinst   *on,
+    Entry           *e
+)
+{
+    bench_unexpected("rs_replace_entry");
+}
+
+int
+overlay_entry_get_ov(
+    Operation               *op,
+    struct berval           *dn,
+    ObjectClass             *oc,
+    AttributeDescription    *ad,
+    int                     rw,
+    Entry                   **e,
+    slap_overinst           *on
+)
+{
+    bench_unexpected("overlay_entry_get_ov");
+    return LDAP_OTHER;
+}
+
+int
+overlay_entry_release_ov(
+    Operation       *op,
+    Entry           *e,
+    int             rw,
+    slap_overinst   *on
+)
+{
+    bench_unexpected("overlay_entry_release_ov");
+    return LDAP_OTHER;
+}
+
+int
+attr_normalize_one(
+    AttributeDescription    *ad,
+    struct berval           *val,
+    struct berval           *nval,
+    void                    *memctx
+)
+{
+    bench_unexpected("attr_normalize_one");
+    return LDAP_OTHER;
+}
+
+AttributeName               slap_anlist_no_attrs[] = { { BER_BVNULL } };
+
+/**************************/
+
+/* Fixtures: */
+
+static AttributeType        bench_at_memberuid = { 0 };
+static AttributeType        bench_at_member = { 0 };
+static AttributeType        bench_at_memberof = { 0 };
+static AttributeType        bench_at_other = { 0 };
+static AttributeDescription bench_ad_memberuid = { 0 };
+static AttributeDescription bench_ad_member = { 0 };
+static AttributeDescription bench_ad_memberof = { 0 };
+static AttributeDescription bench_ad_other = { 0 };
+
+static void
+bench_schema_init(void)
+{
+    bench_ad_memberuid.ad_type = &bench_at_memberuid;
+    ber_str2bv("memberUid", 0, 0, &bench_ad_memberuid.ad_cname);
+    bench_ad_member.ad_type = &bench_at_member;
+    ber_str2bv("member", 0, 0, &bench_ad_member.ad_cname);
+    bench_ad_memberof.ad_type = &bench_at_memberof;
+    ber_str2bv("memberOf", 0, 0, &bench_ad_memberof.ad_cname);
+    bench_ad_other.ad_type = &bench_at_other;
+    ber_str2bv("description", 0, 0, &bench_ad_other.ad_cname);
+}
+
+/* n_vals distinct uids of uid_len characters each: */
+static BerVarray
+bench_uids(
+    int             n_vals,
+    int             uid_len
+)
+{
+    BerVarray       vals = (BerVarray)ber_memcalloc(n_vals + 1, sizeof(struct berval));
+    int             i;
+
+    for ( i = 0; i < n_vals; i++ ) {
+        vals[i].bv_val = (char*)ber_memalloc(uid_len + 1);
+        vals[i].bv_len = snprintf(vals[i].bv_val, uid_len + 1, "u%0*d", uid_len - 1, i);
+    }
+    return vals;
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Enough repetitions that every measurement covers about a million values: */
+static int
+bench_reps(
+    int             n_vals
+)
+{
+    return n_vals >= 1000000 ? 1 : 1000000 / n_vals;
+}
+
+static void
+bench_report(
+    const char      *kernel,
+    const char      *params,
+    double          ns,
+    unsigned long   allocs,
+    double          n_units,
+    const char      *unit
+)
+{
+    printf("%-11s %-40s %10.1f ns/%-6s %8.3f allocs/%s\n", kernel, params, ns / n_units, unit, allocs / n_units, unit);
+}
+
+/**************************/
+
+static const char           *bench_tmpls[] = {
+                                "{}",
+                                "uid={},ou=People,dc=example,dc=edu",
+                                "cn={}+uid={},ou=People,dc=example,dc=edu",
+                                NULL
+                            };
+
+static const int            bench_counts[] = { 1, 10, 100, 1000, 10000, 100000, 0 };
+static const int            bench_uid_lens[] = { 8, 32, 0 };
+
+/* automember_xform_uid_to_dn() over template shapes, value counts and uid
+   lengths: */
+static void
+bench_xform(void)
+{
+    int             t, c, l, r;
+
+    for ( t = 0; bench_tmpls[t]; t++ ) {
+        automember_tmpl_t   tmpl = { 0 };
+
+        automember_tmpl_compile(bench_tmpls[t], &tmpl);
+        for ( l = 0; bench_uid_lens[l]; l++ ) {
+            for ( c = 0; bench_counts[c]; c++ ) {
+                BerVarray       uids = bench_uids(bench_counts[c], bench_uid_lens[l]);
+                int             reps = bench_reps(bench_counts[c]);
+                unsigned long   allocs = bench_allocs;
+                double          start = bench_now();
+                char            params[128];
+
+                for ( r = 0; r < reps; r++ ) {
+                    BerVarray   dns = automember_xform_uid_to_dn(&tmpl, uids, bench_counts[c], NULL);
+
+                    ber_memfree(dns);
+                }
+                snprintf(params, sizeof(params), "tmpl=%d values=%d uid_len=%d", t, bench_counts[c], bench_uid_lens[l]);
+                bench_report("xform", params, bench_now() - start, bench_allocs - allocs, (double)reps * bench_counts[c], "value");
+                ber_bvarray_free(uids);
+            }
+        }
+        automember_tmpl_free(&tmpl);
+    }
+}
+
+/* The once-per-search attribute-request analysis, then
+   automember_populate_member_attr() per entry, for several requested
+   attribute lists: */
+static void
+bench_populate_member(void)
+{
+    static const char   *list_names[] = { "all-user", "*", "16-names", "memberUid", "+", NULL };
+    slap_overinst       on = { 0 };
+    automember_t        am = { 0 };
+    AttributeName       names[17], star[2], plus[2], src_only[2];
+    AttributeName       *lists[5];
+    int                 i, c, r;
+
+    am.attr_memberuid = &bench_ad_memberuid;
+    am.attr_member = &bench_ad_member;
+    am.attr_memberof = &bench_ad_memberof;
+    automember_tmpl_compile(bench_tmpls[1], &am.synth_ctmpl);
+
+    /* The synth attribute last in a long list is the scan's worst case: */
+    memset(names, 0, sizeof(names));
+    for ( i = 0; i < 15; i++ ) {
+        names[i].an_name = bench_ad_other.ad_cname;
+        names[i].an_desc = &bench_ad_other;
+    }
+    names[15].an_name = bench_ad_member.ad_cname;
+    names[15].an_desc = &bench_ad_member;
+    memset(star, 0, sizeof(star));
+    star[0] = slap_anlist_all_user_attributes[0];
+    memset(plus, 0, sizeof(plus));
+    plus[0] = slap_anlist_all_operational_attributes[0];
+    memset(src_only, 0, sizeof(src_only));
+    src_only[0].an_name = bench_ad_memberuid.ad_cname;
+    src_only[0].an_desc = &bench_ad_memberuid;
+    lists[0] = NULL;
+    lists[1] = star;
+    lists[2] = names;
+    lists[3] = src_only;
+    lists[4] = plus;
+
+    for ( i = 0; list_names[i]; i++ ) {
+        automember_attr_req_t   req;
+        int                     reps = bench_reps(1);
+        unsigned long           allocs = bench_allocs;
+        double                  start = bench_now();
+        char                    params[128];
+
+        for ( r = 0; r < reps; r++ ) automember_attr_req_analyze(&am, lists[i], &req);
+        snprintf(params, sizeof(params), "attrs=%s", list_names[i]);
+        bench_report("analyze", params, bench_now() - start, bench_allocs - allocs, (double)reps, "search");
+
+        for ( c = 0; bench_counts[c] && bench_counts[c] <= 1000; c++ ) {
+            Attribute       src = { 0 };
+            Entry           e = { 0 };
+            Operation       op = { 0 };
+            SlapReply       rs = { 0 };
+            int             reps = bench_reps(bench_counts[c]);
+            unsigned long   allocs;
+            double          start;
+            char            params[128];
+
+            src.a_desc = &bench_ad_memberuid;
+            src.a_vals = src.a_nvals = bench_uids(bench_counts[c], 8);
+            src.a_numvals = bench_counts[c];
+            ber_str2bv("cn=bench,ou=Groups,dc=example,dc=edu", 0, 0, &e.e_name);
+            e.e_nname = e.e_name;
+            e.e_attrs = &src;
+            op.ors_attrs = lists[i];
+
+            allocs = bench_allocs;
+            start = bench_now();
+            for ( r = 0; r < reps; r++ ) {
+                rs.sr_type = REP_SEARCH;
+                rs.sr_entry = &e;
+                rs.sr_flags = REP_ENTRY_MODIFIABLE;
+                automember_populate_member_attr(&op, &rs, &on, &am, &req);
+
+                /* Take the synthesized attribute back off for the next round: */
+                if ( src.a_next ) {
+                    attr_free(src.a_next);
+                    src.a_next = NULL;
+                }
+            }
+            snprintf(params, sizeof(params), "attrs=%s values=%d", list_names[i], bench_counts[c]);
+            bench_report("populate", params, bench_now() - start, bench_allocs - allocs, (double)reps, "entry");
+            ber_bvarray_free(src.a_vals);
+        }
+    }
+    automember_tmpl_free(&am.synth_ctmpl);
+}
+
+/* automember_collect_memberof_dn_per_entry() in both of its modes:  a flat
+   list of group DNs, and batched uids matched against a group's memberUid
+   values: */
+static void
+bench_collect_memberof(void)
+{
+    int             c, i, r;
+
+    for ( c = 0; bench_counts[c] && bench_counts[c] <= 10000; c++ ) {
+        struct automember_collect_memberof_context  sc_ctxt;
+        slap_callback   sc = { 0 };
+        Operation       op = { 0 };
+        SlapReply       rs = { 0 };
+        Entry           e = { 0 };
+        BerVarray       dn_list = NULL;
+        int             reps = bench_reps(bench_counts[c] * 100);
+        unsigned long   allocs = bench_allocs;
+        double          start = bench_now();
+        char            params[128];
+
+        memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+        sc_ctxt.dn_list = &dn_list;
+        sc.sc_private = &sc_ctxt;
+        op.o_callback = &sc;
+        ber_str2bv("cn=bench,ou=Groups,dc=example,dc=edu", 0, 0, &e.e_name);
+        e.e_nname = e.e_name;
+        rs.sr_type = REP_SEARCH;
+        rs.sr_entry = &e;
+
+        /* One search returning bench_counts[c] groups: */
+        for ( r = 0; r < reps; r++ ) {
+            for ( i = 0; i < bench_counts[c]; i++ ) automember_collect_memberof_dn_per_entry(&op, &rs);
+            ber_bvarray_free(dn_list);
+            dn_list = NULL;
+        }
+        snprintf(params, sizeof(params), "mode=flat groups=%d", bench_counts[c]);
+        bench_report("collect", params, bench_now() - start, bench_allocs - allocs, (double)reps * bench_counts[c], "group");
+    }
+
+    for ( c = 0; bench_counts[c]; c++ ) {
+        struct automember_collect_memberof_context  sc_ctxt;
+        automember_memberof_key_t   *keys;
+        slap_callback   sc = { 0 };
+        Operation       op = { 0 };
+        SlapReply       rs = { 0 };
+        Entry           e = { 0 };
+        Attribute       uids = { 0 };
+        int             n_keys = bench_counts[c] < 64 ? bench_counts[c] : 64;
+        int             reps = bench_reps(bench_counts[c]);
+        unsigned long   allocs;
+        double          start;
+        char            params[128];
+
+        /* A group listing bench_counts[c] uids, n_keys of them in the batch: */
+        uids.a_desc = &bench_ad_memberuid;
+        uids.a_vals = uids.a_nvals = bench_uids(bench_counts[c], 8);
+        uids.a_numvals = bench_counts[c];
+        keys = (automember_memberof_key_t*)ber_memcalloc(n_keys, sizeof(automember_memberof_key_t));
+        for ( i = 0; i < n_keys; i++ ) keys[i].nuid = uids.a_nvals[i * (bench_counts[c] / n_keys)];
+        qsort(keys, n_keys, sizeof(automember_memberof_key_t), automember_memberof_key_cmp);
+
+        memset(&sc_ctxt, 0, sizeof(sc_ctxt));
+        sc_ctxt.keys = keys;
+        sc_ctxt.n_keys = n_keys;
+        sc_ctxt.attr_memberuid = &bench_ad_memberuid;
+        sc.sc_private = &sc_ctxt;
+        op.o_callback = &sc;
+        ber_str2bv("cn=bench,ou=Groups,dc=example,dc=edu", 0, 0, &e.e_name);
+        e.e_nname = e.e_name;
+        e.e_attrs = &uids;
+        rs.sr_type = REP_SEARCH;
+        rs.sr_entry = &e;
+
+        allocs = bench_allocs;
+        start = bench_now();
+        for ( r = 0; r < reps; r++ ) {
+            automember_collect_memberof_dn_per_entry(&op, &rs);
+            for ( i = 0; i < n_keys; i++ ) {
+                ber_bvarray_free(keys[i].dn_list);
+                keys[i].dn_list = NULL;
+            }
+        }
+        snprintf(params, sizeof(params), "mode=batch memberUids=%d keys=%d", bench_counts[c], n_keys);
+        bench_report("collect", params, bench_now() - start, bench_allocs - allocs, (double)reps * bench_counts[c], "value");
+        ber_memfree(keys);
+        ber_bvarray_free(uids.a_vals);
+    }
+}
+
+int
+main(
+    int         argc,
+    char        *argv[]
+)
+{
+    bench_schema_init();
+    bench_xform();
+    bench_populate_member();
+    bench_collect_memberof();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,314 @@
+/*
+ * automember_scale.c
+ *
+ * Load driver for the end-to-end scale benchmark (automember_scale.sh,
+ * run with "make scale-bench"):  a number of clients, each on its own
+ * connection, repeat one search against a running slapd and the time
+ * of every search is kept.  The throughput over all clients and the
+ * median and 99th percentile latency are reported on one line.
+ *
+ * A "%d" in the base or filter is replaced, on each search, by a number
+ * drawn uniformly from [0, range), so that e.g. "cn=group%d,ou=Groups,..."
+ * visits the generated groups at random.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <ldap.h>
+
+#define SCALE_MAX_ATTRS         16
+#define SCALE_MAX_STR           1024
+
+typedef struct {
+    const char          *uri;
+    const char          *binddn;
+    const char          *passwd;
+    const char          *base;
+    const char          *filter;
+    int                 scope;
+    char                *attrs[SCALE_MAX_ATTRS + 1];
+    int                 n_attrs;
+    int                 range;
+    int                 n_ops;
+    pthread_barrier_t   start;
+} scale_params_t;
+
+typedef struct {
+    scale_params_t      *params;
+    pthread_t           thread;
+    unsigned int        seed;
+    double              *latency;
+    int                 n_done;
+    int                 n_errors;
+    unsigned long       n_entries;
+    unsigned long       n_values;
+    double              t_end;
+} scale_client_t;
+
+static double
+scale_now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Copy src into dst, replacing each "%d" with n: */
+static void
+scale_subst(
+    char                *dst,
+    size_t              dst_len,
+    const char          *src,
+    int                 n
+)
+{
+    char                num[16];
+    size_t              num_len = snprintf(num, sizeof(num), "%d", n);
+    size_t              i = 0;
+
+    while ( *src && i + 1 < dst_len ) {
+        if ( src[0] == '%' && src[1] == 'd' ) {
+            if ( i + num_len + 1 > dst_len ) break;
+            memcpy(dst + i, num, num_len);
+            i += num_len;
+            src += 2;
+        } else {
+            dst[i++] = *src++;
+        }
+    }
+    dst[i] = '\0';
+}
+
+static LDAP*
+scale_connect(
+    scale_params_t      *params
+)
+{
+    LDAP                *ld = NULL;
+    int                 version = LDAP_VERSION3;
+    struct berval       cred = { 0, NULL };
+    int                 rc;
+
+    if ( (rc = ldap_initialize(&ld, params->uri)) != LDAP_SUCCESS ) {
+        fprintf(stderr, "automember_scale: ldap_initialize(%s):  %s\n", params->uri, ldap_err2string(rc));
+        return NULL;
+    }
+    ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+    if ( params->passwd ) {
+        cred.bv_val = (char*)params->passwd;
+        cred.bv_len = strlen(params->passwd);
+    }
+    rc = ldap_sasl_bind_s(ld, params->binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+    if ( rc != LDAP_SUCCESS ) {
+        fprintf(stderr, "automember_scale: bind to %s:  %s\n", params->uri, ldap_err2string(rc));
+        ldap_unbind_ext_s(ld, NULL, NULL);
+        return NULL;
+    }
+    return ld;
+}
+
+static void*
+scale_client_run(
+    void                *arg
+)
+{
+    scale_client_t      *client = (scale_client_t*)arg;
+    scale_params_t      *params = client->params;
+    LDAP                *ld = scale_connect(params);
+    char                base[SCALE_MAX_STR], filter[SCALE_MAX_STR];
+    int                 i;
+
+    pthread_barrier_wait(&params->start);
+    for ( i = 0; ld && i < params->n_ops; i++ ) {
+        int             n = params->range > 1 ? (int)(rand_r(&client->seed) % params->range) : 0;
+        LDAPMessage     *res = NULL, *e;
+        double          t_start;
+        int             rc, a;
+
+        scale_subst(base, sizeof(base), params->base, n);
+        scale_subst(filter, sizeof(filter), params->filter, n);
+
+        t_start = scale_now();
+        rc = ldap_search_ext_s(ld, base, params->scope, filter, params->attrs, 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+        if ( rc == LDAP_SUCCESS ) {
+            for ( e = ldap_first_entry(ld, res); e; e = ldap_next_entry(ld, e) ) {
+                client->n_entries++;
+                for ( a = 0; a < params->n_attrs; a++ ) {
+                    struct berval   **vals = ldap_get_values_len(ld, e, params->attrs[a]);
+
+                    if ( vals ) {
+                        client->n_values += ldap_count_values_len(vals);
+                        ldap_value_free_len(vals);
+                    }
+                }
+            }
+        } else {
+            client->n_errors++;
+        }
+        ldap_msgfree(res);
+        client->latency[client->n_done++] = scale_now() - t_start;
+    }
+    client->t_end = scale_now();
+    if ( ld ) {
+        ldap_unbind_ext_s(ld, NULL, NULL);
+    } else {
+        client->n_errors += params->n_ops;
+    }
+    return NULL;
+}
+
+static int
+scale_double_cmp(
+    const void          *a,
+    const void          *b
+)
+{
+    double              x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+scale_percentile(
+    double              *sorted,
+    int                 n,
+    double              p
+)
+{
+    int                 i;
+
+    if ( n == 0 ) return 0.0;
+    i = (int)(p * n + 0.5) - 1;
+    if ( i < 0 ) i = 0;
+    if ( i >= n ) i = n - 1;
+    return sorted[i];
+}
+
+static void
+scale_usage(void)
+{
+    fprintf(stderr,
+        "usage: automember_scale -H uri -b base [-s base|one|sub] [-f filter] [-a attr ...]\n"
+        "                        [-c clients] [-n ops-per-client] [-r range] [-D binddn -w passwd]\n"
+        "                        [-t label]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(
+    int                 argc,
+    char                *argv[]
+)
+{
+    scale_params_t      params;
+    scale_client_t      *clients;
+    const char          *label = "search";
+    int                 n_clients = 1, c, opt;
+    int                 n_done = 0, n_errors = 0;
+    unsigned long       n_entries = 0, n_values = 0;
+    double              *all, t_start, t_end = 0.0, elapsed;
+
+    memset(&params, 0, sizeof(params));
+    params.filter = "(objectClass=*)";
+    params.scope = LDAP_SCOPE_SUBTREE;
+    params.range = 1;
+    params.n_ops = 1000;
+
+    while ( (opt = getopt(argc, argv, "a:b:c:D:f:H:n:r:s:t:w:")) != -1 ) {
+        switch ( opt ) {
+            case 'a':
+                if ( params.n_attrs == SCALE_MAX_ATTRS ) scale_usage();
+                params.attrs[params.n_attrs++] = optarg;
+                break;
+            case 'b':
+                params.base = optarg;
+                break;
+            case 'c':
+                n_clients = atoi(optarg);
+                break;
+            case 'D':
+                params.binddn = optarg;
+                break;
+            case 'f':
+                params.filter = optarg;
+                break;
+            case 'H':
+                params.uri = optarg;
+                break;
+            case 'n':
+                params.n_ops = atoi(optarg);
+                break;
+            case 'r':
+                params.range = atoi(optarg);
+                break;
+            case 's':
+                if ( strcmp(optarg, "base") == 0 ) params.scope = LDAP_SCOPE_BASE;
+                else if ( strcmp(optarg, "one") == 0 ) params.scope = LDAP_SCOPE_ONELEVEL;
+                else if ( strcmp(optarg, "sub") == 0 ) params.scope = LDAP_SCOPE_SUBTREE;
+                else scale_usage();
+                break;
+            case 't':
+                label = optarg;
+                break;
+            case 'w':
+                params.passwd = optarg;
+                break;
+            default:
+                scale_usage();
+        }
+    }
+    if ( ! params.uri || ! params.base || n_clients < 1 || params.n_ops < 1 || params.range < 1 ) scale_usage();
+    if ( params.n_attrs == 0 ) params.attrs[params.n_attrs++] = LDAP_NO_ATTRS;
+
+    clients = calloc(n_clients, sizeof(scale_client_t));
+    all = malloc((size_t)n_clients * params.n_ops * sizeof(double));
+    if ( ! clients || ! all ) {
+        fprintf(stderr, "automember_scale: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The clock starts once every client has connected and bound: */
+    pthread_barrier_init(&params.start, NULL, n_clients + 1);
+    for ( c = 0; c < n_clients; c++ ) {
+        clients[c].params = &params;
+        clients[c].seed = 1 + c;
+        clients[c].latency = all + (size_t)c * params.n_ops;
+        pthread_create(&clients[c].thread, NULL, scale_client_run, &clients[c]);
+    }
+    pthread_barrier_wait(&params.start);
+    t_start = scale_now();
+
+    for ( c = 0; c < n_clients; c++ ) {
+        pthread_join(clients[c].thread, NULL);
+        /* Pack the latencies together for sorting: */
+        if ( all + n_done != clients[c].latency ) memmove(all + n_done, clients[c].latency, clients[c].n_done * sizeof(double));
+        n_done += clients[c].n_done;
+        n_errors += clients[c].n_errors;
+        n_entries += clients[c].n_entries;
+        n_values += clients[c].n_values;
+        if ( clients[c].t_end > t_end ) t_end = clients[c].t_end;
+    }
+    pthread_barrier_destroy(&params.start);
+    elapsed = t_end - t_start;
+    qsort(all, n_done, sizeof(double), scale_double_cmp);
+
+    printf("%-28s clients=%-3d ops=%-7d %10.1f ops/s  p50 %9.1f us  p99 %9.1f us  %8.1f entries/op %10.1f values/op  errors=%d\n",
+        label, n_clients, n_done,
+        elapsed > 0.0 ? n_done / elapsed : 0.0,
+        scale_percentile(all, n_done, 0.50) * 1e6,
+        scale_percentile(all, n_done, 0.99) * 1e6,
+        n_done ? (double)n_entries / n_done : 0.0,
+        n_done ? (double)n_values / n_done : 0.0,
+        n_errors);
+
+    free(all);
+    free(clients);
+    return n_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+#! /bin/sh
+#
+# automember_scale.sh
+#
+# End-to-end scale benchmark, run with "make scale-bench":  a directory of
+# generated people and groups is loaded into an mdb database, then a
+# local slapd serves it first without and then with "overlay automember"
+# while automember_scale drives a fixed set of workloads against it.
+# Each workload reports its throughput and median and 99th percentile
+# latency.
+#
+# Every setting below may be overridden from the environment, e.g.
+#
+#   NUSERS=100000 NGROUPS=5000 CLIENTS=16 ./automember_scale.sh
+#
+# and AUTOMEMBER_CONF may name a file of further overlay directives
+# (automember-memberof-index, automember-memberof-prefetch, ...) to add
+# to the overlay's configuration.
+#
+
+LDAP_SRC=${LDAP_SRC-../../..}
+LDAP_BUILD=${LDAP_BUILD-$LDAP_SRC}
+SLAPD=${SLAPD-$LDAP_BUILD/servers/slapd/slapd}
+LDAPSEARCH=${LDAPSEARCH-$LDAP_BUILD/clients/tools/ldapsearch}
+SCHEMADIR=${SCHEMADIR-$LDAP_SRC/servers/slapd/schema}
+MODULE=${MODULE-`pwd`/.libs/automember.so}
+DRIVER=${DRIVER-./automember_scale}
+
+# Size and shape of the generated directory:
+NUSERS=${NUSERS-10000}
+NGROUPS=${NGROUPS-1000}
+MEMBERSHIPS=${MEMBERSHIPS-8}            # groups drawn per person
+SKEW=${SKEW-2}                          # 1 = uniform; larger crowds the low-numbered groups
+SEED=${SEED-1}
+
+# The workloads:
+CLIENTS=${CLIENTS-8}
+OPS=${OPS-2000}                         # searches per client
+ENUMS=${ENUMS-5}                        # full enumerations
+
+PORT=${PORT-9011}
+URI=ldap://localhost:$PORT/
+SCALEDIR=${SCALEDIR-./scale-data}
+BASEDN="dc=example,dc=com"
+MANAGERDN="cn=Manager,$BASEDN"
+PASSWD=secret
+
+for f in "$SLAPD" "$LDAPSEARCH" "$DRIVER" "$MODULE" "$SCHEMADIR/nis.schema" ; do
+    if test ! -f "$f" ; then
+        echo "automember_scale: $f not found (set LDAP_SRC, LDAP_BUILD, SCHEMADIR or MODULE)"
+        exit 1
+    fi
+done
+
+rm -rf "$SCALEDIR"
+mkdir -p "$SCALEDIR/db" || exit 1
+LDIF=$SCALEDIR/directory.ldif
+
+#
+# Generate the directory.  Each person draws MEMBERSHIPS groups with
+# index NGROUPS * rand()^SKEW, so group sizes fall off from group0:
+#
+echo "Generating $NUSERS people in $NGROUPS groups ($MEMBERSHIPS draws per person, skew $SKEW)..."
+awk -v users="$NUSERS" -v groups="$NGROUPS" -v per="$MEMBERSHIPS" -v skew="$SKEW" -v seed="$SEED" -v base="$BASEDN" '
+BEGIN {
+    srand(seed)
+    printf "dn: %s\nobjectClass: dcObject\nobjectClass: organization\ndc: example\no: Example\n\n", base
+    printf "dn: ou=People,%s\nobjectClass: organizationalUnit\nou: People\n\n", base
+    printf "dn: ou=Groups,%s\nobjectClass: organizationalUnit\nou: Groups\n\n", base
+    for ( u = 0; u < users; u++ ) {
+        printf "dn: uid=user%d,ou=People,%s\nobjectClass: inetOrgPerson\nobjectClass: posixAccount\n", u, base
+        printf "uid: user%d\ncn: User %d\nsn: %d\nuidNumber: %d\ngidNumber: 100\nhomeDirectory: /home/user%d\n\n", u, u, u, 10000 + u, u
+        split("", picked)
+        for ( k = 0; k < per; k++ ) {
+            g = int(groups * rand() ^ skew)
+            if ( g in picked ) continue
+            picked[g] = 1
+            members[g] = members[g] "memberUid: user" u "\n"
+            size[g]++
+            total++
+        }
+    }
+    for ( g = 0; g < groups; g++ ) {
+        printf "dn: cn=group%d,ou=Groups,%s\nobjectClass: posixGroup\ncn: group%d\ngidNumber: %d\n%s\n", g, base, g, 20000 + g, members[g]
+        if ( size[g] > largest ) largest = size[g]
+        if ( size[g] == 0 ) empty++
+    }
+    printf "  %d memberships, largest group %d, %d empty group(s)\n", total, largest, empty > "/dev/stderr"
+}' > "$LDIF" || exit 1
+
+#
+# One configuration per mode, over the same database:
+#
+write_conf() {
+    cat > "$2" <<EOF
+include         $SCHEMADIR/core.schema
+include         $SCHEMADIR/cosine.schema
+include         $SCHEMADIR/inetorgperson.schema
+include         $SCHEMADIR/nis.schema
+pidfile         $SCALEDIR/slapd.pid
+argsfile        $SCALEDIR/slapd.args
+moduleload      $MODULE
+threads         `expr $CLIENTS + 8`
+sizelimit       unlimited
+
+database        mdb
+suffix          "$BASEDN"
+rootdn          "$MANAGERDN"
+rootpw          $PASSWD
+directory       $SCALEDIR/db
+maxsize         4294967296
+index           objectClass eq
+index           uid,cn,memberUid eq
+EOF
+    if test "$1" = automember ; then
+        cat >> "$2" <<EOF
+
+overlay automember
+automember-member-objectclass posixGroup
+automember-memberof-objectclass inetOrgPerson
+automember-synth-template uid={},ou=People,$BASEDN
+automember-group-base ou=Groups,$BASEDN one
+EOF
+        if test -n "$AUTOMEMBER_CONF" ; then
+            cat "$AUTOMEMBER_CONF" >> "$2" || exit 1
+        fi
+    fi
+}
+
+write_conf plain "$SCALEDIR/plain.conf"
+write_conf automember "$SCALEDIR/automember.conf"
+
+echo "Loading the database..."
+"$SLAPD" -T add -q -f "$SCALEDIR/plain.conf" -l "$LDIF" || exit 1
+
+run() {
+    "$DRIVER" -H "$URI" -D "$MANAGERDN" -w "$PASSWD" "$@"
+}
+
+for MODE in plain automember ; do
+    echo "Starting slapd ($MODE)..."
+    "$SLAPD" -f "$SCALEDIR/$MODE.conf" -h "$URI" -d 0 > "$SCALEDIR/slapd.$MODE.log" 2>&1 &
+    PID=$!
+    UP=no
+    for i in 0 1 2 3 4 5 6 7 8 9 ; do
+        sleep 1
+        "$LDAPSEARCH" -x -LLL -H "$URI" -s base -b "" 1.1 > /dev/null 2>&1 && UP=yes && break
+    done
+    if test $UP = no ; then
+        echo "automember_scale: slapd did not start, see $SCALEDIR/slapd.$MODE.log"
+        kill -HUP $PID
+        exit 1
+    fi
+
+    # Bring the database into the page cache before anything is timed:
+    run -t warmup -b "$BASEDN" -s sub -a memberUid -n 1 > /dev/null
+
+    RC=0
+    for C in 1 $CLIENTS ; do
+        run -t "$MODE/group-member" -c $C -n $OPS -r $NGROUPS \
+            -b "cn=group%d,ou=Groups,$BASEDN" -s base -a member || RC=1
+        run -t "$MODE/person-memberof" -c $C -n $OPS -r $NUSERS \
+            -b "ou=People,$BASEDN" -s one -f "(uid=user%d)" -a memberOf || RC=1
+    done
+    run -t "$MODE/enumerate-groups" -n $ENUMS \
+        -b "ou=Groups,$BASEDN" -s one -f "(objectClass=posixGroup)" -a member || RC=1
+    run -t "$MODE/enumerate-people" -n $ENUMS \
+        -b "ou=People,$BASEDN" -s one -f "(objectClass=inetOrgPerson)" -a memberOf || RC=1
+
+    kill -HUP $PID
+    wait $PID
+    if test $RC != 0 ; then
+        echo "automember_scale: searches failed, see $SCALEDIR/slapd.$MODE.log"
+        exit $RC
+    fi
+done
+
+exit 0